@@ -0,0 +1,200 @@
+//////////////////////////////////////
+// CacaoLang Embedding API
+// g++ -c choco_embed.cpp -std=c++17 -pthread
+//////////////////////////////////////
+
+// The interpreter is built in embedded mode: no main(), no GUI.
+#define CHOCO_EMBEDDED_MODE
+#define CHOCO_NO_GUI
+#include "main.cpp"
+#include "choco_embed.h"
+
+namespace {
+
+// Runs `body`, rethrowing interpreter errors as choco::ScriptError.
+template <typename F>
+auto translateErrors(F&& body) -> decltype(body()) {
+    try {
+        return body();
+    } catch (const ResourceLimitError& e) {
+        throw choco::LimitExceeded(e.what(), e.line);
+    } catch (const LexerError& e) {
+        throw choco::ScriptError(e.what(), e.line);
+    } catch (const ParseError& e) {
+        throw choco::ScriptError(e.what(), e.line);
+    } catch (const RuntimeError& e) {
+        throw choco::ScriptError(e.what(), e.line);
+    }
+}
+
+// Runs `body` with `interp`'s heap account active, reporting a hit heap
+// limit as a runtime error. The thread counts as running script code
+// meanwhile, so the cycle collector leaves shared objects alone.
+template <typename F>
+auto accounted(Interpreter& interp, F&& body) -> decltype(body()) {
+    ScriptThreadScope scriptThread;
+    HeapAccountScope accountScope(interp.heap.get());
+    try {
+        return body();
+    } catch (const HeapLimitError&) {
+        throw interp.heapLimitError();
+    }
+}
+
+HostFunction adaptBuiltin(choco::Builtin fn) {
+    return [fn](Interpreter&, const std::vector<Value>& args, int line) -> Value {
+        try {
+            return fn(args);
+        } catch (const RuntimeError&) {
+            throw;
+        } catch (const std::exception& e) {
+            throw RuntimeError(e.what(), line);
+        }
+    };
+}
+
+// Gives a context the program's globals. Builders are shared by
+// reference, so each context gets its own.
+void copyGlobals(Interpreter& interp, const Interpreter& prototype) {
+    interp.scopes[0] = prototype.scopes[0];
+    for (auto& global : interp.scopes[0]) {
+        detachBuilders(global.second);
+    }
+}
+
+// After an error the interpreter may be left mid-call; drop the call
+// frames and control flags so the next call starts clean.
+void unwind(Interpreter& interp, const TokenStream& program) {
+    interp.tokens = program;
+    interp.scopes.resize(1);
+    interp.captureLayers.resize(1);
+    interp.current = interp.tokens.size();
+    interp.inFunction = false;
+    interp.inLoop = false;
+    interp.hasReturned = false;
+    interp.returnValue = Value();
+    interp.shouldBreak = false;
+    interp.shouldContinue = false;
+    interp.inTryCatch = false;
+    interp.currentException.clear();
+}
+
+}
+
+namespace choco {
+
+Program::Program() {}
+Program::~Program() {
+    ScriptThreadScope scriptThread;
+    prototype.reset();
+}
+
+std::shared_ptr<const Program> Program::compile(const std::string& source, const BuiltinTable& builtins) {
+    std::shared_ptr<Program> program(new Program());
+    translateErrors([&] {
+        Lexer lexer(source);
+        // Hosts can change globals between calls, so lets are not propagated.
+        program->prototype = std::make_unique<Interpreter>(
+            TokenStream(Interpreter::optimizeTokens(lexer.tokenize(), false)));
+        Interpreter& interp = *program->prototype;
+        for (const auto& builtin : builtins) {
+            interp.registerBuiltin(builtin.first, adaptBuiltin(builtin.second));
+        }
+        return accounted(interp, [&] {
+            while (!interp.isAtEnd()) {
+                interp.statement();
+            }
+#ifdef CHOCO_HAS_EVENT_LOOP
+            interp.drainEventLoop();
+#endif
+            return 0;
+        });
+    });
+    return program;
+}
+
+std::shared_ptr<const Program> Program::load(const std::string& path, const BuiltinTable& builtins) {
+    std::ifstream file(path);
+    if (!file) {
+        throw ScriptError("Cannot open file '" + path + "'", 0);
+    }
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    return compile(buffer.str(), builtins);
+}
+
+bool Program::hasFunction(const std::string& name) const {
+    return prototype->functions.find(name) != prototype->functions.end();
+}
+
+Context::Context(std::shared_ptr<const Program> prog)
+    : program(std::move(prog)), interpreter(program->prototype->makeIsolate()) {
+    // Contexts are metered separately, not against the program's account.
+    interpreter->heap = HeapAccountRef();
+    HeapAccountScope accountScope(interpreter->heap.get());
+    copyGlobals(*interpreter, *program->prototype);
+    interpreter->current = interpreter->tokens.size();
+}
+
+Context::~Context() {
+    ScriptThreadScope scriptThread;
+    interpreter.reset();
+}
+
+Value Context::call(const std::string& name, const std::vector<Value>& args) {
+    try {
+        return translateErrors([&] {
+            return accounted(*interpreter, [&] {
+                Value result = interpreter->callFunction(name, args, 0);
+                result = interpreter->awaitValue(result, 0);
+#ifdef CHOCO_HAS_EVENT_LOOP
+                interpreter->drainEventLoop();
+#endif
+                return result;
+            });
+        });
+    } catch (...) {
+        ScriptThreadScope scriptThread;
+        unwind(*interpreter, program->prototype->tokens);
+        throw;
+    }
+}
+
+Value Context::global(const std::string& name) const {
+    const auto& globals = interpreter->scopes[0];
+    auto it = globals.find(name);
+    if (it == globals.end()) {
+        throw ScriptError("Undefined variable '" + name + "'", 0);
+    }
+    return it->second;
+}
+
+void Context::setGlobal(const std::string& name, const Value& value) {
+    ScriptThreadScope scriptThread;
+    interpreter->scopes[0][name] = value;
+}
+
+void Context::reset() {
+    ScriptThreadScope scriptThread;
+    HeapAccountScope accountScope(interpreter->heap.get());
+    copyGlobals(*interpreter, *program->prototype);
+}
+
+void Context::registerBuiltin(const std::string& name, Builtin fn) {
+    interpreter->registerBuiltin(name, adaptBuiltin(std::move(fn)));
+}
+
+void Context::setOutput(std::ostream& stream) { interpreter->setOutput(stream); }
+void Context::setErrorOutput(std::ostream& stream) { interpreter->setErrorOutput(stream); }
+void Context::setInput(std::istream& stream) { interpreter->setInput(stream); }
+void Context::seedRandom(uint64_t seed) { interpreter->seedRandom(seed); }
+void Context::setFuel(uint64_t units) { interpreter->setFuel(units); }
+void Context::setTimeout(std::chrono::milliseconds budget) { interpreter->setDeadline(budget); }
+void Context::clearLimits() { interpreter->clearLimits(); }
+uint64_t Context::remainingFuel() const { return interpreter->remainingFuel(); }
+void Context::setHeapLimit(size_t bytes) { interpreter->setHeapLimit(bytes); }
+size_t Context::heapLiveBytes() const { return interpreter->heapStats().liveBytes; }
+size_t Context::heapPeakBytes() const { return interpreter->heapStats().peakBytes; }
+uint64_t Context::heapAllocations() const { return interpreter->heapStats().allocations; }
+
+}
@@ -0,0 +1,126 @@
+//////////////////////////////////////
+// CacaoLang Embedding API
+// Run Choco scripts inside a C++ host
+//////////////////////////////////////
+//
+// Compile a script once, then create a Context per request (or per
+// thread) and call its functions:
+//
+//   auto program = choco::Program::compile(source);
+//   choco::Context ctx(program);
+//   ctx.registerBuiltin("lookup", [](const std::vector<Value>& args) { ... });
+//   Value verdict = ctx.call("check", {Value(42.0)});
+//
+// Link against choco_embed.cpp:
+//   g++ -c choco_embed.cpp -std=c++17 -pthread
+// The library leaves the global operator new alone. To get per-context
+// heap limits and counters, or the small-block pool, replace it by adding
+// -DCHOCO_HEAP_ACCOUNTING and/or -DCHOCO_SMALL_BLOCK_POOL; a host that
+// links its own allocator should leave both off.
+
+#ifndef CHOCO_EMBED_H
+#define CHOCO_EMBED_H
+
+#include "choco_value.h"
+#include <functional>
+#include <iosfwd>
+#include <stdexcept>
+#include <cstdint>
+#include <chrono>
+
+class Interpreter;
+
+namespace choco {
+
+// A lexer, parse or runtime error raised by a script.
+class ScriptError : public std::runtime_error {
+public:
+    int line;
+    ScriptError(const std::string& msg, int line_num)
+        : std::runtime_error(msg), line(line_num) {}
+};
+
+// A call ran out of fuel or past its deadline (see Context::setFuel).
+class LimitExceeded : public ScriptError {
+public:
+    LimitExceeded(const std::string& msg, int line_num) : ScriptError(msg, line_num) {}
+};
+
+// A host function callable from scripts. Throwing any std::exception
+// turns into a script runtime error at the call site.
+typedef std::function<Value(const std::vector<Value>& args)> Builtin;
+typedef std::unordered_map<std::string, Builtin> BuiltinTable;
+
+// An immutable compiled script: its tokens plus the functions, structs and
+// globals left behind by running the top level once. A Program may be
+// shared by any number of Contexts on any number of threads.
+class Program {
+public:
+    // Lexes and runs the top level of `source`. `builtins` are visible to
+    // the top level and are registered in every Context created later.
+    static std::shared_ptr<const Program> compile(const std::string& source,
+                                                  const BuiltinTable& builtins = BuiltinTable());
+    static std::shared_ptr<const Program> load(const std::string& path,
+                                               const BuiltinTable& builtins = BuiltinTable());
+
+    bool hasFunction(const std::string& name) const;
+    ~Program();
+
+private:
+    Program();
+    std::unique_ptr<Interpreter> prototype;
+    friend class Context;
+};
+
+// One execution context of a Program: its own globals, scopes, RNG, I/O
+// streams and host builtins. Creating one copies no tokens. A Context is
+// not thread-safe; use one per thread.
+class Context {
+public:
+    explicit Context(std::shared_ptr<const Program> program);
+    ~Context();
+
+    Context(const Context&) = delete;
+    Context& operator=(const Context&) = delete;
+
+    // Calls a script function (or builtin) by name. Async functions are
+    // awaited before returning. Errors are thrown as ScriptError and leave
+    // the context usable for the next call.
+    Value call(const std::string& name, const std::vector<Value>& args = std::vector<Value>());
+
+    Value global(const std::string& name) const;
+    void setGlobal(const std::string& name, const Value& value);
+
+    // Restores the globals the Program started with.
+    void reset();
+
+    void registerBuiltin(const std::string& name, Builtin fn);
+    void setOutput(std::ostream& stream);
+    void setErrorOutput(std::ostream& stream);
+    void setInput(std::istream& stream);
+    void seedRandom(uint64_t seed);
+
+    // Bounds later calls: fuel is charged one unit per loop iteration and
+    // per function call, the deadline counts from now. Once exceeded, every
+    // call throws LimitExceeded until new limits are set or cleared.
+    void setFuel(uint64_t units);
+    void setTimeout(std::chrono::milliseconds budget);
+    void clearLimits();
+    uint64_t remainingFuel() const;
+
+    // Caps the bytes live in this context's heap account (0 removes the
+    // cap). Exceeding it makes the call throw ScriptError. Only enforced,
+    // and counters only nonzero, when built with CHOCO_HEAP_ACCOUNTING.
+    void setHeapLimit(size_t bytes);
+    size_t heapLiveBytes() const;
+    size_t heapPeakBytes() const;
+    uint64_t heapAllocations() const;
+
+private:
+    std::shared_ptr<const Program> program;
+    std::unique_ptr<Interpreter> interpreter;
+};
+
+}
+
+#endif
@@ -4,81 +4,9 @@
 //////////////////////////////////////
 
 #include "choco_gui.h"
+#include "choco_value.h"
 #include <iostream>
 
-struct Value {
-    enum Type { NUMBER, STRING, BOOL, ARRAY, STRUCT, LAMBDA, NIL } type;
-    double num;
-    std::string str;
-    bool boolean;
-    std::vector<Value> array;
-    std::unordered_map<std::string, Value> structFields;
-    std::string structType;
-    
-    std::vector<std::string> lambdaParams;
-    size_t lambdaBodyStart;
-    size_t lambdaBodyEnd;
-    std::unordered_map<std::string, Value> closureCaptures;
-
-    Value() : type(NIL), num(0), boolean(false), lambdaBodyStart(0), lambdaBodyEnd(0) {}
-    Value(double n) : type(NUMBER), num(n), boolean(false), lambdaBodyStart(0), lambdaBodyEnd(0) {}
-    Value(const std::string& s) : type(STRING), str(s), num(0), boolean(false), lambdaBodyStart(0), lambdaBodyEnd(0) {}
-    Value(bool b) : type(BOOL), num(0), boolean(b), lambdaBodyStart(0), lambdaBodyEnd(0) {}
-    Value(const std::vector<Value>& arr) : type(ARRAY), num(0), boolean(false), array(arr), lambdaBodyStart(0), lambdaBodyEnd(0) {}
-
-    std::string toString() const {
-        switch (type) {
-            case NUMBER: {
-                if (num == static_cast<int>(num)) {
-                    return std::to_string(static_cast<int>(num));
-                }
-                std::string s = std::to_string(num);
-                s.erase(s.find_last_not_of('0') + 1, std::string::npos);
-                if (s.back() == '.') s.pop_back();
-                return s;
-            }
-            case STRING: return str;
-            case BOOL: return boolean ? "true" : "false";
-            case ARRAY: {
-                std::string result = "[";
-                for (size_t i = 0; i < array.size(); i++) {
-                    result += array[i].toString();
-                    if (i < array.size() - 1) result += ", ";
-                }
-                result += "]";
-                return result;
-            }
-            case STRUCT: {
-                std::string result = structType + " { ";
-                bool first = true;
-                for (const auto& field : structFields) {
-                    if (!first) result += ", ";
-                    result += field.first + ": " + field.second.toString();
-                    first = false;
-                }
-                result += " }";
-                return result;
-            }
-            case LAMBDA: return "<lambda>";
-            case NIL: return "nil";
-        }
-        return "";
-    }
-    
-    std::string getType() const {
-        switch (type) {
-            case NUMBER: return "number";
-            case STRING: return "string";
-            case BOOL: return "bool";
-            case ARRAY: return "array";
-            case STRUCT: return structType.empty() ? "struct" : structType;
-            case LAMBDA: return "lambda";
-            case NIL: return "nil";
-        }
-        return "unknown";
-    }
-};
-
 class RuntimeError : public std::runtime_error {
 public:
     int line;
@@ -0,0 +1,131 @@
+//////////////////////////////////////
+// CacaoLang Value type
+// Shared by the interpreter, the GUI
+// bindings and the embedding API
+//////////////////////////////////////
+
+#ifndef CHOCO_VALUE_H
+#define CHOCO_VALUE_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <cstdint>
+
+struct IteratorState;
+struct TaskState;
+class Channel;
+struct MapTable;
+
+// Renders a map value; defined with MapTable in the interpreter.
+std::string mapToString(const MapTable& map);
+
+struct Value {
+    enum Type { NUMBER, STRING, BOOL, ARRAY, STRUCT, LAMBDA, ITERATOR, TASK, CHANNEL, MAP, FLOATS, BUILDER, NIL } type;
+    // Integers past +-2^53, which `num` can only approximate, are `wide`:
+    // `integer` holds them exactly. Below that `num` is exact on its own.
+    bool wide;
+    double num;
+    int64_t integer;
+    std::string str;
+    bool boolean;
+    std::vector<Value> array;
+    std::unordered_map<std::string, Value> structFields;
+    std::string structType;
+    
+    std::vector<std::string> lambdaParams;
+    size_t lambdaBodyStart;
+    size_t lambdaBodyEnd;
+    std::unordered_map<std::string, Value> closureCaptures;
+    std::shared_ptr<IteratorState> iterator;
+    std::shared_ptr<TaskState> task;
+    std::shared_ptr<Channel> channel;
+    std::shared_ptr<MapTable> map;  // shared copy-on-write
+    std::shared_ptr<std::vector<double>> floats;  // packed numbers, shared copy-on-write
+    std::shared_ptr<std::string> builder;  // string builder, shared by reference
+
+    Value() : type(NIL), wide(false), num(0), integer(0), boolean(false), lambdaBodyStart(0), lambdaBodyEnd(0) {}
+    Value(double n) : type(NUMBER), wide(false), num(n), integer(0), boolean(false), lambdaBodyStart(0), lambdaBodyEnd(0) {}
+    Value(int64_t i) : type(NUMBER), wide(i > WIDE_THRESHOLD || i < -WIDE_THRESHOLD),
+                       num(static_cast<double>(i)), integer(i), boolean(false), lambdaBodyStart(0), lambdaBodyEnd(0) {}
+    Value(const std::string& s) : type(STRING), wide(false), num(0), integer(0), str(s), boolean(false), lambdaBodyStart(0), lambdaBodyEnd(0) {}
+    Value(bool b) : type(BOOL), wide(false), num(0), integer(0), boolean(b), lambdaBodyStart(0), lambdaBodyEnd(0) {}
+    Value(const std::vector<Value>& arr) : type(ARRAY), wide(false), num(0), integer(0), boolean(false), array(arr), lambdaBodyStart(0), lambdaBodyEnd(0) {}
+
+    static const int64_t WIDE_THRESHOLD = int64_t(1) << 53;
+
+    std::string toString() const {
+        switch (type) {
+            case NUMBER: {
+                if (wide) return std::to_string(integer);
+                if (num > -9.2e18 && num < 9.2e18 && num == static_cast<int64_t>(num)) {
+                    return std::to_string(static_cast<int64_t>(num));
+                }
+                std::string s = std::to_string(num);
+                s.erase(s.find_last_not_of('0') + 1, std::string::npos);
+                if (s.back() == '.') s.pop_back();
+                return s;
+            }
+            case STRING: return str;
+            case BOOL: return boolean ? "true" : "false";
+            case ARRAY: {
+                std::string result = "[";
+                for (size_t i = 0; i < array.size(); i++) {
+                    result += array[i].toString();
+                    if (i < array.size() - 1) result += ", ";
+                }
+                result += "]";
+                return result;
+            }
+            case STRUCT: {
+                std::string result = structType + " { ";
+                bool first = true;
+                for (const auto& field : structFields) {
+                    if (!first) result += ", ";
+                    result += field.first + ": " + field.second.toString();
+                    first = false;
+                }
+                result += " }";
+                return result;
+            }
+            case LAMBDA: return "<lambda>";
+            case ITERATOR: return "<iterator>";
+            case TASK: return "<task>";
+            case CHANNEL: return "<channel>";
+            case MAP: return mapToString(*map);
+            case FLOATS: {
+                std::string result = "[";
+                for (size_t i = 0; i < floats->size(); i++) {
+                    if (i > 0) result += ", ";
+                    result += Value((*floats)[i]).toString();
+                }
+                return result + "]";
+            }
+            case BUILDER: return *builder;
+            case NIL: return "nil";
+        }
+        return "";
+    }
+    
+    std::string getType() const {
+        switch (type) {
+            case NUMBER: return "number";
+            case STRING: return "string";
+            case BOOL: return "bool";
+            case ARRAY: return "array";
+            case STRUCT: return structType.empty() ? "struct" : structType;
+            case LAMBDA: return "lambda";
+            case ITERATOR: return "iterator";
+            case TASK: return "task";
+            case CHANNEL: return "channel";
+            case MAP: return "map";
+            case FLOATS: return "floats";
+            case BUILDER: return "builder";
+            case NIL: return "nil";
+        }
+        return "unknown";
+    }
+};
+
+#endif
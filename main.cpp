@@ -3,7 +3,7 @@
 // CoffeeShop Development              ||
 // Made by Camila "Mocha" Rose         ||
 // g++ -o cocoa main.cpp choco_gui.cpp ||
-// $(pkg-config --cflags --libs gtk4) -std=c++17 
+// $(pkg-config --cflags --libs gtk4) -std=c++17 -pthread
 //=====================================||
 
 #include <iostream>
@@ -11,6 +11,7 @@
 #include <vector>
 #include <map>
 #include <unordered_map>
+#include <unordered_set>
 #include <memory>
 #include <fstream>
 #include <sstream>
@@ -21,6 +22,39 @@
 #include <ctime>
 #include <cstdlib>
 #include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <random>
+#include <cstdint>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <new>
+#include "choco_value.h"
+#if defined(__linux__)
+    #include <ucontext.h>
+    #include <sys/epoll.h>
+    #include <sys/timerfd.h>
+    #include <sys/eventfd.h>
+    #include <sys/mman.h>
+    #include <sys/wait.h>
+    #include <unistd.h>
+    #include <fcntl.h>
+    #include <sys/stat.h>
+    #include <sys/resource.h>
+    #define CHOCO_HAS_EVENT_LOOP
+    #define CHOCO_HAS_MMAP
+    #if defined(__x86_64__) && !defined(CHOCO_NO_JIT)
+        #define CHOCO_HAS_JIT
+    #endif
+#endif
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(CHOCO_NO_THREADED_DISPATCH)
+    #define CHOCO_THREADED_DISPATCH
+#endif
 #ifndef CHOCO_NO_GUI
     #include "choco_gui.h"
 #else
@@ -117,6 +151,8 @@ bool compileChocoFile(const std::string& inputFile, const std::string& outputNam
     
     // Define these BEFORE including main.cpp
     output << "#define CHOCO_EMBEDDED_MODE\n";
+    // The compiled program owns its process, so it keeps the allocation pool.
+    output << "#define CHOCO_SMALL_BLOCK_POOL\n";
     if (!useGUI) {
         output << "#define CHOCO_NO_GUI\n";
     }
@@ -139,7 +175,7 @@ bool compileChocoFile(const std::string& inputFile, const std::string& outputNam
     
     output << "    try {\n";
     output << "        Lexer lexer(EMBEDDED_SOURCE);\n";
-    output << "        std::vector<Token> tokens = lexer.tokenize();\n";
+    output << "        std::vector<Token> tokens = Interpreter::optimizeTokens(lexer.tokenize());\n";
     output << "        Interpreter interpreter(tokens);\n";
     
     if (useGUI) {
@@ -232,7 +268,7 @@ bool compileChocoFile(const std::string& inputFile, const std::string& outputNam
         }
     }
     
-    compileCmd << "-std=c++17 2>&1";
+    compileCmd << "-std=c++17 -pthread 2>&1";
     
     std::cout << "Invoking C++ compiler..." << std::endl;
     
@@ -277,7 +313,7 @@ enum TokenType {
     TOKEN_AND, TOKEN_OR, TOKEN_BANG,
     TOKEN_LPAREN, TOKEN_RPAREN, TOKEN_LBRACE, TOKEN_RBRACE, TOKEN_LBRACKET, TOKEN_RBRACKET,
     TOKEN_COMMA, TOKEN_SEMICOLON, TOKEN_ARROW, TOKEN_DOT, TOKEN_DOTDOT, TOKEN_COLON,
-    TOKEN_PIPE
+    TOKEN_PIPE, TOKEN_AMPERSAND, TOKEN_CARET, TOKEN_TILDE, TOKEN_LESS_LESS, TOKEN_GREATER_GREATER
 };
 
 struct Token {
@@ -286,6 +322,73 @@ struct Token {
     int line;
 };
 
+// Operand types seen at a binary operator, recorded per token so hot
+// sites can take a specialized path. A site only ever moves from unseen to
+// one kind and from there to mixed.
+enum OperandFeedback : uint8_t {
+    OPERANDS_UNSEEN, OPERANDS_NUMBERS, OPERANDS_STRINGS, OPERANDS_BOOLS, OPERANDS_MIXED
+};
+
+// Immutable, shared token storage. Copying a TokenStream only bumps a
+// reference count, so several interpreter contexts can run the same program.
+// Alongside the tokens it keeps number literals parsed once and the operand
+// feedback of each operator site. Feedback is only a hint, shared by every
+// context running the stream, so it is kept in relaxed atomics.
+class TokenStream {
+    struct Storage {
+        std::vector<Token> tokens;
+        std::vector<double> numbers;
+        std::unique_ptr<std::atomic<uint8_t>[]> feedback;
+        uint64_t id;
+
+        explicit Storage(std::vector<Token> toks)
+            : tokens(std::move(toks)), numbers(tokens.size()),
+              feedback(new std::atomic<uint8_t>[tokens.size()]), id(nextId()) {
+            for (size_t i = 0; i < tokens.size(); i++) {
+                if (tokens[i].type == TOKEN_NUMBER) numbers[i] = std::strtod(tokens[i].value.c_str(), nullptr);
+                feedback[i].store(OPERANDS_UNSEEN, std::memory_order_relaxed);
+            }
+        }
+
+        static uint64_t nextId() {
+            static std::atomic<uint64_t> counter(0);
+            return ++counter;
+        }
+    };
+
+    std::shared_ptr<const Storage> storage;
+    const Token* first;
+    size_t count;
+
+public:
+    TokenStream() : first(nullptr), count(0) {}
+    TokenStream(std::vector<Token> toks)
+        : storage(std::make_shared<const Storage>(std::move(toks))),
+          first(storage->tokens.data()), count(storage->tokens.size()) {}
+    TokenStream(const TokenStream&) = default;
+    TokenStream& operator=(const TokenStream&) = default;
+
+    inline const Token& operator[](size_t i) const { return first[i]; }
+    inline size_t size() const { return count; }
+    inline bool empty() const { return count == 0; }
+    inline const Token& back() const { return first[count - 1]; }
+    inline const Token* data() const { return first; }
+    // Distinct for every stream ever built, never 0; a stream's copies share it.
+    inline uint64_t id() const { return storage ? storage->id : 0; }
+
+    // The value of the number literal at i.
+    inline double number(size_t i) const { return storage->numbers[i]; }
+
+    inline OperandFeedback feedback(size_t i) const {
+        return static_cast<OperandFeedback>(storage->feedback[i].load(std::memory_order_relaxed));
+    }
+    inline void recordOperands(size_t i, OperandFeedback seen) const {
+        OperandFeedback known = feedback(i);
+        if (known == seen || known == OPERANDS_MIXED) return;
+        storage->feedback[i].store(known == OPERANDS_UNSEEN ? seen : OPERANDS_MIXED, std::memory_order_relaxed);
+    }
+};
+
 class RuntimeError : public std::runtime_error {
 public:
     int line;
@@ -293,6 +396,22 @@ public:
         : std::runtime_error(msg), line(line_num) {}
 };
 
+// A script-level `throw` that escaped every try block. Async tasks keep the
+// thrown message so an `await` inside try/catch can catch it again.
+class ThrownError : public RuntimeError {
+public:
+    std::string message;
+    ThrownError(const std::string& msg, int line_num)
+        : RuntimeError("Uncaught exception: " + msg, line_num), message(msg) {}
+};
+
+// Raised when an Interpreter runs out of fuel or past its deadline. It is
+// never delivered to script try/catch, only to the host.
+class ResourceLimitError : public RuntimeError {
+public:
+    ResourceLimitError(const std::string& msg, int line_num) : RuntimeError(msg, line_num) {}
+};
+
 class ParseError : public std::runtime_error {
 public:
     int line;
@@ -300,6 +419,253 @@ public:
         : std::runtime_error(msg), line(line_num) {}
 };
 
+// Heap accounting. Every allocation made through operator new carries a
+// small header naming the HeapAccount that was active on the allocating
+// thread, so the bytes are credited back to the right account no matter
+// which thread frees them. An Interpreter activates its account while it
+// runs; allocations made with no account active are not counted.
+//
+// Replacing operator new is opt-in for library builds, since a host may
+// link its own allocator. Two switches control it:
+//   CHOCO_HEAP_ACCOUNTING   per-interpreter byte counts and heap limits
+//   CHOCO_SMALL_BLOCK_POOL  per-thread free lists for small blocks
+// The CLI turns both on unless built with CHOCO_NO_HEAP_ACCOUNTING or
+// CHOCO_SYSTEM_MALLOC; CHOCO_EMBEDDED_MODE builds get neither by default.
+#ifndef CHOCO_EMBEDDED_MODE
+#if !defined(CHOCO_NO_HEAP_ACCOUNTING) && !defined(CHOCO_HEAP_ACCOUNTING)
+#define CHOCO_HEAP_ACCOUNTING
+#endif
+#if !defined(CHOCO_SYSTEM_MALLOC) && !defined(CHOCO_SMALL_BLOCK_POOL)
+#define CHOCO_SMALL_BLOCK_POOL
+#endif
+#endif
+struct HeapStats {
+    size_t liveBytes = 0;
+    size_t peakBytes = 0;
+    size_t limitBytes = 0;  // 0 means unlimited
+    uint64_t allocations = 0;
+};
+
+// Thrown by operator new when an allocation would push an account over
+// its limit. Interpreter entry points turn it into a RuntimeError.
+class HeapLimitError : public std::bad_alloc {
+public:
+    const char* what() const noexcept override { return "Heap limit exceeded"; }
+};
+
+class HeapAccount {
+    // One reference per owning Interpreter plus one per live block, so an
+    // account outlives the last value allocated from it.
+    std::atomic<size_t> refs{1};
+    std::atomic<size_t> live{0};
+    std::atomic<size_t> peak{0};
+    std::atomic<uint64_t> allocations{0};
+    std::atomic<size_t> limit{0};
+    std::atomic<bool> tripped{false};
+
+public:
+    static HeapAccount* create() {
+        void* memory = std::malloc(sizeof(HeapAccount));
+        if (!memory) throw std::bad_alloc();
+        return new (memory) HeapAccount();
+    }
+
+    void retain() { refs.fetch_add(1, std::memory_order_relaxed); }
+
+    void release() {
+        if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            this->~HeapAccount();
+            std::free(this);
+        }
+    }
+
+    // Returns false when the allocation would exceed the limit. Once the
+    // limit has tripped, allocations are let through so that the error can
+    // be reported and the stack unwound; rearm() restores enforcement.
+    bool charge(size_t bytes) {
+        size_t cap = limit.load(std::memory_order_relaxed);
+        size_t now = live.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+        if (cap != 0 && now > cap && !tripped.exchange(true, std::memory_order_relaxed)) {
+            live.fetch_sub(bytes, std::memory_order_relaxed);
+            return false;
+        }
+        size_t seen = peak.load(std::memory_order_relaxed);
+        while (now > seen && !peak.compare_exchange_weak(seen, now, std::memory_order_relaxed)) {}
+        allocations.fetch_add(1, std::memory_order_relaxed);
+        refs.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    void credit(size_t bytes) {
+        live.fetch_sub(bytes, std::memory_order_relaxed);
+        release();
+    }
+
+    void setLimit(size_t bytes) {
+        limit.store(bytes, std::memory_order_relaxed);
+        rearm();
+    }
+
+    void rearm() { tripped.store(false, std::memory_order_relaxed); }
+
+    HeapStats stats() const {
+        HeapStats s;
+        s.liveBytes = live.load(std::memory_order_relaxed);
+        s.peakBytes = peak.load(std::memory_order_relaxed);
+        s.limitBytes = limit.load(std::memory_order_relaxed);
+        s.allocations = allocations.load(std::memory_order_relaxed);
+        return s;
+    }
+};
+
+thread_local HeapAccount* activeHeapAccount = nullptr;
+
+// Makes `account` the one charged by this thread until the scope ends.
+class HeapAccountScope {
+    HeapAccount* saved;
+
+public:
+    explicit HeapAccountScope(HeapAccount* account) : saved(activeHeapAccount) { activeHeapAccount = account; }
+    ~HeapAccountScope() { activeHeapAccount = saved; }
+    HeapAccountScope(const HeapAccountScope&) = delete;
+    HeapAccountScope& operator=(const HeapAccountScope&) = delete;
+};
+
+// Shared ownership of a HeapAccount, held by Interpreters.
+class HeapAccountRef {
+    HeapAccount* account;
+
+public:
+    HeapAccountRef() : account(HeapAccount::create()) {}
+    HeapAccountRef(const HeapAccountRef& other) : account(other.account) { account->retain(); }
+    HeapAccountRef& operator=(HeapAccountRef other) {
+        std::swap(account, other.account);
+        return *this;
+    }
+    ~HeapAccountRef() { account->release(); }
+
+    HeapAccount* get() const { return account; }
+    HeapAccount* operator->() const { return account; }
+};
+
+#if defined(CHOCO_HEAP_ACCOUNTING) || defined(CHOCO_SMALL_BLOCK_POOL)
+// Every block records its size (for the pool) and the account it was
+// charged to, which stays null when accounting is off.
+struct alignas(16) HeapBlockHeader {
+    HeapAccount* account;
+    size_t size;
+};
+
+#ifdef CHOCO_SMALL_BLOCK_POOL
+// Per-thread free lists of blocks up to 2 KiB, one per 16-byte size class.
+// Freed blocks are kept for reuse rather than handed back to malloc; a
+// Value is a few hundred bytes, so scope nodes, argument vectors and
+// temporaries all land here and steady-state calls stop calling malloc.
+// A thread keeps at most MAX_CACHED_BYTES this way, so idle pool workers
+// and host threads do not hold on to a burst's worth of blocks.
+struct SmallBlockCache {
+    static const size_t GRANULE = 16;
+    static const size_t CLASS_COUNT = 128;
+    static const uint32_t MAX_CACHED = 512;
+    static const size_t MAX_CACHED_BYTES = 4 << 20;
+
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    FreeBlock* heads[CLASS_COUNT];
+    uint32_t counts[CLASS_COUNT];
+    size_t cachedBytes;
+    bool closed;
+
+    static size_t classOf(size_t size) { return size == 0 ? 0 : (size - 1) / GRANULE; }
+    static size_t blockBytes(size_t cls) { return sizeof(HeapBlockHeader) + (cls + 1) * GRANULE; }
+};
+
+// Trivially destructible, so it stays usable while other thread_locals are
+// being destroyed; the owner below empties it and closes it at thread exit.
+thread_local SmallBlockCache smallBlocks = {};
+
+struct SmallBlockCacheOwner {
+    ~SmallBlockCacheOwner() {
+        for (size_t cls = 0; cls < SmallBlockCache::CLASS_COUNT; cls++) {
+            while (SmallBlockCache::FreeBlock* block = smallBlocks.heads[cls]) {
+                smallBlocks.heads[cls] = block->next;
+                std::free(block);
+            }
+            smallBlocks.counts[cls] = 0;
+        }
+        smallBlocks.cachedBytes = 0;
+        smallBlocks.closed = true;
+    }
+};
+thread_local SmallBlockCacheOwner smallBlockOwner;
+#endif
+
+static void* accountedAlloc(size_t size) {
+#ifdef CHOCO_HEAP_ACCOUNTING
+    HeapAccount* account = activeHeapAccount;
+    if (account && !account->charge(size)) throw HeapLimitError();
+#else
+    HeapAccount* account = nullptr;
+#endif
+    void* memory = nullptr;
+#ifdef CHOCO_SMALL_BLOCK_POOL
+    size_t cls = SmallBlockCache::classOf(size);
+    if (cls < SmallBlockCache::CLASS_COUNT) {
+        if (SmallBlockCache::FreeBlock* block = smallBlocks.heads[cls]) {
+            smallBlocks.heads[cls] = block->next;
+            smallBlocks.counts[cls]--;
+            smallBlocks.cachedBytes -= SmallBlockCache::blockBytes(cls);
+            memory = block;
+        } else {
+            memory = std::malloc(SmallBlockCache::blockBytes(cls));
+        }
+    } else {
+        memory = std::malloc(sizeof(HeapBlockHeader) + size);
+    }
+#else
+    memory = std::malloc(sizeof(HeapBlockHeader) + size);
+#endif
+    if (!memory) {
+        if (account) account->credit(size);
+        throw std::bad_alloc();
+    }
+    HeapBlockHeader* header = static_cast<HeapBlockHeader*>(memory);
+    header->account = account;
+    header->size = size;
+    return header + 1;
+}
+
+static void accountedFree(void* ptr) noexcept {
+    if (!ptr) return;
+    HeapBlockHeader* header = static_cast<HeapBlockHeader*>(ptr) - 1;
+    if (header->account) header->account->credit(header->size);
+#ifdef CHOCO_SMALL_BLOCK_POOL
+    size_t cls = SmallBlockCache::classOf(header->size);
+    if (cls < SmallBlockCache::CLASS_COUNT && !smallBlocks.closed &&
+        smallBlocks.counts[cls] < SmallBlockCache::MAX_CACHED &&
+        smallBlocks.cachedBytes < SmallBlockCache::MAX_CACHED_BYTES) {
+        if (smallBlocks.counts[cls] == 0) (void)&smallBlockOwner;
+        SmallBlockCache::FreeBlock* block = reinterpret_cast<SmallBlockCache::FreeBlock*>(header);
+        block->next = smallBlocks.heads[cls];
+        smallBlocks.heads[cls] = block;
+        smallBlocks.counts[cls]++;
+        smallBlocks.cachedBytes += SmallBlockCache::blockBytes(cls);
+        return;
+    }
+#endif
+    std::free(header);
+}
+
+void* operator new(size_t size) { return accountedAlloc(size); }
+void* operator new[](size_t size) { return accountedAlloc(size); }
+void operator delete(void* ptr) noexcept { accountedFree(ptr); }
+void operator delete[](void* ptr) noexcept { accountedFree(ptr); }
+void operator delete(void* ptr, size_t) noexcept { accountedFree(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { accountedFree(ptr); }
+#endif
+
 class LexerError : public std::runtime_error {
 public:
     int line;
@@ -378,6 +744,8 @@ private:
             case ',': return {TOKEN_COMMA, ",", line};
             case ';': return {TOKEN_SEMICOLON, ";", line};
             case ':': return {TOKEN_COLON, ":", line};
+            case '^': return {TOKEN_CARET, "^", line};
+            case '~': return {TOKEN_TILDE, "~", line};
             case '.':
                 if (pos < source.length() && source[pos] == '.') {
                     pos++;
@@ -409,12 +777,18 @@ private:
                 if (pos < source.length() && source[pos] == '=') {
                     pos++;
                     return {TOKEN_LESS_EQUAL, "<=", line};
+                } else if (pos < source.length() && source[pos] == '<') {
+                    pos++;
+                    return {TOKEN_LESS_LESS, "<<", line};
                 }
                 return {TOKEN_LESS, "<", line};
             case '>':
                 if (pos < source.length() && source[pos] == '=') {
                     pos++;
                     return {TOKEN_GREATER_EQUAL, ">=", line};
+                } else if (pos < source.length() && source[pos] == '>') {
+                    pos++;
+                    return {TOKEN_GREATER_GREATER, ">>", line};
                 }
                 return {TOKEN_GREATER, ">", line};
             case '&':
@@ -422,7 +796,7 @@ private:
                     pos++;
                     return {TOKEN_AND, "&&", line};
                 }
-                throw LexerError("Unexpected character '&'. Did you mean '&&'?", line);
+                return {TOKEN_AMPERSAND, "&", line};
             case '|':
                 if (pos < source.length() && source[pos] == '|') {
                     pos++;
@@ -440,6 +814,16 @@ private:
         num.reserve(16);
         bool hasDot = false;
         int startLine = line;
+
+        if (source[pos] == '0' && pos + 2 < source.length() && (source[pos + 1] == 'x' || source[pos + 1] == 'X') &&
+            std::isxdigit(static_cast<unsigned char>(source[pos + 2]))) {
+            num = source.substr(pos, 2);
+            pos += 2;
+            while (pos < source.length() && std::isxdigit(static_cast<unsigned char>(source[pos]))) {
+                num += source[pos++];
+            }
+            return {TOKEN_NUMBER, num, startLine};
+        }
         
         while (pos < source.length()) {
             if (std::isdigit(static_cast<unsigned char>(source[pos]))) {
@@ -526,181 +910,3371 @@ const std::unordered_map<std::string, TokenType> Lexer::keywords = {
     {"await", TOKEN_AWAIT}
 };
 
-class Interpreter;
+// Numbers are doubles, which hold every integer up to 2^53 exactly. Past
+// that, + - * % and exact / on integer operands are redone in int64 and the
+// result kept as a wide Value; a + - * result beyond int64 is an error, as
+// an out-of-range shift is, never wrapped or rounded. Bitwise operators
+// take any integer.
+static const double EXACT_INTEGER_LIMIT = 9007199254740992.0;  // 2^53
+// A double result below this means the exact one fits an int64.
+static const double INT64_SAFE_LIMIT = 9.2e18;
 
-struct Value {
-    enum Type { NUMBER, STRING, BOOL, ARRAY, STRUCT, LAMBDA, NIL } type;
-    double num;
-    std::string str;
-    bool boolean;
-    std::vector<Value> array;
-    std::unordered_map<std::string, Value> structFields;
-    std::string structType;
-    
-    std::vector<std::string> lambdaParams;
-    size_t lambdaBodyStart;
-    size_t lambdaBodyEnd;
-    std::unordered_map<std::string, Value> closureCaptures;
-
-    Value() : type(NIL), num(0), boolean(false), lambdaBodyStart(0), lambdaBodyEnd(0) {}
-    Value(double n) : type(NUMBER), num(n), boolean(false), lambdaBodyStart(0), lambdaBodyEnd(0) {}
-    Value(const std::string& s) : type(STRING), str(s), num(0), boolean(false), lambdaBodyStart(0), lambdaBodyEnd(0) {}
-    Value(bool b) : type(BOOL), num(0), boolean(b), lambdaBodyStart(0), lambdaBodyEnd(0) {}
-    Value(const std::vector<Value>& arr) : type(ARRAY), num(0), boolean(false), array(arr), lambdaBodyStart(0), lambdaBodyEnd(0) {}
-
-    std::string toString() const {
-        switch (type) {
-            case NUMBER: {
-                if (num == static_cast<int>(num)) {
-                    return std::to_string(static_cast<int>(num));
-                }
-                std::string s = std::to_string(num);
-                s.erase(s.find_last_not_of('0') + 1, std::string::npos);
-                if (s.back() == '.') s.pop_back();
-                return s;
-            }
-            case STRING: return str;
-            case BOOL: return boolean ? "true" : "false";
-            case ARRAY: {
-                std::string result = "[";
-                for (size_t i = 0; i < array.size(); i++) {
-                    result += array[i].toString();
-                    if (i < array.size() - 1) result += ", ";
-                }
-                result += "]";
-                return result;
-            }
-            case STRUCT: {
-                std::string result = structType + " { ";
-                bool first = true;
-                for (const auto& field : structFields) {
-                    if (!first) result += ", ";
-                    result += field.first + ": " + field.second.toString();
-                    first = false;
-                }
-                result += " }";
-                return result;
-            }
-            case LAMBDA: return "<lambda>";
-            case NIL: return "nil";
-        }
-        return "";
+// The integer a number holds exactly, if it is one within int64.
+static bool exactInteger(const Value& v, int64_t& out) {
+    if (v.wide) {
+        out = v.integer;
+        return true;
     }
-    
-    std::string getType() const {
-        switch (type) {
-            case NUMBER: return "number";
-            case STRING: return "string";
-            case BOOL: return "bool";
-            case ARRAY: return "array";
-            case STRUCT: return structType.empty() ? "struct" : structType;
-            case LAMBDA: return "lambda";
-            case NIL: return "nil";
+    if (v.num != std::trunc(v.num) || !(std::fabs(v.num) < INT64_SAFE_LIMIT)) return false;
+    out = static_cast<int64_t>(v.num);
+    return true;
+}
+
+// A number truncated to an integer, saturating at the int64 range.
+static int64_t truncateInteger(const Value& v) {
+    if (v.wide) return v.integer;
+    if (std::isnan(v.num)) return 0;
+    if (std::fabs(v.num) >= INT64_SAFE_LIMIT) return v.num < 0 ? INT64_MIN : INT64_MAX;
+    return static_cast<int64_t>(v.num);
+}
+
+// `a op b` for + - * in int64. False where the result does not fit.
+static bool checkedInteger(TokenType op, int64_t a, int64_t b, int64_t& out) {
+    if (op == TOKEN_PLUS) {
+        if ((b > 0 && a > INT64_MAX - b) || (b < 0 && a < INT64_MIN - b)) return false;
+        out = a + b;
+    } else if (op == TOKEN_MINUS) {
+        if ((b < 0 && a > INT64_MAX + b) || (b > 0 && a < INT64_MIN + b)) return false;
+        out = a - b;
+    } else {
+        if (a != 0 && b != 0) {
+            bool overflow = (a > 0) == (b > 0) ? (a > 0 ? a > INT64_MAX / b : a < INT64_MAX / b)
+                                               : (a > 0 ? b < INT64_MIN / a : a < INT64_MIN / b);
+            if (overflow) return false;
         }
-        return "unknown";
+        out = a * b;
     }
-};
+    return true;
+}
 
-struct Function {
-    std::vector<std::string> params;
-    size_t bodyStart;
-    size_t bodyEnd;
-};
+// `l op r` for + - * on two numbers. Integer operands get an exact result;
+// others (fractions, or magnitudes past int64) stay doubles.
+static Value addOrMultiply(TokenType op, const Value& l, const Value& r, int line) {
+    double approx = op == TOKEN_PLUS ? l.num + r.num : op == TOKEN_MINUS ? l.num - r.num : l.num * r.num;
+    if (!l.wide && !r.wide && std::fabs(approx) < EXACT_INTEGER_LIMIT) return Value(approx);
+    int64_t a, b, result;
+    if (!exactInteger(l, a) || !exactInteger(r, b)) return Value(approx);
+    if (!checkedInteger(op, a, b, result)) {
+        const char* symbol = op == TOKEN_PLUS ? " + " : op == TOKEN_MINUS ? " - " : " * ";
+        throw RuntimeError("Integer overflow: " + l.toString() + symbol + r.toString() +
+                           " is outside the 64-bit range", line);
+    }
+    return Value(result);
+}
 
-struct StructDef {
-    std::vector<std::string> fields;
-};
+// `l % r`, with the sign of l as in fmod. r is not zero.
+static Value moduloNumbers(const Value& l, const Value& r) {
+    int64_t a, b;
+    if ((l.wide || r.wide) && exactInteger(l, a) && exactInteger(r, b)) {
+        return Value(b == -1 ? int64_t(0) : a % b);
+    }
+    return Value(std::fmod(l.num, r.num));
+}
 
-struct ChocoException {
-    std::string message;
-    ChocoException(const std::string& msg) : message(msg) {}
-};
+// Exact where either side is wide; doubles compare exactly otherwise.
+static int orderNumbers(const Value& l, const Value& r) {
+    int64_t a, b;
+    if ((l.wide || r.wide) && exactInteger(l, a) && exactInteger(r, b)) {
+        return a < b ? -1 : a > b ? 1 : 0;
+    }
+    if (l.num < r.num) return -1;
+    if (l.num > r.num) return 1;
+    return l.num == r.num ? 0 : 2;  // 2: unordered (NaN)
+}
 
-class Interpreter {
-public:
-    std::unordered_map<std::string, Value> globalVars;
-    std::vector<std::unordered_map<std::string, Value>> scopes;
-    std::unordered_map<std::string, Function> functions;
-    std::unordered_map<std::string, StructDef> structDefs;
+// `l / r` where either side is wide: exact when the quotient is an
+// integer. r is not zero.
+static Value divideNumbers(const Value& l, const Value& r) {
+    int64_t a, b;
+    if (exactInteger(l, a) && exactInteger(r, b) && b != 0 && !(a == INT64_MIN && b == -1) && a % b == 0) {
+        return Value(a / b);
+    }
+    return Value(l.num / r.num);
+}
+
+static Value negateNumber(const Value& v) {
+    if (v.wide && v.integer != INT64_MIN) return Value(-v.integer);
+    return Value(-v.num);
+}
+
+// The value of a number literal; integers past 2^53 are read exactly.
+static Value numberLiteral(const std::string& text, double parsed) {
+    if (std::fabs(parsed) < EXACT_INTEGER_LIMIT || text.find('.') != std::string::npos) return Value(parsed);
+    bool hex = text.size() > 2 && (text[1] == 'x' || text[1] == 'X');
+    errno = 0;
+    char* end = nullptr;
+    long long integer = std::strtoll(text.c_str(), &end, hex ? 16 : 10);
+    if (errno == ERANGE || *end != '\0') return Value(parsed);
+    return Value(static_cast<int64_t>(integer));
+}
+
+// `a op b` for the bitwise operators, on the 64-bit two's complement
+// pattern. False for a shift count outside 0..63.
+static bool bitwise(TokenType op, int64_t a, int64_t b, int64_t& out) {
+    switch (op) {
+        case TOKEN_AMPERSAND: out = a & b; return true;
+        case TOKEN_PIPE: out = a | b; return true;
+        case TOKEN_CARET: out = a ^ b; return true;
+        default: break;
+    }
+    if (b < 0 || b > 63) return false;
+    if (op == TOKEN_LESS_LESS) out = static_cast<int64_t>(static_cast<uint64_t>(a) << b);
+    else out = a >> b;
+    return true;
+}
+
+// Rewrites a token stream before it runs, to fixpoint:
+//  - operators whose operands are literals are folded into one literal,
+//    respecting precedence, and never where the runtime would raise
+//    (division by zero, mismatched types);
+//  - top-level `let NAME = LITERAL;` bindings that nothing else binds or
+//    assigns are substituted into later top-level uses;
+//  - `if` statements and `match` statements on a literal keep only the
+//    branch that runs.
+// The result is an ordinary, shorter program: folded tokens keep the line
+// of the expression they replace, so error lines are unchanged.
+class TokenOptimizer {
     std::vector<Token> tokens;
-    size_t current;
-    bool inFunction;
-    bool inLoop;
-    bool hasReturned;
-    Value returnValue;
-    bool shouldBreak;
-    bool shouldContinue;
-    bool inTryCatch;
-    std::string currentException;
-    
-    static const std::unordered_map<std::string, bool> builtinFunctions;
+    bool propagateLets;
+    std::function<bool(const std::string&)> reservedName;
 
-    Value callFunction(const std::string& name, const std::vector<Value>& args, int callLine) {
-        if (name == "map") {
-            if (args.size() < 2) {
-                throw RuntimeError("map() expects 2 arguments (array, lambda), got " + std::to_string(args.size()), callLine);
-            }
-            if (args[0].type != Value::ARRAY) {
-                throw RuntimeError("map() first argument must be an array, got " + args[0].getType(), callLine);
-            }
-            if (args[1].type != Value::LAMBDA) {
-                throw RuntimeError("map() second argument must be a lambda, got " + args[1].getType(), callLine);
-            }
-            std::vector<Value> result;
-            result.reserve(args[0].array.size());
-            for (const auto& item : args[0].array) {
-                std::vector<Value> lambdaArgs = {item};
-                result.push_back(callLambda(args[1], lambdaArgs));
-            }
-            return Value(result);
+    static bool isLiteral(const Token& t) {
+        return t.type == TOKEN_NUMBER || t.type == TOKEN_TRUE || t.type == TOKEN_FALSE ||
+               (t.type == TOKEN_STRING && t.value.find("#{") == std::string::npos);
+    }
+
+    // Tokens that can end an operand, making a following '-' binary.
+    static bool endsOperand(TokenType type) {
+        return type == TOKEN_NUMBER || type == TOKEN_STRING || type == TOKEN_IDENTIFIER ||
+               type == TOKEN_TRUE || type == TOKEN_FALSE || type == TOKEN_RPAREN ||
+               type == TOKEN_RBRACKET || type == TOKEN_RBRACE;
+    }
+
+    static bool isPostfix(TokenType type) {
+        return type == TOKEN_LPAREN || type == TOKEN_LBRACKET || type == TOKEN_DOT;
+    }
+
+    static int precedence(TokenType type) {
+        switch (type) {
+            case TOKEN_OR: return 1;
+            case TOKEN_AND: return 2;
+            case TOKEN_EQUAL_EQUAL: case TOKEN_BANG_EQUAL: case TOKEN_LESS:
+            case TOKEN_GREATER: case TOKEN_LESS_EQUAL: case TOKEN_GREATER_EQUAL: return 3;
+            case TOKEN_PIPE: return 4;
+            case TOKEN_CARET: return 5;
+            case TOKEN_AMPERSAND: return 6;
+            case TOKEN_LESS_LESS: case TOKEN_GREATER_GREATER: return 7;
+            case TOKEN_PLUS: case TOKEN_MINUS: return 8;
+            case TOKEN_STAR: case TOKEN_SLASH: case TOKEN_PERCENT: return 9;
+            default: return 0;
         }
-        
-        if (name == "filter") {
-            if (args.size() < 2) {
-                throw RuntimeError("filter() expects 2 arguments (array, lambda), got " + std::to_string(args.size()), callLine);
-            }
-            if (args[0].type != Value::ARRAY) {
-                throw RuntimeError("filter() first argument must be an array, got " + args[0].getType(), callLine);
-            }
-            if (args[1].type != Value::LAMBDA) {
-                throw RuntimeError("filter() second argument must be a lambda, got " + args[1].getType(), callLine);
+    }
+
+    static Value literalValue(const Token& t) {
+        if (t.type == TOKEN_NUMBER) return Value(std::stod(t.value));
+        if (t.type == TOKEN_STRING) return Value(t.value);
+        return Value(t.type == TOKEN_TRUE);
+    }
+
+    static Token literalToken(const Value& v, int line) {
+        if (v.type == Value::BOOL) return {v.boolean ? TOKEN_TRUE : TOKEN_FALSE, v.boolean ? "true" : "false", line};
+        if (v.type == Value::STRING) return {TOKEN_STRING, v.str, line};
+        char buffer[32];
+        std::snprintf(buffer, sizeof(buffer), "%.17g", v.num);
+        return {TOKEN_NUMBER, buffer, line};
+    }
+
+    static bool truthy(const Value& v) {
+        if (v.type == Value::BOOL) return v.boolean;
+        if (v.type == Value::NUMBER) return v.num != 0;
+        if (v.type == Value::STRING) return !v.str.empty();
+        return false;
+    }
+
+    // Mirrors logicalOr() .. factor(); false where those would throw.
+    // Integers past 2^53, as operands or results, are left to the runtime,
+    // which keeps them exact or raises.
+    static bool evalBinary(TokenType op, const Value& l, const Value& r, Value& out) {
+        bool numbers = l.type == Value::NUMBER && r.type == Value::NUMBER;
+        if (numbers && !(std::fabs(l.num) < EXACT_INTEGER_LIMIT && std::fabs(r.num) < EXACT_INTEGER_LIMIT)) {
+            return false;
+        }
+        switch (op) {
+            case TOKEN_OR:
+            case TOKEN_AND: {
+                bool lb = l.type == Value::BOOL ? l.boolean : l.type == Value::NUMBER && l.num != 0;
+                bool rb = r.type == Value::BOOL ? r.boolean : r.type == Value::NUMBER && r.num != 0;
+                out = Value(op == TOKEN_OR ? (lb || rb) : (lb && rb));
+                return true;
+            }
+            case TOKEN_EQUAL_EQUAL: case TOKEN_BANG_EQUAL: case TOKEN_LESS:
+            case TOKEN_GREATER: case TOKEN_LESS_EQUAL: case TOKEN_GREATER_EQUAL: {
+                bool result = false;
+                if (numbers) {
+                    if (op == TOKEN_EQUAL_EQUAL) result = l.num == r.num;
+                    else if (op == TOKEN_BANG_EQUAL) result = l.num != r.num;
+                    else if (op == TOKEN_LESS) result = l.num < r.num;
+                    else if (op == TOKEN_GREATER) result = l.num > r.num;
+                    else if (op == TOKEN_LESS_EQUAL) result = l.num <= r.num;
+                    else result = l.num >= r.num;
+                } else if (l.type == r.type && (l.type == Value::BOOL || l.type == Value::STRING)) {
+                    bool equal = l.type == Value::BOOL ? l.boolean == r.boolean : l.str == r.str;
+                    if (op == TOKEN_EQUAL_EQUAL) result = equal;
+                    else if (op == TOKEN_BANG_EQUAL) result = !equal;
+                }
+                out = Value(result);
+                return true;
             }
-            std::vector<Value> result;
-            for (const auto& item : args[0].array) {
-                std::vector<Value> lambdaArgs = {item};
-                Value condition = callLambda(args[1], lambdaArgs);
-                if (condition.type == Value::BOOL && condition.boolean) {
-                    result.push_back(item);
+            case TOKEN_PLUS:
+                if (numbers) {
+                    out = Value(l.num + r.num);
+                    return std::fabs(out.num) < EXACT_INTEGER_LIMIT;
                 }
+                if (l.type == Value::STRING && r.type == Value::STRING) {
+                    out = Value(l.str + r.str);
+                    // The runtime interpolates each literal on its own.
+                    return out.str.find("#{") == std::string::npos;
+                }
+                return false;
+            case TOKEN_MINUS:
+                if (!numbers) return false;
+                out = Value(l.num - r.num);
+                return std::fabs(out.num) < EXACT_INTEGER_LIMIT;
+            case TOKEN_STAR:
+                if (!numbers) return false;
+                out = Value(l.num * r.num);
+                return std::fabs(out.num) < EXACT_INTEGER_LIMIT;
+            case TOKEN_SLASH:
+            case TOKEN_PERCENT:
+                if (!numbers || r.num == 0) return false;
+                out = Value(op == TOKEN_SLASH ? l.num / r.num : std::fmod(l.num, r.num));
+                return true;
+            case TOKEN_PIPE: case TOKEN_CARET: case TOKEN_AMPERSAND:
+            case TOKEN_LESS_LESS: case TOKEN_GREATER_GREATER: {
+                int64_t a, b;
+                if (!numbers || !exactInteger(l, a) || !exactInteger(r, b)) return false;
+                int64_t result;
+                if (!bitwise(op, a, b, result)) return false;
+                out = Value(result);
+                return true;
             }
-            return Value(result);
+            default:
+                return false;
         }
-        
-        if (name == "reduce") {
-            if (args.size() < 3) {
-                throw RuntimeError("reduce() expects 3 arguments (array, initial, lambda), got " + std::to_string(args.size()), callLine);
+    }
+
+    // Index of the '}' matching the '{' at `open`, or tokens.size().
+    size_t matchingBrace(size_t open) const {
+        int depth = 0;
+        for (size_t i = open; i < tokens.size(); i++) {
+            if (tokens[i].type == TOKEN_LBRACE) depth++;
+            else if (tokens[i].type == TOKEN_RBRACE && --depth == 0) return i;
+        }
+        return tokens.size();
+    }
+
+    void replace(size_t begin, size_t end, std::vector<Token> with) {
+        tokens.erase(tokens.begin() + begin, tokens.begin() + end);
+        tokens.insert(tokens.begin() + begin, std::make_move_iterator(with.begin()),
+                      std::make_move_iterator(with.end()));
+    }
+
+    bool foldOperators() {
+        bool changed = false;
+        for (size_t i = 0; i + 2 < tokens.size(); i++) {
+            TokenType prev = i > 0 ? tokens[i - 1].type : TOKEN_SEMICOLON;
+            bool prevEndsOperand = i > 0 && endsOperand(prev);
+
+            // Unary '-' or '!' on a literal.
+            if ((tokens[i].type == TOKEN_MINUS || tokens[i].type == TOKEN_BANG) && !prevEndsOperand &&
+                isLiteral(tokens[i + 1]) && !isPostfix(tokens[i + 2].type)) {
+                Value operand = literalValue(tokens[i + 1]);
+                Value result;
+                if (tokens[i].type == TOKEN_BANG) {
+                    result = Value(operand.type == Value::BOOL && !operand.boolean);
+                } else if (operand.type == Value::NUMBER && std::fabs(operand.num) < EXACT_INTEGER_LIMIT) {
+                    result = Value(-operand.num);
+                } else {
+                    continue;
+                }
+                replace(i, i + 2, {literalToken(result, tokens[i].line)});
+                changed = true;
+                continue;
             }
-            if (args[0].type != Value::ARRAY) {
-                throw RuntimeError("reduce() first argument must be an array, got " + args[0].getType(), callLine);
+
+            // A parenthesized literal (not a call's argument list).
+            if (tokens[i].type == TOKEN_LPAREN && !prevEndsOperand && isLiteral(tokens[i + 1]) &&
+                tokens[i + 2].type == TOKEN_RPAREN) {
+                replace(i, i + 3, {tokens[i + 1]});
+                changed = true;
+                if (i > 0) i--;
+                continue;
             }
-            if (args[2].type != Value::LAMBDA) {
-                throw RuntimeError("reduce() third argument must be a lambda, got " + args[2].getType(), callLine);
+
+            if (!isLiteral(tokens[i]) || i + 3 >= tokens.size() || !isLiteral(tokens[i + 2])) continue;
+            TokenType op = tokens[i + 1].type;
+            int level = precedence(op);
+            if (level == 0) continue;
+
+            // The left operand must not belong to a tighter or equal
+            // operator on its left; '-' there may be unary, which only
+            // commutes with * / %.
+            bool leftFree;
+            if (i == 0) {
+                leftFree = true;
+            } else if (prev == TOKEN_MINUS) {
+                leftFree = level == 9;
+            } else if (precedence(prev) > 0) {
+                leftFree = precedence(prev) < level;
+            } else {
+                leftFree = !prevEndsOperand && prev != TOKEN_BANG && prev != TOKEN_AWAIT && prev != TOKEN_DOT;
             }
-            Value accumulator = args[1];
-            for (const auto& item : args[0].array) {
-                std::vector<Value> lambdaArgs = {accumulator, item};
-                accumulator = callLambda(args[2], lambdaArgs);
+            TokenType next = tokens[i + 3].type;
+            bool rightFree = precedence(next) > 0 ? precedence(next) <= level : !isPostfix(next);
+            if (!leftFree || !rightFree) continue;
+
+            Value result;
+            if (!evalBinary(op, literalValue(tokens[i]), literalValue(tokens[i + 2]), result)) continue;
+            if (result.type == Value::NUMBER && !(std::fabs(result.num) < EXACT_INTEGER_LIMIT) &&
+                result.num == std::trunc(result.num)) {
+                continue;
             }
-            return accumulator;
+            if (result.type == Value::NUMBER && !std::isfinite(result.num)) continue;
+            replace(i, i + 3, {literalToken(result, tokens[i].line)});
+            changed = true;
+            if (i > 0) i--;
         }
-        
-        if (name == "typeof") {
-            if (args.size() == 0) {
-                throw RuntimeError("typeof() expects 1 argument, got 0", callLine);
+        return changed;
+    }
+
+    bool eliminateBranches() {
+        bool changed = false;
+        for (size_t i = 0; i + 2 < tokens.size(); i++) {
+            if (tokens[i].type == TOKEN_IF && isLiteral(tokens[i + 1]) && tokens[i + 2].type == TOKEN_LBRACE) {
+                size_t thenEnd = matchingBrace(i + 2);
+                if (thenEnd >= tokens.size()) continue;
+                size_t end = thenEnd + 1;
+                size_t elseOpen = 0, elseEnd = 0;
+                if (end + 1 < tokens.size() && tokens[end].type == TOKEN_ELSE && tokens[end + 1].type == TOKEN_LBRACE) {
+                    elseOpen = end + 1;
+                    elseEnd = matchingBrace(elseOpen);
+                    if (elseEnd >= tokens.size()) continue;
+                    end = elseEnd + 1;
+                }
+                std::vector<Token> kept;
+                if (truthy(literalValue(tokens[i + 1]))) {
+                    kept.assign(tokens.begin() + i + 3, tokens.begin() + thenEnd);
+                } else if (elseOpen) {
+                    kept.assign(tokens.begin() + elseOpen + 1, tokens.begin() + elseEnd);
+                }
+                replace(i, end, std::move(kept));
+                changed = true;
+                if (i > 0) i--;
+                continue;
             }
-            return Value(args[0].getType());
-        }
-        
+
+            if (tokens[i].type == TOKEN_MATCH && isLiteral(tokens[i + 1]) && tokens[i + 2].type == TOKEN_LBRACE) {
+                size_t close = matchingBrace(i + 2);
+                if (close >= tokens.size()) continue;
+                Value subject = literalValue(tokens[i + 1]);
+                size_t bodyOpen = 0, defaultOpen = 0;
+                bool simple = true;
+                size_t j = i + 3;
+                while (simple && j < close) {
+                    if (tokens[j].type == TOKEN_CASE && j + 3 < close && isLiteral(tokens[j + 1]) &&
+                        tokens[j + 2].type == TOKEN_ARROW_FAT && tokens[j + 3].type == TOKEN_LBRACE) {
+                        Value candidate = literalValue(tokens[j + 1]);
+                        Value equal;
+                        if (subject.type == candidate.type &&
+                            !evalBinary(TOKEN_EQUAL_EQUAL, subject, candidate, equal)) {
+                            simple = false;
+                        } else if (!bodyOpen && subject.type == candidate.type && equal.boolean) {
+                            bodyOpen = j + 3;
+                        }
+                        j = matchingBrace(j + 3) + 1;
+                    } else if (tokens[j].type == TOKEN_DEFAULT && j + 2 < close &&
+                               tokens[j + 1].type == TOKEN_ARROW_FAT && tokens[j + 2].type == TOKEN_LBRACE &&
+                               !defaultOpen) {
+                        defaultOpen = j + 2;
+                        j = matchingBrace(j + 2) + 1;
+                    } else {
+                        simple = false;
+                    }
+                }
+                if (!simple) continue;
+                size_t open = bodyOpen ? bodyOpen : defaultOpen;
+                std::vector<Token> kept;
+                if (open) kept.assign(tokens.begin() + open + 1, tokens.begin() + matchingBrace(open));
+                replace(i, close + 1, std::move(kept));
+                changed = true;
+                if (i > 0) i--;
+            }
+        }
+        return changed;
+    }
+
+    // Marks the tokens of function, method and lambda bodies and struct
+    // field lists: uses there may run in another isolate or not be
+    // variables at all.
+    std::vector<char> nestedRegions() const {
+        std::vector<char> nested(tokens.size(), 0);
+        for (size_t i = 0; i < tokens.size(); i++) {
+            size_t open = 0;
+            if ((tokens[i].type == TOKEN_FN || tokens[i].type == TOKEN_STRUCT || tokens[i].type == TOKEN_IMPL) &&
+                i + 1 < tokens.size()) {
+                for (size_t j = i + 1; j < tokens.size() && tokens[j].type != TOKEN_SEMICOLON; j++) {
+                    if (tokens[j].type == TOKEN_LBRACE) {
+                        open = j;
+                        break;
+                    }
+                }
+            } else if (tokens[i].type == TOKEN_ARROW_FAT && i + 1 < tokens.size() &&
+                       tokens[i + 1].type == TOKEN_LBRACE && i > 0 && tokens[i - 1].type == TOKEN_PIPE) {
+                open = i + 1;
+            }
+            if (!open) continue;
+            size_t close = matchingBrace(open);
+            for (size_t j = i; j <= close && j < tokens.size(); j++) nested[j] = 1;
+        }
+        return nested;
+    }
+
+    bool propagateConstants() {
+        for (const Token& t : tokens) {
+            if (t.type == TOKEN_IMPORT) return false;
+        }
+
+        // Every way a name gets bound: let, assignment, fn/struct names,
+        // parameters, loop and catch variables.
+        std::unordered_map<std::string, int> bindings;
+        std::unordered_map<std::string, size_t> topLevelLet;
+        bool inParams = false;
+        int depth = 0;
+        for (size_t i = 0; i < tokens.size(); i++) {
+            const Token& t = tokens[i];
+            if (t.type == TOKEN_LBRACE) depth++;
+            else if (t.type == TOKEN_RBRACE) depth--;
+            if (t.type == TOKEN_PIPE) {
+                size_t j = i + 1;
+                while (j < tokens.size() && (tokens[j].type == TOKEN_IDENTIFIER || tokens[j].type == TOKEN_COMMA)) j++;
+                if (j < tokens.size() && tokens[j].type == TOKEN_PIPE) {
+                    for (size_t k = i + 1; k < j; k++) {
+                        if (tokens[k].type == TOKEN_IDENTIFIER) bindings[tokens[k].value] += 2;
+                    }
+                }
+            }
+            if (t.type != TOKEN_IDENTIFIER) {
+                if (t.type == TOKEN_RPAREN) inParams = false;
+                continue;
+            }
+            TokenType prev = i > 0 ? tokens[i - 1].type : TOKEN_SEMICOLON;
+            TokenType next = i + 1 < tokens.size() ? tokens[i + 1].type : TOKEN_EOF;
+            if (prev == TOKEN_LET) {
+                bindings[t.value]++;
+                if (depth == 0) topLevelLet[t.value] = i;
+            } else if (prev == TOKEN_FN || prev == TOKEN_STRUCT || prev == TOKEN_FOR ||
+                       prev == TOKEN_CATCH || next == TOKEN_EQUAL || inParams) {
+                bindings[t.value] += 2;
+            }
+            if (prev == TOKEN_FN && next == TOKEN_LPAREN) inParams = true;
+        }
+
+        std::unordered_map<std::string, std::pair<size_t, Token>> constants;
+        for (const auto& let : topLevelLet) {
+            size_t at = let.second;
+            if (bindings[let.first] != 1 || reservedName(let.first)) continue;
+            if (at + 3 < tokens.size() && tokens[at + 1].type == TOKEN_EQUAL && isLiteral(tokens[at + 2]) &&
+                tokens[at + 3].type == TOKEN_SEMICOLON) {
+                constants.emplace(let.first, std::make_pair(at + 3, tokens[at + 2]));
+            }
+        }
+        if (constants.empty()) return false;
+
+        std::vector<char> nested = nestedRegions();
+        bool changed = false;
+        for (size_t i = 1; i + 1 < tokens.size(); i++) {
+            if (tokens[i].type != TOKEN_IDENTIFIER || nested[i]) continue;
+            auto it = constants.find(tokens[i].value);
+            if (it == constants.end() || i <= it->second.first) continue;
+            TokenType prev = tokens[i - 1].type;
+            TokenType next = tokens[i + 1].type;
+            if (prev == TOKEN_DOT || prev == TOKEN_LET || next == TOKEN_COLON || next == TOKEN_EQUAL) continue;
+            Token literal = it->second.second;
+            literal.line = tokens[i].line;
+            tokens[i] = std::move(literal);
+            changed = true;
+        }
+        return changed;
+    }
+
+public:
+    TokenOptimizer(std::vector<Token> toks, bool propagate, std::function<bool(const std::string&)> reserved)
+        : tokens(std::move(toks)), propagateLets(propagate), reservedName(std::move(reserved)) {}
+
+    std::vector<Token> run() {
+        bool changed = true;
+        while (changed) {
+            changed = foldOperators();
+            changed = eliminateBranches() || changed;
+            if (propagateLets) changed = propagateConstants() || changed;
+        }
+        return std::move(tokens);
+    }
+};
+
+class Interpreter;
+
+// ---- cycle collector ------------------------------------------------------
+//
+// Iterators, tasks and channels are shared through std::shared_ptr, so a
+// channel holding itself (directly or through a value sent on it) is a
+// cycle reference counting never frees. Every such object is registered
+// here; a collection finds the ones referenced only from other registered
+// objects (trial deletion: subtract internal references from each use
+// count, then keep whatever is reachable from an object with references
+// left over) and clears their contents, which breaks the cycles.
+//
+// Collections are generational: objects created since the last collection
+// are scanned every `youngThreshold` allocations and promoted if they
+// survive; all objects are scanned once the old generation has grown by
+// `growthFactor` since the last full collection. Contents of shared objects
+// may be touched by any isolate, so a collection only runs while a single
+// thread is executing script code; with isolates or pmap workers running
+// it is deferred to the next allocation.
+
+class HeapObject : public std::enable_shared_from_this<HeapObject> {
+public:
+    HeapObject();
+    HeapObject(const HeapObject&) : HeapObject() {}
+    HeapObject& operator=(const HeapObject&) { return *this; }
+    virtual ~HeapObject();
+
+    // Appends every registered object this one holds a reference to, once
+    // per reference.
+    virtual void children(std::vector<HeapObject*>& out) const = 0;
+    // Moves everything this object holds into `sink`.
+    virtual void release(std::vector<Value>& sink) = 0;
+
+protected:
+    static void valueChildren(const Value& value, std::vector<HeapObject*>& out);
+
+private:
+    friend class CycleCollector;
+    HeapObject* prev = nullptr;
+    HeapObject* next = nullptr;
+    bool old = false;
+    bool scanning = false;
+    bool reachable = false;
+    long gcRefs = 0;
+};
+
+struct GcStats {
+    uint64_t minorCollections = 0;
+    uint64_t fullCollections = 0;
+    uint64_t freed = 0;
+    size_t young = 0;
+    size_t old = 0;
+    double lastPauseMs = 0;
+    double maxPauseMs = 0;
+    double totalPauseMs = 0;
+};
+
+class CycleCollector {
+    std::mutex mutex;
+    HeapObject* youngHead = nullptr;
+    HeapObject* oldHead = nullptr;
+    std::atomic<size_t> youngCount{0};
+    size_t oldCount = 0;
+    size_t oldAfterFull = 0;
+    size_t youngThreshold = 1024;
+    double growthFactor = 2.0;
+    size_t scriptThreads = 0;
+    GcStats stats;
+
+    static void link(HeapObject*& head, HeapObject* object) {
+        object->prev = nullptr;
+        object->next = head;
+        if (head) head->prev = object;
+        head = object;
+    }
+
+    static void unlink(HeapObject*& head, HeapObject* object) {
+        if (object->prev) object->prev->next = object->next;
+        else head = object->next;
+        if (object->next) object->next->prev = object->prev;
+    }
+
+    // Trial deletion over the young generation, or over everything when
+    // `full`. Old objects left out of a minor collection act as roots.
+    // Returns the contents of the garbage, to be destroyed unlocked.
+    std::vector<Value> collectLocked(bool full) {
+        auto started = std::chrono::steady_clock::now();
+        std::vector<HeapObject*> scan;
+        scan.reserve(youngCount.load(std::memory_order_relaxed) + (full ? oldCount : 0));
+        for (HeapObject* o = youngHead; o; o = o->next) scan.push_back(o);
+        if (full) {
+            for (HeapObject* o = oldHead; o; o = o->next) scan.push_back(o);
+        }
+        for (HeapObject* o : scan) {
+            o->gcRefs = o->weak_from_this().use_count();
+            // Not owned yet, or mid-destruction: leave it alone.
+            o->scanning = o->gcRefs > 0;
+            o->reachable = !o->scanning;
+        }
+
+        std::vector<HeapObject*> kids;
+        for (HeapObject* o : scan) {
+            if (!o->scanning) continue;
+            kids.clear();
+            o->children(kids);
+            for (HeapObject* kid : kids) {
+                if (kid->scanning) kid->gcRefs--;
+            }
+        }
+
+        std::vector<HeapObject*> pending;
+        for (HeapObject* o : scan) {
+            if (o->scanning && o->gcRefs > 0) {
+                o->reachable = true;
+                pending.push_back(o);
+            }
+        }
+        while (!pending.empty()) {
+            HeapObject* o = pending.back();
+            pending.pop_back();
+            kids.clear();
+            o->children(kids);
+            for (HeapObject* kid : kids) {
+                if (kid->scanning && !kid->reachable) {
+                    kid->reachable = true;
+                    pending.push_back(kid);
+                }
+            }
+        }
+
+        std::vector<Value> garbage;
+        for (HeapObject* o : scan) {
+            if (!o->reachable) {
+                o->release(garbage);
+                stats.freed++;
+            }
+            o->scanning = false;
+        }
+
+        while (HeapObject* o = youngHead) {
+            unlink(youngHead, o);
+            o->old = true;
+            link(oldHead, o);
+            oldCount++;
+        }
+        youngCount.store(0, std::memory_order_relaxed);
+        if (full) {
+            oldAfterFull = oldCount;
+            stats.fullCollections++;
+        } else {
+            stats.minorCollections++;
+        }
+
+        double pause = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+        stats.lastPauseMs = pause;
+        stats.maxPauseMs = std::max(stats.maxPauseMs, pause);
+        stats.totalPauseMs += pause;
+        return garbage;
+    }
+
+    bool exclusive() const;
+
+public:
+    // Never destroyed: objects may outlive static destruction.
+    static CycleCollector& instance() {
+        static CycleCollector* collector = new CycleCollector();
+        return *collector;
+    }
+
+    void track(HeapObject* object) {
+        std::lock_guard<std::mutex> lock(mutex);
+        link(youngHead, object);
+        youngCount.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void untrack(HeapObject* object) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (object->old) {
+            unlink(oldHead, object);
+            oldCount--;
+        } else {
+            unlink(youngHead, object);
+            youngCount.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+    // Called after each registered allocation.
+    void maybeCollect() {
+        if (youngCount.load(std::memory_order_relaxed) < youngThreshold) return;
+        std::vector<Value> garbage;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (youngCount.load(std::memory_order_relaxed) < youngThreshold || !exclusive()) return;
+            garbage = collectLocked(false);
+            if (oldCount > 256 && oldCount > oldAfterFull * growthFactor) {
+                std::vector<Value> more = collectLocked(true);
+                garbage.insert(garbage.end(), std::make_move_iterator(more.begin()),
+                               std::make_move_iterator(more.end()));
+            }
+        }
+    }
+
+    // Full collection now; returns the number of objects freed, or 0 when
+    // other script threads are running.
+    uint64_t collect() {
+        std::vector<Value> garbage;
+        uint64_t freed;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!exclusive()) return 0;
+            uint64_t before = stats.freed;
+            garbage = collectLocked(true);
+            freed = stats.freed - before;
+        }
+        return freed;
+    }
+
+    void tune(size_t young, double growth) {
+        std::lock_guard<std::mutex> lock(mutex);
+        youngThreshold = young;
+        growthFactor = growth;
+    }
+
+    GcStats snapshot() {
+        std::lock_guard<std::mutex> lock(mutex);
+        GcStats result = stats;
+        result.young = youngCount.load(std::memory_order_relaxed);
+        result.old = oldCount;
+        return result;
+    }
+
+    void enterScript() {
+        std::lock_guard<std::mutex> lock(mutex);
+        scriptThreads++;
+    }
+
+    void leaveScript() {
+        std::lock_guard<std::mutex> lock(mutex);
+        scriptThreads--;
+    }
+};
+
+// Marks the current thread as running script code for as long as it
+// lives; nests freely. A thread entering waits for any collection in
+// progress to finish.
+thread_local int scriptThreadDepth = 0;
+
+class ScriptThreadScope {
+public:
+    ScriptThreadScope() {
+        if (scriptThreadDepth++ == 0) CycleCollector::instance().enterScript();
+    }
+    ~ScriptThreadScope() {
+        if (--scriptThreadDepth == 0) CycleCollector::instance().leaveScript();
+    }
+    ScriptThreadScope(const ScriptThreadScope&) = delete;
+    ScriptThreadScope& operator=(const ScriptThreadScope&) = delete;
+};
+
+inline bool CycleCollector::exclusive() const {
+    return scriptThreadDepth > 0 && scriptThreads == 1;
+}
+
+HeapObject::HeapObject() { CycleCollector::instance().track(this); }
+HeapObject::~HeapObject() { CycleCollector::instance().untrack(this); }
+
+// Allocates a collected object, giving the collector a chance to run.
+template <typename T, typename... Args>
+std::shared_ptr<T> newHeapObject(Args&&... args) {
+    std::shared_ptr<T> object = std::make_shared<T>(std::forward<Args>(args)...);
+    CycleCollector::instance().maybeCollect();
+    return object;
+}
+
+// A lazy iterator is a chain of immutable stages; each adapter points at
+// the stage it pulls from, down to a range, array or string source.
+struct IteratorState : HeapObject {
+    enum Kind { RANGE, SOURCE, MAP, FILTER, TAKE } kind;
+    double rangeStart = 0;
+    double rangeEnd = 0;
+    double rangeStep = 1;
+    Value source;
+    Value fn;
+    size_t limit = 0;
+    std::shared_ptr<IteratorState> parent;
+
+    explicit IteratorState(Kind k) : kind(k) {}
+
+    void children(std::vector<HeapObject*>& out) const override {
+        valueChildren(source, out);
+        valueChildren(fn, out);
+        if (parent) out.push_back(parent.get());
+    }
+
+    void release(std::vector<Value>& sink) override {
+        sink.push_back(std::move(source));
+        sink.push_back(std::move(fn));
+        Value upstream;
+        upstream.type = Value::ITERATOR;
+        upstream.iterator = std::move(parent);
+        sink.push_back(std::move(upstream));
+    }
+};
+
+struct Coroutine;
+
+// Result slot of an async call or async builtin. Coroutines awaiting an
+// unfinished task park themselves in `waiters` until it completes.
+struct TaskState : HeapObject {
+    bool done = false;
+    bool failed = false;
+    bool observed = false;
+    bool thrown = false;
+    Value result;
+    std::string error;
+    int errorLine = 0;
+    std::vector<Coroutine*> waiters;
+
+    void children(std::vector<HeapObject*>& out) const override { valueChildren(result, out); }
+    void release(std::vector<Value>& sink) override { sink.push_back(std::move(result)); }
+};
+
+// String-keyed table behind map values. Entries sit in a dense array in
+// insertion order, each with its key's hash cached; `slots` indexes them
+// by open addressing (linear probing, power-of-two size), so a probe
+// compares hashes before it touches a key and a rehash never rehashes a
+// string. Removal leaves a dead entry and a tombstone slot until the next
+// rehash compacts both. Map values share a table until one is written.
+struct MapTable : HeapObject {
+    struct Entry {
+        std::string key;
+        size_t hash;
+        Value value;
+        bool live;
+    };
+
+    static const uint32_t EMPTY = 0;
+    static const uint32_t TOMBSTONE = UINT32_MAX;
+    static const size_t NOT_FOUND = SIZE_MAX;
+
+    std::vector<Entry> entries;
+    std::vector<uint32_t> slots;  // entry index + 1, EMPTY or TOMBSTONE
+    size_t count = 0;
+    size_t used = 0;  // slots that are not EMPTY
+
+    static size_t hashKey(const std::string& key) { return std::hash<std::string>()(key); }
+
+    size_t locate(const std::string& key, size_t hash) const {
+        if (slots.empty()) return NOT_FOUND;
+        size_t mask = slots.size() - 1;
+        for (size_t i = hash & mask;; i = (i + 1) & mask) {
+            uint32_t slot = slots[i];
+            if (slot == EMPTY) return NOT_FOUND;
+            if (slot != TOMBSTONE) {
+                const Entry& entry = entries[slot - 1];
+                if (entry.hash == hash && entry.key == key) return i;
+            }
+        }
+    }
+
+    const Value* find(const std::string& key) const {
+        size_t i = locate(key, hashKey(key));
+        return i == NOT_FOUND ? nullptr : &entries[slots[i] - 1].value;
+    }
+
+    // The value stored under `key`, added as nil if missing.
+    Value& insert(const std::string& key) {
+        if ((used + 1) * 4 > slots.size() * 3) rehash();
+        size_t hash = hashKey(key);
+        size_t mask = slots.size() - 1;
+        size_t reuse = NOT_FOUND;
+        size_t i = hash & mask;
+        for (;; i = (i + 1) & mask) {
+            uint32_t slot = slots[i];
+            if (slot == EMPTY) break;
+            if (slot == TOMBSTONE) {
+                if (reuse == NOT_FOUND) reuse = i;
+            } else {
+                Entry& entry = entries[slot - 1];
+                if (entry.hash == hash && entry.key == key) return entry.value;
+            }
+        }
+        if (reuse == NOT_FOUND) used++;
+        else i = reuse;
+        entries.push_back({key, hash, Value(), true});
+        slots[i] = static_cast<uint32_t>(entries.size());
+        count++;
+        return entries.back().value;
+    }
+
+    bool erase(const std::string& key) {
+        size_t i = locate(key, hashKey(key));
+        if (i == NOT_FOUND) return false;
+        Entry& entry = entries[slots[i] - 1];
+        entry.live = false;
+        entry.key.clear();
+        entry.value = Value();
+        slots[i] = TOMBSTONE;
+        count--;
+        if (entries.size() > 2 * count + 8) rehash();
+        return true;
+    }
+
+    // Drops dead entries and rebuilds the index at under half full.
+    void rehash() {
+        size_t live = 0;
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (!entries[i].live) continue;
+            if (live != i) entries[live] = std::move(entries[i]);
+            live++;
+        }
+        entries.resize(live);
+        size_t capacity = 8;
+        while (capacity < 2 * (count + 1)) capacity *= 2;
+        slots.assign(capacity, uint32_t(EMPTY));
+        size_t mask = capacity - 1;
+        for (size_t e = 0; e < entries.size(); e++) {
+            size_t i = entries[e].hash & mask;
+            while (slots[i] != EMPTY) i = (i + 1) & mask;
+            slots[i] = static_cast<uint32_t>(e + 1);
+        }
+        used = count;
+    }
+
+    void children(std::vector<HeapObject*>& out) const override {
+        for (const Entry& entry : entries) valueChildren(entry.value, out);
+    }
+
+    void release(std::vector<Value>& sink) override {
+        for (Entry& entry : entries) sink.push_back(std::move(entry.value));
+        entries.clear();
+        slots.clear();
+        count = used = 0;
+    }
+};
+
+std::string mapToString(const MapTable& map) {
+    std::string result = "{";
+    bool first = true;
+    for (const auto& entry : map.entries) {
+        if (!entry.live) continue;
+        if (!first) result += ", ";
+        result += entry.key + ": " + entry.value.toString();
+        first = false;
+    }
+    return result + "}";
+}
+
+inline Value mapValue(std::shared_ptr<MapTable> table) {
+    Value result;
+    result.type = Value::MAP;
+    result.map = std::move(table);
+    return result;
+}
+
+// The table of `value` ready to be written: a shared one is copied first.
+inline MapTable& ownMap(Value& value) {
+    if (value.map.use_count() > 1) value.map = newHeapObject<MapTable>(*value.map);
+    return *value.map;
+}
+
+inline Value floatsValue(std::vector<double> data) {
+    Value result;
+    result.type = Value::FLOATS;
+    result.floats = std::make_shared<std::vector<double>>(std::move(data));
+    return result;
+}
+
+// The buffer of `value` ready to be written: a shared one is copied first.
+inline std::vector<double>& ownFloats(Value& value) {
+    if (value.floats.use_count() > 1) value.floats = std::make_shared<std::vector<double>>(*value.floats);
+    return *value.floats;
+}
+
+// Builders are shared by reference, so a value handed to another isolate or
+// embedding context gets builders of its own. Nothing is walked until some
+// script has created a builder.
+static std::atomic<bool> buildersCreated(false);
+
+static bool holdsBuilder(const Value& value) {
+    switch (value.type) {
+        case Value::BUILDER: return true;
+        case Value::ARRAY:
+            return std::any_of(value.array.begin(), value.array.end(), holdsBuilder);
+        case Value::STRUCT:
+            for (const auto& field : value.structFields) {
+                if (holdsBuilder(field.second)) return true;
+            }
+            return false;
+        case Value::LAMBDA:
+            for (const auto& capture : value.closureCaptures) {
+                if (holdsBuilder(capture.second)) return true;
+            }
+            return false;
+        case Value::MAP:
+            for (const auto& entry : value.map->entries) {
+                if (entry.live && holdsBuilder(entry.value)) return true;
+            }
+            return false;
+        default: return false;
+    }
+}
+
+static void detachBuilders(Value& value) {
+    if (!buildersCreated.load(std::memory_order_relaxed)) return;
+    switch (value.type) {
+        case Value::BUILDER:
+            value.builder = std::make_shared<std::string>(*value.builder);
+            break;
+        case Value::ARRAY:
+            for (Value& item : value.array) detachBuilders(item);
+            break;
+        case Value::STRUCT:
+            for (auto& field : value.structFields) detachBuilders(field.second);
+            break;
+        case Value::LAMBDA:
+            for (auto& capture : value.closureCaptures) detachBuilders(capture.second);
+            break;
+        case Value::MAP:
+            if (!holdsBuilder(value)) break;
+            for (auto& entry : ownMap(value).entries) {
+                if (entry.live) detachBuilders(entry.value);
+            }
+            break;
+        default: break;
+    }
+}
+
+// The numbers in a floats value, or in an array holding only numbers
+// (packed into `scratch`); null for anything else.
+static const std::vector<double>* packedNumbers(const Value& value, std::vector<double>& scratch) {
+    if (value.type == Value::FLOATS) return value.floats.get();
+    if (value.type != Value::ARRAY) return nullptr;
+    scratch.clear();
+    scratch.reserve(value.array.size());
+    for (const Value& item : value.array) {
+        if (item.type != Value::NUMBER) return nullptr;
+        scratch.push_back(item.num);
+    }
+    return &scratch;
+}
+
+// Loops over packed numbers, written so the compiler can vectorize them.
+// Reductions keep four partial results, since a single floating-point
+// accumulator cannot be reordered; sums may differ from a left-to-right
+// sum in the last bits (never for integers below 2^53).
+
+static double sumFloats(const double* x, size_t n) {
+    double lane[4] = {0, 0, 0, 0};
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        lane[0] += x[i];
+        lane[1] += x[i + 1];
+        lane[2] += x[i + 2];
+        lane[3] += x[i + 3];
+    }
+    double total = (lane[0] + lane[1]) + (lane[2] + lane[3]);
+    for (; i < n; i++) total += x[i];
+    return total;
+}
+
+static double dotFloats(const double* x, const double* y, size_t n) {
+    double lane[4] = {0, 0, 0, 0};
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        lane[0] += x[i] * y[i];
+        lane[1] += x[i + 1] * y[i + 1];
+        lane[2] += x[i + 2] * y[i + 2];
+        lane[3] += x[i + 3] * y[i + 3];
+    }
+    double total = (lane[0] + lane[1]) + (lane[2] + lane[3]);
+    for (; i < n; i++) total += x[i] * y[i];
+    return total;
+}
+
+// The least (or greatest) of n > 0 numbers, ignoring NaNs; NaN if all are.
+static double extremeFloats(const double* x, size_t n, bool greatest) {
+    const double none = greatest ? -INFINITY : INFINITY;
+    double lane[4] = {none, none, none, none};
+    size_t i = 0;
+    if (greatest) {
+        for (; i + 4 <= n; i += 4) {
+            for (int j = 0; j < 4; j++) lane[j] = x[i + j] > lane[j] ? x[i + j] : lane[j];
+        }
+    } else {
+        for (; i + 4 <= n; i += 4) {
+            for (int j = 0; j < 4; j++) lane[j] = x[i + j] < lane[j] ? x[i + j] : lane[j];
+        }
+    }
+    double result = none;
+    for (int j = 0; j < 4; j++) result = greatest ? std::max(result, lane[j]) : std::min(result, lane[j]);
+    for (; i < n; i++) {
+        if (greatest ? x[i] > result : x[i] < result) result = x[i];
+    }
+    if (result == none && std::all_of(x, x + n, [](double v) { return v != v; })) return NAN;
+    return result;
+}
+
+// out[i] = x[i] op y[i] for + and *, or x[i] * k when y is null.
+static void elementwiseFloats(TokenType op, const double* x, const double* y, double k, double* out, size_t n) {
+    if (!y) {
+        for (size_t i = 0; i < n; i++) out[i] = x[i] * k;
+    } else if (op == TOKEN_PLUS) {
+        for (size_t i = 0; i < n; i++) out[i] = x[i] + y[i];
+    } else {
+        for (size_t i = 0; i < n; i++) out[i] = x[i] * y[i];
+    }
+}
+
+struct Function {
+    std::vector<std::string> params;
+    size_t bodyStart;
+    size_t bodyEnd;
+    bool isAsync = false;
+    TokenStream code;  // the stream bodyStart/bodyEnd index into
+    bool exprBody = false;  // body is exactly `return EXPR;`
+};
+
+// True when the body in [start, end) is exactly `return EXPR;`. Calls to
+// such a body evaluate EXPR in place of running the statement loop.
+static bool returnsExpression(const TokenStream& code, size_t start, size_t end) {
+    if (start >= end || end > code.size() || code[start].type != TOKEN_RETURN) return false;
+    int depth = 0;
+    for (size_t i = start + 1; i < end; i++) {
+        TokenType type = code[i].type;
+        if (type == TOKEN_LBRACE) depth++;
+        else if (type == TOKEN_RBRACE) depth--;
+        else if (type == TOKEN_SEMICOLON && depth == 0) return i + 1 == end;
+    }
+    return false;
+}
+
+struct StructDef {
+    std::vector<std::string> fields;
+    std::unordered_map<std::string, Function> methods;  // from impl blocks
+};
+
+// What an identifier or field-name token resolved to last time, keyed by
+// its stream and position. Name and method entries hold while the
+// interpreter's callableEpoch is unchanged. Field entries remember the
+// bucket the field name falls in for the last two bucket counts seen,
+// which is all that is needed to find it in any struct without hashing
+// the name again.
+struct SiteCache {
+    uint64_t stream = 0;
+    size_t index = 0;
+    uint64_t epoch = 0;
+    bool callable = false;
+    // The user function a callable name calls, or the method a `.name(`
+    // site called on a struct of type *methodType.
+    Function* function = nullptr;
+    const std::string* methodType = nullptr;
+    size_t bucketCounts[2] = {0, 0};
+    size_t buckets[2] = {0, 0};
+};
+
+// Binary snapshot of an initialized interpreter: token streams, struct
+// definitions, functions, globals and the position to resume from. Bump
+// SNAPSHOT_VERSION whenever TokenType or the layout below changes.
+static const char SNAPSHOT_MAGIC[8] = {'C', 'H', 'O', 'C', 'O', 'S', 'N', 'P'};
+static const uint32_t SNAPSHOT_VERSION = 6;
+
+class SnapshotWriter {
+    std::string bytes;
+
+public:
+    void raw(const void* data, size_t size) { bytes.append(static_cast<const char*>(data), size); }
+    void u8(uint8_t v) { raw(&v, sizeof(v)); }
+    void u32(uint32_t v) { raw(&v, sizeof(v)); }
+    void u64(uint64_t v) { raw(&v, sizeof(v)); }
+    void f64(double v) { raw(&v, sizeof(v)); }
+    void str(const std::string& s) {
+        u32(static_cast<uint32_t>(s.size()));
+        raw(s.data(), s.size());
+    }
+
+    void value(const Value& v, const std::string& where, int line) {
+        u8(static_cast<uint8_t>(v.type));
+        switch (v.type) {
+            case Value::NUMBER:
+                f64(v.num);
+                u8(v.wide);
+                if (v.wide) u64(static_cast<uint64_t>(v.integer));
+                break;
+            case Value::STRING: str(v.str); break;
+            case Value::BOOL: u8(v.boolean); break;
+            case Value::ARRAY:
+                u32(static_cast<uint32_t>(v.array.size()));
+                for (const Value& item : v.array) value(item, where, line);
+                break;
+            case Value::STRUCT:
+                str(v.structType);
+                u32(static_cast<uint32_t>(v.structFields.size()));
+                for (const auto& field : v.structFields) {
+                    str(field.first);
+                    value(field.second, where, line);
+                }
+                break;
+            case Value::LAMBDA:
+                u32(static_cast<uint32_t>(v.lambdaParams.size()));
+                for (const auto& param : v.lambdaParams) str(param);
+                u64(v.lambdaBodyStart);
+                u64(v.lambdaBodyEnd);
+                u32(static_cast<uint32_t>(v.closureCaptures.size()));
+                for (const auto& capture : v.closureCaptures) {
+                    str(capture.first);
+                    value(capture.second, where, line);
+                }
+                break;
+            case Value::MAP:
+                u32(static_cast<uint32_t>(v.map->count));
+                for (const auto& entry : v.map->entries) {
+                    if (!entry.live) continue;
+                    str(entry.key);
+                    value(entry.value, where, line);
+                }
+                break;
+            case Value::FLOATS:
+                u32(static_cast<uint32_t>(v.floats->size()));
+                for (double item : *v.floats) f64(item);
+                break;
+            case Value::NIL: break;
+            default:
+                throw RuntimeError("snapshot(): cannot save a " + v.getType() + " (in '" + where + "')", line);
+        }
+    }
+
+    bool save(const std::string& path) const {
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        file.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+        return static_cast<bool>(file);
+    }
+};
+
+// Reads a snapshot straight out of the mapped file; every read is bounds
+// checked so a truncated or foreign file fails cleanly.
+class SnapshotReader {
+    const char* data;
+    size_t size;
+    size_t pos = 0;
+
+public:
+    SnapshotReader(const char* bytes, size_t length) : data(bytes), size(length) {}
+
+    void raw(void* out, size_t n) {
+        if (n > size - pos) throw RuntimeError("Corrupt snapshot: unexpected end of file", 0);
+        std::memcpy(out, data + pos, n);
+        pos += n;
+    }
+    uint8_t u8() { uint8_t v; raw(&v, sizeof(v)); return v; }
+    uint32_t u32() { uint32_t v; raw(&v, sizeof(v)); return v; }
+    uint64_t u64() { uint64_t v; raw(&v, sizeof(v)); return v; }
+    double f64() { double v; raw(&v, sizeof(v)); return v; }
+    std::string str() {
+        uint32_t n = u32();
+        if (n > size - pos) throw RuntimeError("Corrupt snapshot: unexpected end of file", 0);
+        std::string s(data + pos, n);
+        pos += n;
+        return s;
+    }
+
+    Value value() {
+        Value v;
+        uint8_t type = u8();
+        if (type > Value::NIL) throw RuntimeError("Corrupt snapshot: unknown value type", 0);
+        v.type = static_cast<Value::Type>(type);
+        switch (v.type) {
+            case Value::NUMBER:
+                v.num = f64();
+                v.wide = u8() != 0;
+                if (v.wide) v.integer = static_cast<int64_t>(u64());
+                break;
+            case Value::STRING: v.str = str(); break;
+            case Value::BOOL: v.boolean = u8() != 0; break;
+            case Value::ARRAY: {
+                uint32_t n = u32();
+                for (uint32_t i = 0; i < n; i++) v.array.push_back(value());
+                break;
+            }
+            case Value::STRUCT: {
+                v.structType = str();
+                uint32_t n = u32();
+                for (uint32_t i = 0; i < n; i++) {
+                    std::string name = str();
+                    v.structFields[name] = value();
+                }
+                break;
+            }
+            case Value::LAMBDA: {
+                uint32_t n = u32();
+                for (uint32_t i = 0; i < n; i++) v.lambdaParams.push_back(str());
+                v.lambdaBodyStart = u64();
+                v.lambdaBodyEnd = u64();
+                uint32_t captures = u32();
+                for (uint32_t i = 0; i < captures; i++) {
+                    std::string name = str();
+                    v.closureCaptures[name] = value();
+                }
+                break;
+            }
+            case Value::MAP: {
+                v.map = newHeapObject<MapTable>();
+                uint32_t n = u32();
+                for (uint32_t i = 0; i < n; i++) {
+                    std::string key = str();
+                    v.map->insert(key) = value();
+                }
+                break;
+            }
+            case Value::FLOATS: {
+                uint32_t n = u32();
+                std::vector<double> items(n);
+                for (uint32_t i = 0; i < n; i++) items[i] = f64();
+                v.floats = std::make_shared<std::vector<double>>(std::move(items));
+                break;
+            }
+            case Value::NIL: break;
+            default: throw RuntimeError("Corrupt snapshot: unexpected " + v.getType(), 0);
+        }
+        return v;
+    }
+};
+
+struct ChocoException {
+    std::string message;
+    ChocoException(const std::string& msg) : message(msg) {}
+};
+
+// Work-stealing thread pool shared by the parallel builtins. Every worker
+// owns a deque: it pops its own work from the back and steals from the
+// front of the others when it runs dry. The thread that submits a job
+// helps run that job's chunks until all of them are finished.
+class WorkStealingPool {
+    struct Job {
+        std::function<void(size_t, size_t, size_t)> body;
+        std::atomic<size_t> pending{0};
+        std::mutex errorMutex;
+        std::exception_ptr error;
+    };
+
+    struct Chunk {
+        Job* job;
+        size_t begin;
+        size_t end;
+    };
+
+    struct WorkerQueue {
+        std::mutex mutex;
+        std::deque<Chunk> chunks;
+    };
+
+    std::vector<std::thread> threads;
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+    std::mutex sleepMutex;
+    std::condition_variable wakeUp;
+    std::atomic<size_t> queued{0};
+    bool stopping = false;
+
+    WorkStealingPool(size_t workerCount) {
+        for (size_t i = 0; i < workerCount; i++) {
+            queues.push_back(std::make_unique<WorkerQueue>());
+        }
+        for (size_t i = 0; i < workerCount; i++) {
+            threads.emplace_back([this, i] { workerLoop(i); });
+        }
+    }
+
+    static void runChunk(const Chunk& chunk, size_t slot) {
+        try {
+            chunk.job->body(slot, chunk.begin, chunk.end);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(chunk.job->errorMutex);
+            if (!chunk.job->error) chunk.job->error = std::current_exception();
+        }
+        chunk.job->pending.fetch_sub(1, std::memory_order_acq_rel);
+    }
+
+    // Takes a chunk from the back of our own queue, or steals one from the
+    // front of another. With onlyJob set, only that job's chunks qualify.
+    bool findChunk(size_t self, Job* onlyJob, Chunk& out) {
+        size_t n = queues.size();
+        for (size_t k = 0; k < n; k++) {
+            size_t idx = (self + k) % n;
+            WorkerQueue& q = *queues[idx];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (q.chunks.empty()) continue;
+            if (onlyJob) {
+                for (auto it = q.chunks.begin(); it != q.chunks.end(); ++it) {
+                    if (it->job == onlyJob) {
+                        out = *it;
+                        q.chunks.erase(it);
+                        queued.fetch_sub(1, std::memory_order_relaxed);
+                        return true;
+                    }
+                }
+                continue;
+            }
+            if (idx == self) {
+                out = q.chunks.back();
+                q.chunks.pop_back();
+            } else {
+                out = q.chunks.front();
+                q.chunks.pop_front();
+            }
+            queued.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+
+    void workerLoop(size_t self) {
+        while (true) {
+            Chunk chunk;
+            if (findChunk(self, nullptr, chunk)) {
+                runChunk(chunk, self);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            wakeUp.wait(lock, [this] { return stopping || queued.load() > 0; });
+            if (stopping) return;
+        }
+    }
+
+public:
+    ~WorkStealingPool() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wakeUp.notify_all();
+        for (auto& t : threads) t.join();
+    }
+
+    // Sized to the machine, or to CHOCO_THREADS when that is set.
+    static WorkStealingPool& shared() {
+        static WorkStealingPool pool([] {
+            const char* env = std::getenv("CHOCO_THREADS");
+            long n = env ? std::atol(env) : static_cast<long>(std::thread::hardware_concurrency());
+            return static_cast<size_t>(std::max(1L, n) - 1);
+        }());
+        return pool;
+    }
+
+    // Number of distinct slot ids handed to parallelFor bodies: one per
+    // worker plus one for the submitting thread.
+    size_t slots() const { return threads.size() + 1; }
+
+    // Splits [0, count) into chunks of at most `grain` items and runs
+    // body(slot, begin, end) for each. Chunks sharing a slot id never run
+    // concurrently, so bodies can keep per-slot state. The first exception
+    // thrown by a chunk is rethrown here once every chunk has finished.
+    void parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t, size_t)>& body) {
+        if (count == 0) return;
+        grain = std::max<size_t>(grain, 1);
+        size_t callerSlot = threads.size();
+        if (threads.empty() || count <= grain) {
+            for (size_t begin = 0; begin < count; begin += grain) {
+                body(callerSlot, begin, std::min(count, begin + grain));
+            }
+            return;
+        }
+
+        Job job;
+        job.body = body;
+        size_t chunkCount = (count + grain - 1) / grain;
+        job.pending.store(chunkCount);
+
+        size_t idx = 0;
+        for (size_t begin = 0; begin < count; begin += grain, idx++) {
+            WorkerQueue& q = *queues[idx % queues.size()];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            q.chunks.push_back({&job, begin, std::min(count, begin + grain)});
+            queued.fetch_add(1, std::memory_order_relaxed);
+        }
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+        }
+        wakeUp.notify_all();
+
+        while (job.pending.load(std::memory_order_acquire) > 0) {
+            Chunk chunk;
+            if (findChunk(0, &job, chunk)) {
+                runChunk(chunk, callerSlot);
+            } else {
+                std::this_thread::yield();
+            }
+        }
+
+        if (job.error) std::rethrow_exception(job.error);
+    }
+};
+
+// Bounded multi-producer/multi-consumer queue connecting isolates (Vyukov's
+// design). Every cell carries a sequence number saying whose turn it is, so
+// send and receive are one CAS on a position counter plus a move of the
+// Value; no lock is ever taken. The ring is rounded up to a power of two,
+// so a separate count holds the channel to the capacity it was made with.
+class Channel : public HeapObject {
+    struct Cell {
+        std::atomic<size_t> sequence;
+        Value value;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    size_t limit;
+    alignas(64) std::atomic<size_t> enqueuePos{0};
+    alignas(64) std::atomic<size_t> dequeuePos{0};
+    alignas(64) std::atomic<size_t> count{0};
+    std::atomic<bool> closed{false};
+#ifdef CHOCO_HAS_EVENT_LOOP
+    std::mutex wakeLock;
+    std::vector<int> wakeFds;
+    std::atomic<bool> hasWaiters{false};
+
+    // Pairs with the fence in addWaiter: either the waiter's retry sees
+    // this operation or this check sees the waiter.
+    void wakeWaiters() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!hasWaiters.load(std::memory_order_relaxed)) return;
+        std::lock_guard<std::mutex> guard(wakeLock);
+        for (int fd : wakeFds) {
+            uint64_t one = 1;
+            ssize_t ignored = write(fd, &one, sizeof(one));
+            (void)ignored;
+        }
+        wakeFds.clear();
+        hasWaiters.store(false, std::memory_order_relaxed);
+    }
+#else
+    void wakeWaiters() {}
+#endif
+
+    // Spin briefly, then yield, then sleep, so a blocked peer costs
+    // little CPU while a busy pipeline stays on the fast path.
+    static void backoff(unsigned& attempt) {
+        if (attempt < 64) {
+            attempt++;
+        } else if (attempt < 128) {
+            attempt++;
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    }
+
+    // Claims one of the `limit` slots; fails when the channel is full.
+    bool reserve() {
+        size_t held = count.load(std::memory_order_relaxed);
+        while (held < limit) {
+            if (count.compare_exchange_weak(held, held + 1, std::memory_order_acquire)) return true;
+        }
+        return false;
+    }
+
+    bool enqueue(Value& value) {
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[pos & mask];
+            size_t seq = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.value = std::move(value);
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+public:
+    // Larger requests are refused by channel() rather than allocated.
+    static constexpr size_t MAX_CAPACITY = size_t(1) << 24;
+
+    explicit Channel(size_t capacity) : limit(capacity) {
+        size_t size = 2;
+        while (size < capacity) size <<= 1;
+        cells.reset(new Cell[size]);
+        mask = size - 1;
+        for (size_t i = 0; i < size; i++) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    size_t capacity() const { return limit; }
+
+    // Moves `value` into the queue; returns false (leaving it intact) when full.
+    bool trySend(Value& value) {
+        if (!reserve()) return false;
+        if (enqueue(value)) {
+            wakeWaiters();
+            return true;
+        }
+        count.fetch_sub(1, std::memory_order_release);
+        return false;
+    }
+
+    // Moves the oldest value into `out`; returns false when empty.
+    bool tryRecv(Value& out) {
+        size_t pos = dequeuePos.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[pos & mask];
+            size_t seq = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    out = std::move(cell.value);
+                    cell.value = Value();
+                    cell.sequence.store(pos + mask + 1, std::memory_order_release);
+                    count.fetch_sub(1, std::memory_order_release);
+                    wakeWaiters();
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Blocks while the channel is full; returns false if it was closed.
+    bool send(Value& value) {
+        unsigned attempt = 0;
+        while (!closed.load(std::memory_order_acquire)) {
+            if (trySend(value)) return true;
+            backoff(attempt);
+        }
+        return false;
+    }
+
+    // Blocks while the channel is empty; returns false once it is closed
+    // and fully drained.
+    bool recv(Value& out) {
+        unsigned attempt = 0;
+        while (true) {
+            if (tryRecv(out)) return true;
+            if (closed.load(std::memory_order_acquire)) return tryRecv(out);
+            backoff(attempt);
+        }
+    }
+
+    void close() {
+        closed.store(true, std::memory_order_release);
+        wakeWaiters();
+    }
+
+    bool isClosed() const { return closed.load(std::memory_order_acquire); }
+
+#ifdef CHOCO_HAS_EVENT_LOOP
+    // An event loop that can't send or receive yet parks an eventfd here
+    // instead of spinning; the next send, receive or close signals it.
+    // The caller must try again after adding, before it waits.
+    void addWaiter(int fd) {
+        {
+            std::lock_guard<std::mutex> guard(wakeLock);
+            wakeFds.push_back(fd);
+            hasWaiters.store(true, std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    void removeWaiter(int fd) {
+        std::lock_guard<std::mutex> guard(wakeLock);
+        wakeFds.erase(std::remove(wakeFds.begin(), wakeFds.end(), fd), wakeFds.end());
+        hasWaiters.store(!wakeFds.empty(), std::memory_order_relaxed);
+    }
+#endif
+
+    // Only called by the collector, while no other thread runs script code.
+    void children(std::vector<HeapObject*>& out) const override {
+        for (size_t i = 0; i <= mask; i++) valueChildren(cells[i].value, out);
+    }
+
+    void release(std::vector<Value>& sink) override {
+        for (size_t i = 0; i <= mask; i++) sink.push_back(std::move(cells[i].value));
+        closed.store(true, std::memory_order_release);
+    }
+};
+
+void HeapObject::valueChildren(const Value& value, std::vector<HeapObject*>& out) {
+    for (const auto& element : value.array) valueChildren(element, out);
+    for (const auto& field : value.structFields) valueChildren(field.second, out);
+    for (const auto& capture : value.closureCaptures) valueChildren(capture.second, out);
+    if (value.iterator) out.push_back(value.iterator.get());
+    if (value.task) out.push_back(value.task.get());
+    if (value.channel) out.push_back(value.channel.get());
+    if (value.map) out.push_back(value.map.get());
+}
+
+// Interpreter state that belongs to one thread of execution. The main
+// program and every suspended coroutine each own one; they are swapped in
+// and out of the Interpreter when control moves between them.
+struct ExecState {
+    TokenStream tokens;
+    std::vector<std::unordered_map<std::string, Value>> scopes;
+    std::vector<const std::unordered_map<std::string, Value>*> captureLayers;
+    size_t current = 0;
+    bool inFunction = false;
+    bool inLoop = false;
+    bool hasReturned = false;
+    Value returnValue;
+    bool shouldBreak = false;
+    bool shouldContinue = false;
+    bool inTryCatch = false;
+    std::string currentException;
+};
+
+#ifdef CHOCO_HAS_EVENT_LOOP
+// A suspendable call of an async function, running on its own stack.
+struct Coroutine {
+    ucontext_t context;
+    void* stack = nullptr;
+    size_t stackSize = 0;
+    ExecState state;
+    Function func;
+    std::vector<Value> args;
+    std::shared_ptr<TaskState> task;
+    bool finished = false;
+};
+
+// An in-flight operation watched by epoll, keyed by its file descriptor.
+struct PendingIo {
+    enum Kind { TIMER, FILE_READ, PROCESS, ISOLATE, CHANNEL } kind;
+    std::shared_ptr<TaskState> task;
+    std::string buffer;
+    pid_t pid = -1;
+    std::thread reader;
+    std::shared_ptr<std::pair<bool, std::string>> fileResult;
+    std::shared_ptr<TaskState> isolateResult;
+};
+
+// Single-threaded scheduler: coroutines ready to resume, plus timers,
+// background file reads and child processes multiplexed through epoll.
+struct AsyncRuntime {
+    // Coroutines get as much stack as the main thread, so an async call
+    // recurses as deep as a synchronous one. Pages are only committed as
+    // they are touched.
+    static size_t stackSize() {
+        static const size_t size = [] {
+            struct rlimit limit;
+            if (getrlimit(RLIMIT_STACK, &limit) != 0) return size_t(8) << 20;
+            if (limit.rlim_cur == RLIM_INFINITY) return size_t(256) << 20;
+            return std::max<size_t>(limit.rlim_cur, size_t(1) << 20);
+        }();
+        return size;
+    }
+
+    int epollFd = -1;
+    ucontext_t schedulerContext;
+    Coroutine* running = nullptr;
+    std::deque<Coroutine*> ready;
+    std::unordered_map<Coroutine*, std::unique_ptr<Coroutine>> coroutines;
+    std::unordered_map<int, PendingIo> pending;
+    std::vector<std::shared_ptr<TaskState>> unobserved;
+
+    AsyncRuntime() : epollFd(epoll_create1(EPOLL_CLOEXEC)) {}
+
+    ~AsyncRuntime() {
+        for (auto& entry : pending) {
+            if (entry.second.reader.joinable()) entry.second.reader.join();
+            if (entry.second.pid > 0) waitpid(entry.second.pid, nullptr, 0);
+            close(entry.first);
+        }
+        for (auto& entry : coroutines) {
+            munmap(entry.second->stack, entry.second->stackSize);
+        }
+        if (epollFd >= 0) close(epollFd);
+    }
+
+    void watch(int fd, PendingIo io) {
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+        pending.emplace(fd, std::move(io));
+    }
+
+    void unwatch(int fd) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        pending.erase(fd);
+    }
+};
+#endif
+
+// Numeric kernels. A function or while loop that only computes with
+// numbers and bools is compiled, once hot, to register bytecode over
+// doubles (and, with --jit, on to x86-64 machine code). Kernels have no
+// side effects, so whenever one meets something the interpreter would
+// report (division by zero, sqrt of a negative, runaway recursion) it
+// deopts: its work is dropped and the call or loop runs again in the
+// token walker, which raises the error as usual.
+
+enum ExecutionTier { TIER_INTERPRET, TIER_KERNELS, TIER_JIT };
+
+enum KernelKind : uint8_t { KIND_NUMBER = 1, KIND_BOOL = 2, KIND_NIL = 4 };
+
+enum KernelOpcode : uint8_t {
+    K_LOADK, K_MOV,
+    K_ADD, K_SUB, K_MUL, K_DIV, K_MOD, K_NEG,
+    K_EQ, K_NE, K_LT, K_LE, K_GT, K_GE,
+    K_NOT, K_TRUTH, K_AND, K_OR,
+    K_JMP, K_JMPF,
+    K_SQRT, K_ABS, K_FLOOR, K_CEIL, K_ROUND, K_POW, K_MIN, K_MAX,
+    K_CALL, K_RET,
+    // Superinstructions (see KernelCompiler::fuse): arithmetic with a
+    // constant right operand, and a comparison fused with the jump taken
+    // when it is false, against a register or a constant.
+    K_ADDK, K_SUBK, K_MULK, K_DIVK, K_MODK,
+    K_JNEQ, K_JNNE, K_JNLT, K_JNLE, K_JNGT, K_JNGE,
+    K_JNEQK, K_JNNEK, K_JNLTK, K_JNLEK, K_JNGTK, K_JNGEK,
+    K_OPCODE_COUNT
+};
+
+// Registers a, b, c; a is the destination, or the target of a jump.
+// K_CALL's c indexes Kernel::callees, K_RET's b is a KernelKind. The ...K
+// forms take their constant from k in place of register c.
+struct KernelInstr {
+    KernelOpcode op;
+    int32_t a, b, c;
+    double k;
+};
+
+struct Kernel {
+    std::vector<KernelInstr> code;
+    size_t params = 0;
+    size_t registers = 1;
+    uint8_t returnKinds = 0;
+    // Function kernels: names other than the parameters the body assigns.
+    // Each must be unbound at entry, or `let` would write the caller's.
+    std::vector<std::string> locals;
+    // Loop kernels: registers [0, names.size()) mirror these variables,
+    // loaded at entry (guarded to `kinds`) and, if written, stored back.
+    // Range kernels keep the index and the end in the next two.
+    std::vector<std::string> names;
+    std::vector<uint8_t> kinds;
+    std::vector<bool> written;
+    // Lambda kernels: captured variables, passed after the parameters.
+    std::vector<std::string> captures;
+    std::vector<Kernel*> callees;
+    bool compiling = false;
+    bool callsItself = false;
+#ifdef CHOCO_HAS_JIT
+    void* native = nullptr;
+    size_t nativeSize = 0;
+#endif
+
+    Kernel() {}
+    Kernel(const Kernel&) = delete;
+    Kernel& operator=(const Kernel&) = delete;
+    ~Kernel() {
+#ifdef CHOCO_HAS_JIT
+        if (native) munmap(native, nativeSize);
+#endif
+    }
+};
+
+struct KernelReturn {
+    double value;
+    int32_t kind;
+};
+
+// Frames for kernel calls, carved from one fixed block so native code can
+// hold pointers into it.
+struct KernelRuntime {
+    static const size_t STACK_SIZE = 1 << 15;
+    static const uint32_t MAX_DEPTH = 4096;
+    KernelReturn ret = {0, 0};
+    std::vector<double> stack;
+    size_t top = 0;
+    uint32_t depth = 0;
+};
+
+typedef int (*NativeKernel)(double* frame, KernelRuntime* rt, KernelReturn* ret);
+
+static int runKernel(const Kernel& kernel, double* r, KernelRuntime& rt);
+
+// Runs a kernel on a frame whose parameters are filled in. 0 on return,
+// 1 to deopt.
+static int enterKernel(const Kernel& kernel, double* frame, KernelRuntime& rt) {
+#ifdef CHOCO_HAS_JIT
+    if (kernel.native) return reinterpret_cast<NativeKernel>(kernel.native)(frame, &rt, &rt.ret);
+#endif
+    return runKernel(kernel, frame, rt);
+}
+
+// A call from one kernel to another, from the VM or from native code.
+static int kernelCall(KernelRuntime* rt, const Kernel* callee, const double* args, double* dest) {
+    if (rt->depth >= KernelRuntime::MAX_DEPTH || rt->top + callee->registers > rt->stack.size()) return 1;
+    double* frame = rt->stack.data() + rt->top;
+    std::copy(args, args + callee->params, frame);
+    rt->top += callee->registers;
+    rt->depth++;
+    int status = enterKernel(*callee, frame, *rt);
+    rt->top -= callee->registers;
+    rt->depth--;
+    if (status == 0) *dest = rt->ret.value;
+    return status;
+}
+
+static double kernelFmod(double a, double b) { return fmod(a, b); }
+static double kernelFloor(double a) { return floor(a); }
+static double kernelCeil(double a) { return ceil(a); }
+static double kernelRound(double a) { return round(a); }
+static double kernelPow(double a, double b) { return pow(a, b); }
+static double kernelMin(double a, double b) { return std::min(a, b); }
+static double kernelMax(double a, double b) { return std::max(a, b); }
+
+// With GCC and Clang each handler jumps straight to the next one through
+// a label table; elsewhere the loop dispatches through a switch.
+static int runKernel(const Kernel& kernel, double* r, KernelRuntime& rt) {
+    const KernelInstr* code = kernel.code.data();
+    const KernelInstr* ip = code;
+    const KernelInstr* in;
+#ifdef CHOCO_THREADED_DISPATCH
+    static const void* const handlers[] = {
+        &&op_K_LOADK, &&op_K_MOV,
+        &&op_K_ADD, &&op_K_SUB, &&op_K_MUL, &&op_K_DIV, &&op_K_MOD, &&op_K_NEG,
+        &&op_K_EQ, &&op_K_NE, &&op_K_LT, &&op_K_LE, &&op_K_GT, &&op_K_GE,
+        &&op_K_NOT, &&op_K_TRUTH, &&op_K_AND, &&op_K_OR,
+        &&op_K_JMP, &&op_K_JMPF,
+        &&op_K_SQRT, &&op_K_ABS, &&op_K_FLOOR, &&op_K_CEIL, &&op_K_ROUND, &&op_K_POW, &&op_K_MIN, &&op_K_MAX,
+        &&op_K_CALL, &&op_K_RET,
+        &&op_K_ADDK, &&op_K_SUBK, &&op_K_MULK, &&op_K_DIVK, &&op_K_MODK,
+        &&op_K_JNEQ, &&op_K_JNNE, &&op_K_JNLT, &&op_K_JNLE, &&op_K_JNGT, &&op_K_JNGE,
+        &&op_K_JNEQK, &&op_K_JNNEK, &&op_K_JNLTK, &&op_K_JNLEK, &&op_K_JNGTK, &&op_K_JNGEK
+    };
+    static_assert(sizeof(handlers) / sizeof(handlers[0]) == K_OPCODE_COUNT, "one handler per opcode");
+#define KERNEL_OP(name) op_##name:
+#define KERNEL_NEXT() goto *handlers[(in = ip++)->op]
+    KERNEL_NEXT();
+#else
+#define KERNEL_OP(name) case name:
+#define KERNEL_NEXT() continue
+    for (;;) {
+    in = ip++;
+    switch (in->op) {
+#endif
+    KERNEL_OP(K_LOADK) r[in->a] = in->k; KERNEL_NEXT();
+    KERNEL_OP(K_MOV) r[in->a] = r[in->b]; KERNEL_NEXT();
+    // Sums and products past 2^53 deopt: the interpreter may have to keep
+    // them as exact integers.
+    KERNEL_OP(K_ADD)
+        r[in->a] = r[in->b] + r[in->c];
+        if (fabs(r[in->a]) >= EXACT_INTEGER_LIMIT) return 1;
+        KERNEL_NEXT();
+    KERNEL_OP(K_SUB)
+        r[in->a] = r[in->b] - r[in->c];
+        if (fabs(r[in->a]) >= EXACT_INTEGER_LIMIT) return 1;
+        KERNEL_NEXT();
+    KERNEL_OP(K_MUL)
+        r[in->a] = r[in->b] * r[in->c];
+        if (fabs(r[in->a]) >= EXACT_INTEGER_LIMIT) return 1;
+        KERNEL_NEXT();
+    KERNEL_OP(K_DIV)
+        if (r[in->c] == 0) return 1;
+        r[in->a] = r[in->b] / r[in->c];
+        KERNEL_NEXT();
+    KERNEL_OP(K_MOD)
+        if (r[in->c] == 0) return 1;
+        r[in->a] = fmod(r[in->b], r[in->c]);
+        KERNEL_NEXT();
+    KERNEL_OP(K_NEG) r[in->a] = -r[in->b]; KERNEL_NEXT();
+    KERNEL_OP(K_EQ) r[in->a] = r[in->b] == r[in->c] ? 1 : 0; KERNEL_NEXT();
+    KERNEL_OP(K_NE) r[in->a] = r[in->b] != r[in->c] ? 1 : 0; KERNEL_NEXT();
+    KERNEL_OP(K_LT) r[in->a] = r[in->b] < r[in->c] ? 1 : 0; KERNEL_NEXT();
+    KERNEL_OP(K_LE) r[in->a] = r[in->b] <= r[in->c] ? 1 : 0; KERNEL_NEXT();
+    KERNEL_OP(K_GT) r[in->a] = r[in->b] > r[in->c] ? 1 : 0; KERNEL_NEXT();
+    KERNEL_OP(K_GE) r[in->a] = r[in->b] >= r[in->c] ? 1 : 0; KERNEL_NEXT();
+    KERNEL_OP(K_NOT) r[in->a] = r[in->b] == 0 ? 1 : 0; KERNEL_NEXT();
+    KERNEL_OP(K_TRUTH) r[in->a] = r[in->b] != 0 ? 1 : 0; KERNEL_NEXT();
+    KERNEL_OP(K_AND) r[in->a] = r[in->b] * r[in->c]; KERNEL_NEXT();
+    KERNEL_OP(K_OR) r[in->a] = std::max(r[in->b], r[in->c]); KERNEL_NEXT();
+    KERNEL_OP(K_JMP) ip = code + in->a; KERNEL_NEXT();
+    KERNEL_OP(K_JMPF)
+        if (r[in->b] == 0) ip = code + in->a;
+        KERNEL_NEXT();
+    KERNEL_OP(K_SQRT)
+        if (r[in->b] < 0) return 1;
+        r[in->a] = sqrt(r[in->b]);
+        KERNEL_NEXT();
+    KERNEL_OP(K_ABS) r[in->a] = fabs(r[in->b]); KERNEL_NEXT();
+    KERNEL_OP(K_FLOOR) r[in->a] = floor(r[in->b]); KERNEL_NEXT();
+    KERNEL_OP(K_CEIL) r[in->a] = ceil(r[in->b]); KERNEL_NEXT();
+    KERNEL_OP(K_ROUND) r[in->a] = round(r[in->b]); KERNEL_NEXT();
+    KERNEL_OP(K_POW) r[in->a] = pow(r[in->b], r[in->c]); KERNEL_NEXT();
+    KERNEL_OP(K_MIN) r[in->a] = std::min(r[in->b], r[in->c]); KERNEL_NEXT();
+    KERNEL_OP(K_MAX) r[in->a] = std::max(r[in->b], r[in->c]); KERNEL_NEXT();
+    KERNEL_OP(K_CALL)
+        if (kernelCall(&rt, kernel.callees[in->c], r + in->b, r + in->a)) return 1;
+        KERNEL_NEXT();
+    KERNEL_OP(K_RET)
+        rt.ret.value = r[in->a];
+        rt.ret.kind = in->b;
+        return 0;
+    // Fused only where the constant cannot deopt.
+    KERNEL_OP(K_ADDK)
+        r[in->a] = r[in->b] + in->k;
+        if (fabs(r[in->a]) >= EXACT_INTEGER_LIMIT) return 1;
+        KERNEL_NEXT();
+    KERNEL_OP(K_SUBK)
+        r[in->a] = r[in->b] - in->k;
+        if (fabs(r[in->a]) >= EXACT_INTEGER_LIMIT) return 1;
+        KERNEL_NEXT();
+    KERNEL_OP(K_MULK)
+        r[in->a] = r[in->b] * in->k;
+        if (fabs(r[in->a]) >= EXACT_INTEGER_LIMIT) return 1;
+        KERNEL_NEXT();
+    KERNEL_OP(K_DIVK) r[in->a] = r[in->b] / in->k; KERNEL_NEXT();
+    KERNEL_OP(K_MODK) r[in->a] = fmod(r[in->b], in->k); KERNEL_NEXT();
+    KERNEL_OP(K_JNEQ) if (!(r[in->b] == r[in->c])) ip = code + in->a; KERNEL_NEXT();
+    KERNEL_OP(K_JNNE) if (!(r[in->b] != r[in->c])) ip = code + in->a; KERNEL_NEXT();
+    KERNEL_OP(K_JNLT) if (!(r[in->b] < r[in->c])) ip = code + in->a; KERNEL_NEXT();
+    KERNEL_OP(K_JNLE) if (!(r[in->b] <= r[in->c])) ip = code + in->a; KERNEL_NEXT();
+    KERNEL_OP(K_JNGT) if (!(r[in->b] > r[in->c])) ip = code + in->a; KERNEL_NEXT();
+    KERNEL_OP(K_JNGE) if (!(r[in->b] >= r[in->c])) ip = code + in->a; KERNEL_NEXT();
+    KERNEL_OP(K_JNEQK) if (!(r[in->b] == in->k)) ip = code + in->a; KERNEL_NEXT();
+    KERNEL_OP(K_JNNEK) if (!(r[in->b] != in->k)) ip = code + in->a; KERNEL_NEXT();
+    KERNEL_OP(K_JNLTK) if (!(r[in->b] < in->k)) ip = code + in->a; KERNEL_NEXT();
+    KERNEL_OP(K_JNLEK) if (!(r[in->b] <= in->k)) ip = code + in->a; KERNEL_NEXT();
+    KERNEL_OP(K_JNGTK) if (!(r[in->b] > in->k)) ip = code + in->a; KERNEL_NEXT();
+    KERNEL_OP(K_JNGEK) if (!(r[in->b] >= in->k)) ip = code + in->a; KERNEL_NEXT();
+#ifndef CHOCO_THREADED_DISPATCH
+    case K_OPCODE_COUNT:
+        return 1;
+    }
+    }
+#endif
+#undef KERNEL_OP
+#undef KERNEL_NEXT
+}
+
+// Compiles a function body or a while loop to a Kernel, mirroring the
+// interpreter statement for statement. Throws Unsupported at the first
+// construct a kernel cannot run exactly as the interpreter would.
+class KernelCompiler {
+public:
+    struct Unsupported {};
+
+    struct Environment {
+        std::function<bool(const std::string&)> isCallable;
+        std::function<bool(const std::string&)> isBuiltin;
+        std::function<bool(const std::string&)> isStruct;
+        // The kernel for a user function called from `caller`, or null.
+        std::function<Kernel*(const std::string&, Kernel* caller)> callee;
+    };
+
+    KernelCompiler(const TokenStream& code, const Environment& environment, Kernel& target)
+        : tokens(code), env(environment), kernel(target) {}
+
+    void compileFunction(const std::vector<std::string>& params, size_t bodyStart, size_t bodyEnd) {
+        inFunction = true;
+        kernel.params = params.size();
+        for (const auto& param : params) declare(param, KIND_NUMBER, true);
+        if (order.size() != params.size()) throw Unsupported();
+        collectNames(bodyStart, bodyEnd);
+        startTemps();
+        pos = bodyStart;
+        bool returns = false;
+        while (pos < bodyEnd) {
+            nextTemp = firstTemp;
+            returns = statement() || returns;
+        }
+        if (pos != bodyEnd) throw Unsupported();
+        if (!returns) {
+            emit(K_RET, 0, KIND_NIL);
+            kernel.returnKinds |= KIND_NIL;
+        }
+        fuse();
+        for (size_t i = params.size(); i < order.size(); i++) {
+            if (variables[order[i]].written) kernel.locals.push_back(order[i]);
+        }
+    }
+
+    // `kindOf` gives the kind each variable has on entry, 0 if it cannot
+    // be mirrored in a register.
+    void compileLoop(size_t conditionStart, const std::function<uint8_t(const std::string&)>& kindOf) {
+        size_t end = conditionStart;
+        while (end < tokens.size() && tokens[end].type != TOKEN_LBRACE) end++;
+        collectNames(conditionStart, blockEnd(end + 1));
+        for (auto& name : order) {
+            Variable& var = variables[name];
+            var.kind = kindOf(name);
+            if (var.kind != KIND_NUMBER && var.kind != KIND_BOOL) throw Unsupported();
+            var.assigned = true;
+        }
+        startTemps();
+        pos = conditionStart;
+        nextTemp = firstTemp;
+        whileLoop();
+        emit(K_RET, 0, KIND_NIL);
+        fuse();
+        for (auto& name : order) {
+            kernel.names.push_back(name);
+            kernel.kinds.push_back(variables[name].kind);
+            kernel.written.push_back(variables[name].written);
+        }
+    }
+
+    // The rest of `for var in a..b { body }`, whose body is [bodyStart,
+    // bodyEnd). The two registers after the mirrored variables hold the
+    // index before the next iteration and the end of the range.
+    void compileRange(const std::string& var, size_t bodyStart, size_t bodyEnd,
+                      const std::function<uint8_t(const std::string&)>& kindOf) {
+        declare(var, 0, false);
+        collectNames(bodyStart, bodyEnd);
+        for (auto& name : order) {
+            Variable& v = variables[name];
+            v.kind = kindOf(name);
+            if (v.kind != KIND_NUMBER && v.kind != KIND_BOOL) throw Unsupported();
+            v.assigned = true;
+        }
+        Variable& counter = variables[var];
+        if (counter.kind != KIND_NUMBER) throw Unsupported();
+        int index = static_cast<int>(order.size());
+        int end = index + 1;
+        firstTemp = nextTemp = end + 1;
+        kernel.registers = std::max<size_t>(kernel.registers, firstTemp);
+
+        size_t start = emit(K_ADDK, index, index, 0, 1);
+        int more = temp();
+        emit(K_LT, more, index, end);
+        size_t exit = emit(K_JMPF, 0, more);
+        emit(K_MOV, counter.reg, index);
+        counter.written = true;
+        loops.push_back({start, {}});
+        pos = bodyStart;
+        nextTemp = firstTemp;
+        block();
+        if (pos != bodyEnd + 1) throw Unsupported();
+        emit(K_JMP, static_cast<int32_t>(start));
+        patch(exit);
+        for (size_t jump : loops.back().breaks) patch(jump);
+        loops.pop_back();
+        emit(K_RET, 0, KIND_NIL);
+        fuse();
+        for (auto& name : order) {
+            kernel.names.push_back(name);
+            kernel.kinds.push_back(variables[name].kind);
+            kernel.written.push_back(variables[name].written);
+        }
+    }
+
+private:
+    struct Variable {
+        int reg = 0;
+        uint8_t kind = 0;
+        bool assigned = false;  // definitely assigned at this point
+        bool written = false;
+    };
+    struct Operand {
+        int reg;
+        uint8_t kind;
+    };
+    struct Loop {
+        size_t start;
+        std::vector<size_t> breaks;
+    };
+
+    const TokenStream& tokens;
+    const Environment& env;
+    Kernel& kernel;
+    size_t pos = 0;
+    bool inFunction = false;
+    std::unordered_map<std::string, Variable> variables;
+    std::vector<std::string> order;
+    std::vector<Loop> loops;
+    int firstTemp = 0;
+    int nextTemp = 0;
+
+    void declare(const std::string& name, uint8_t kind, bool assigned) {
+        if (variables.count(name)) return;
+        Variable var;
+        var.reg = static_cast<int>(order.size());
+        var.kind = kind;
+        var.assigned = assigned;
+        variables[name] = var;
+        order.push_back(name);
+    }
+
+    // Gives every name read or written in [start, end) a register of its own.
+    void collectNames(size_t start, size_t end) {
+        for (size_t i = start; i < end && i < tokens.size(); i++) {
+            if (tokens[i].type != TOKEN_IDENTIFIER) continue;
+            if (i > start && tokens[i - 1].type == TOKEN_DOT) continue;
+            if (i + 1 < tokens.size() && tokens[i + 1].type == TOKEN_LPAREN) continue;
+            if (env.isCallable(tokens[i].value)) continue;
+            declare(tokens[i].value, 0, false);
+        }
+    }
+
+    size_t blockEnd(size_t start) const {
+        int depth = 1;
+        size_t i = start;
+        while (i < tokens.size()) {
+            if (tokens[i].type == TOKEN_LBRACE) depth++;
+            else if (tokens[i].type == TOKEN_RBRACE && --depth == 0) break;
+            i++;
+        }
+        return i;
+    }
+
+    void startTemps() {
+        firstTemp = nextTemp = static_cast<int>(order.size());
+        kernel.registers = std::max<size_t>(kernel.registers, order.size());
+    }
+
+    int temp() {
+        int reg = nextTemp++;
+        kernel.registers = std::max<size_t>(kernel.registers, nextTemp);
+        return reg;
+    }
+
+    size_t emit(KernelOpcode op, int32_t a = 0, int32_t b = 0, int32_t c = 0, double k = 0) {
+        kernel.code.push_back({op, a, b, c, k});
+        return kernel.code.size() - 1;
+    }
+
+    void patch(size_t jump) { kernel.code[jump].a = static_cast<int32_t>(kernel.code.size()); }
+
+    bool check(TokenType type) const { return pos < tokens.size() && tokens[pos].type == type; }
+
+    bool match(TokenType type) {
+        if (!check(type)) return false;
+        pos++;
+        return true;
+    }
+
+    void expect(TokenType type) {
+        if (!match(type)) throw Unsupported();
+    }
+
+    std::vector<bool> assignedState() const {
+        std::vector<bool> state;
+        for (const auto& name : order) state.push_back(variables.at(name).assigned);
+        return state;
+    }
+
+    void restoreAssigned(const std::vector<bool>& state) {
+        for (size_t i = 0; i < order.size(); i++) variables[order[i]].assigned = state[i];
+    }
+
+    void assign(const std::string& name, Operand value) {
+        auto it = variables.find(name);
+        if (it == variables.end()) throw Unsupported();
+        Variable& var = it->second;
+        if (var.kind == 0) var.kind = value.kind;
+        if (var.kind != value.kind) throw Unsupported();
+        if (value.reg != var.reg) emit(K_MOV, var.reg, value.reg);
+        var.assigned = true;
+        var.written = true;
+    }
+
+    // Returns whether the statement always returns.
+    bool statement() {
+        if (match(TOKEN_LET)) {
+            if (!check(TOKEN_IDENTIFIER)) throw Unsupported();
+            std::string name = tokens[pos++].value;
+            expect(TOKEN_EQUAL);
+            assign(name, expression());
+            expect(TOKEN_SEMICOLON);
+            return false;
+        }
+        if (match(TOKEN_BREAK)) {
+            if (loops.empty()) throw Unsupported();
+            loops.back().breaks.push_back(emit(K_JMP));
+            match(TOKEN_SEMICOLON);
+            return false;
+        }
+        if (match(TOKEN_CONTINUE)) {
+            if (loops.empty()) throw Unsupported();
+            emit(K_JMP, static_cast<int32_t>(loops.back().start));
+            match(TOKEN_SEMICOLON);
+            return false;
+        }
+        if (match(TOKEN_IF)) return ifStatement();
+        if (match(TOKEN_WHILE)) {
+            whileLoop();
+            return false;
+        }
+        if (match(TOKEN_RETURN)) {
+            if (!inFunction) throw Unsupported();
+            Operand value = expression();
+            expect(TOKEN_SEMICOLON);
+            emit(K_RET, value.reg, value.kind);
+            kernel.returnKinds |= value.kind;
+            return true;
+        }
+        if (check(TOKEN_IDENTIFIER) && pos + 1 < tokens.size() && tokens[pos + 1].type == TOKEN_EQUAL) {
+            std::string name = tokens[pos].value;
+            pos += 2;
+            assign(name, expression());
+            expect(TOKEN_SEMICOLON);
+            return false;
+        }
+        switch (pos < tokens.size() ? tokens[pos].type : TOKEN_EOF) {
+            case TOKEN_FN: case TOKEN_ASYNC: case TOKEN_STRUCT: case TOKEN_IMPORT: case TOKEN_TRY:
+            case TOKEN_THROW: case TOKEN_PRINT: case TOKEN_FOR: case TOKEN_MATCH: case TOKEN_EOF:
+                throw Unsupported();
+            default:
+                break;
+        }
+        expression();
+        expect(TOKEN_SEMICOLON);
+        return false;
+    }
+
+    // Statements up to the closing brace. Returns whether one always returns.
+    bool block() {
+        bool returns = false;
+        while (!match(TOKEN_RBRACE)) {
+            if (pos >= tokens.size()) throw Unsupported();
+            int saved = nextTemp;
+            returns = statement() || returns;
+            nextTemp = saved;
+        }
+        return returns;
+    }
+
+    bool ifStatement() {
+        Operand condition = expression();
+        expect(TOKEN_LBRACE);
+        size_t skipThen = emit(K_JMPF, 0, condition.reg);
+        std::vector<bool> before = assignedState();
+        bool thenReturns = block();
+        if (!match(TOKEN_ELSE)) {
+            patch(skipThen);
+            restoreAssigned(before);
+            return false;
+        }
+        expect(TOKEN_LBRACE);
+        size_t skipElse = emit(K_JMP);
+        patch(skipThen);
+        std::vector<bool> afterThen = assignedState();
+        restoreAssigned(before);
+        bool elseReturns = block();
+        patch(skipElse);
+        std::vector<bool> afterElse = assignedState();
+        for (size_t i = 0; i < order.size(); i++) {
+            bool assigned = thenReturns ? afterElse[i] : elseReturns ? afterThen[i] : afterThen[i] && afterElse[i];
+            variables[order[i]].assigned = assigned;
+        }
+        return thenReturns && elseReturns;
+    }
+
+    void whileLoop() {
+        size_t start = kernel.code.size();
+        Operand condition = expression();
+        // The interpreter only loops while the condition is a true bool.
+        if (condition.kind != KIND_BOOL) throw Unsupported();
+        expect(TOKEN_LBRACE);
+        size_t exit = emit(K_JMPF, 0, condition.reg);
+        loops.push_back({start, {}});
+        std::vector<bool> before = assignedState();
+        block();
+        restoreAssigned(before);
+        emit(K_JMP, static_cast<int32_t>(start));
+        patch(exit);
+        for (size_t jump : loops.back().breaks) patch(jump);
+        loops.pop_back();
+    }
+
+    static bool writesRegister(KernelOpcode op) {
+        return op != K_JMP && op != K_JMPF && op != K_RET && (op < K_JNEQ || op > K_JNGEK);
+    }
+
+    // Rewrites the most frequent instruction sequences in hot kernels
+    // (counted over the test and benchmark scripts) as one instruction:
+    //   LOADK t, k; ADD d, x, t        ->  ADDK d, x, k   (also SUB, MUL, DIV, MOD)
+    //   LT d, x, y; JMPF L, d          ->  JNLT L, x, y   (all six comparisons)
+    //   LOADK t, k; LT d, x, t; JMPF   ->  JNLTK L, x, k
+    //   ADD t, x, y; MOV v, t          ->  ADD v, x, y    (any instruction writing t)
+    // Only temporaries are elided, each of which is read exactly once, and
+    // never across a jump target.
+    void fuse() {
+        std::vector<KernelInstr>& code = kernel.code;
+        std::vector<bool> target(code.size() + 1, false);
+        for (const KernelInstr& in : code) {
+            if (in.op == K_JMP || in.op == K_JMPF) target[in.a] = true;
+        }
+        auto temporary = [&](int32_t reg) { return reg >= firstTemp; };
+        auto compareJump = [](KernelOpcode op, bool constant) -> int {
+            if (op < K_EQ || op > K_GE) return -1;
+            return (constant ? K_JNEQK : K_JNEQ) + (op - K_EQ);
+        };
+
+        std::vector<KernelInstr> fused;
+        std::vector<int32_t> moved(code.size() + 1);
+        size_t i = 0;
+        while (i < code.size()) {
+            moved[i] = static_cast<int32_t>(fused.size());
+            const KernelInstr& in = code[i];
+            const KernelInstr* next = i + 1 < code.size() && !target[i + 1] ? &code[i + 1] : nullptr;
+            const KernelInstr* third = next && i + 2 < code.size() && !target[i + 2] ? &code[i + 2] : nullptr;
+            size_t used = 1;
+            KernelInstr out = in;
+            if (in.op == K_LOADK && temporary(in.a) && next && next->c == in.a && next->b != in.a) {
+                int jump = compareJump(next->op, true);
+                bool nonzero = in.k != 0;
+                if (jump >= 0 && third && third->op == K_JMPF && third->b == next->a && temporary(next->a)) {
+                    out = {static_cast<KernelOpcode>(jump), third->a, next->b, 0, in.k};
+                    used = 3;
+                } else if (next->op == K_ADD || next->op == K_SUB || next->op == K_MUL ||
+                           (nonzero && (next->op == K_DIV || next->op == K_MOD))) {
+                    KernelOpcode op = next->op == K_ADD ? K_ADDK : next->op == K_SUB ? K_SUBK :
+                                      next->op == K_MUL ? K_MULK : next->op == K_DIV ? K_DIVK : K_MODK;
+                    out = {op, next->a, next->b, 0, in.k};
+                    used = 2;
+                }
+            } else if (compareJump(in.op, false) >= 0 && temporary(in.a) && next && next->op == K_JMPF &&
+                       next->b == in.a) {
+                out = {static_cast<KernelOpcode>(compareJump(in.op, false)), next->a, in.b, in.c, 0};
+                used = 2;
+            }
+            for (size_t j = 1; j < used; j++) moved[i + j] = moved[i];
+            i += used;
+            // Store to a variable: write it directly.
+            if (writesRegister(out.op) && temporary(out.a) && i < code.size() && !target[i] &&
+                code[i].op == K_MOV && code[i].b == out.a) {
+                out.a = code[i].a;
+                moved[i] = static_cast<int32_t>(fused.size());
+                i++;
+            }
+            fused.push_back(out);
+        }
+        moved[code.size()] = static_cast<int32_t>(fused.size());
+        for (KernelInstr& in : fused) {
+            if (in.op == K_JMP || in.op == K_JMPF || (in.op >= K_JNEQ && in.op <= K_JNGEK)) in.a = moved[in.a];
+        }
+        code.swap(fused);
+    }
+
+    Operand expression() { return logicalOr(); }
+
+    int truth(Operand value) {
+        if (value.kind == KIND_BOOL) return value.reg;
+        int reg = temp();
+        emit(K_TRUTH, reg, value.reg);
+        return reg;
+    }
+
+    // Both sides are always evaluated, as in the interpreter.
+    Operand logicalOr() {
+        Operand left = logicalAnd();
+        while (match(TOKEN_OR)) {
+            Operand right = logicalAnd();
+            int l = truth(left), r = truth(right);
+            int dest = temp();
+            emit(K_OR, dest, l, r);
+            left = {dest, KIND_BOOL};
+        }
+        return left;
+    }
+
+    Operand logicalAnd() {
+        Operand left = comparison();
+        while (match(TOKEN_AND)) {
+            Operand right = comparison();
+            int l = truth(left), r = truth(right);
+            int dest = temp();
+            emit(K_AND, dest, l, r);
+            left = {dest, KIND_BOOL};
+        }
+        return left;
+    }
+
+    Operand comparison() {
+        Operand left = term();
+        while (pos < tokens.size()) {
+            KernelOpcode op;
+            switch (tokens[pos].type) {
+                case TOKEN_EQUAL_EQUAL: op = K_EQ; break;
+                case TOKEN_BANG_EQUAL: op = K_NE; break;
+                case TOKEN_LESS: op = K_LT; break;
+                case TOKEN_LESS_EQUAL: op = K_LE; break;
+                case TOKEN_GREATER: op = K_GT; break;
+                case TOKEN_GREATER_EQUAL: op = K_GE; break;
+                default: return left;
+            }
+            pos++;
+            Operand right = term();
+            if (left.kind != right.kind) throw Unsupported();
+            if (left.kind == KIND_BOOL && op != K_EQ && op != K_NE) throw Unsupported();
+            int dest = temp();
+            emit(op, dest, left.reg, right.reg);
+            left = {dest, KIND_BOOL};
+        }
+        return left;
+    }
+
+    Operand arithmetic(KernelOpcode op, Operand left, Operand right) {
+        if (left.kind != KIND_NUMBER || right.kind != KIND_NUMBER) throw Unsupported();
+        int dest = temp();
+        emit(op, dest, left.reg, right.reg);
+        return {dest, KIND_NUMBER};
+    }
+
+    Operand term() {
+        Operand left = factor();
+        while (check(TOKEN_PLUS) || check(TOKEN_MINUS)) {
+            KernelOpcode op = tokens[pos++].type == TOKEN_PLUS ? K_ADD : K_SUB;
+            left = arithmetic(op, left, factor());
+        }
+        return left;
+    }
+
+    Operand factor() {
+        Operand left = unary();
+        while (check(TOKEN_STAR) || check(TOKEN_SLASH) || check(TOKEN_PERCENT)) {
+            TokenType type = tokens[pos++].type;
+            KernelOpcode op = type == TOKEN_STAR ? K_MUL : type == TOKEN_SLASH ? K_DIV : K_MOD;
+            left = arithmetic(op, left, unary());
+        }
+        return left;
+    }
+
+    Operand unary() {
+        if (match(TOKEN_BANG)) {
+            Operand value = unary();
+            int dest = temp();
+            // `!` of anything but a bool is false.
+            if (value.kind == KIND_BOOL) emit(K_NOT, dest, value.reg);
+            else emit(K_LOADK, dest, 0, 0, 0);
+            return {dest, KIND_BOOL};
+        }
+        if (match(TOKEN_MINUS)) {
+            Operand value = unary();
+            if (value.kind != KIND_NUMBER) throw Unsupported();
+            int dest = temp();
+            emit(K_NEG, dest, value.reg);
+            return {dest, KIND_NUMBER};
+        }
+        Operand value = primary();
+        if (check(TOKEN_LPAREN) || check(TOKEN_LBRACKET) || check(TOKEN_DOT)) throw Unsupported();
+        return value;
+    }
+
+    Operand primary() {
+        if (pos >= tokens.size()) throw Unsupported();
+        const Token& token = tokens[pos];
+        if (token.type == TOKEN_NUMBER || token.type == TOKEN_TRUE || token.type == TOKEN_FALSE) {
+            int dest = temp();
+            if (token.type == TOKEN_NUMBER) {
+                // Past 2^53 a literal may be a wide integer.
+                if (!(std::fabs(tokens.number(pos)) < EXACT_INTEGER_LIMIT)) throw Unsupported();
+                emit(K_LOADK, dest, 0, 0, tokens.number(pos));
+            } else {
+                emit(K_LOADK, dest, 0, 0, token.type == TOKEN_TRUE ? 1 : 0);
+            }
+            pos++;
+            return {dest, token.type == TOKEN_NUMBER ? KIND_NUMBER : KIND_BOOL};
+        }
+        if (token.type == TOKEN_IDENTIFIER) {
+            const std::string& name = token.value;
+            pos++;
+            if (env.isStruct(name) && check(TOKEN_LBRACE)) throw Unsupported();
+            if (check(TOKEN_LPAREN)) return callExpression(name);
+            if (env.isCallable(name)) throw Unsupported();
+            auto it = variables.find(name);
+            if (it == variables.end() || !it->second.assigned) throw Unsupported();
+            return {it->second.reg, it->second.kind};
+        }
+        if (match(TOKEN_LPAREN)) {
+            Operand value = expression();
+            expect(TOKEN_RPAREN);
+            return value;
+        }
+        throw Unsupported();
+    }
+
+    Operand callExpression(const std::string& name) {
+        expect(TOKEN_LPAREN);
+        std::vector<Operand> args;
+        while (!match(TOKEN_RPAREN)) {
+            args.push_back(expression());
+            if (!match(TOKEN_COMMA)) {
+                expect(TOKEN_RPAREN);
+                break;
+            }
+        }
+        if (env.isBuiltin(name)) return mathCall(name, args);
+        if (!env.isCallable(name)) throw Unsupported();
+
+        Kernel* callee = env.callee(name, &kernel);
+        if (!callee) throw Unsupported();
+        if (args.size() < callee->params) throw Unsupported();
+        uint8_t kind;
+        if (callee == &kernel) {
+            // Checked against the finished body in Interpreter::compileFunctionKernel.
+            kernel.callsItself = true;
+            kind = KIND_NUMBER;
+        } else if (callee->returnKinds == KIND_NUMBER || callee->returnKinds == KIND_BOOL) {
+            kind = callee->returnKinds;
+        } else {
+            throw Unsupported();
+        }
+
+        int base = nextTemp;
+        for (size_t i = 0; i < callee->params; i++) {
+            if (args[i].kind != KIND_NUMBER) throw Unsupported();
+            emit(K_MOV, temp(), args[i].reg);
+        }
+        int dest = temp();
+        auto known = std::find(kernel.callees.begin(), kernel.callees.end(), callee);
+        size_t index = known - kernel.callees.begin();
+        if (known == kernel.callees.end()) kernel.callees.push_back(callee);
+        emit(K_CALL, dest, base, static_cast<int32_t>(index));
+        return {dest, kind};
+    }
+
+    Operand mathCall(const std::string& name, const std::vector<Operand>& args) {
+        static const std::unordered_map<std::string, KernelOpcode> unaryMath = {
+            {"sqrt", K_SQRT}, {"abs", K_ABS}, {"floor", K_FLOOR}, {"ceil", K_CEIL}, {"round", K_ROUND}
+        };
+        static const std::unordered_map<std::string, KernelOpcode> binaryMath = {
+            {"pow", K_POW}, {"min", K_MIN}, {"max", K_MAX}
+        };
+        int dest;
+        auto one = unaryMath.find(name);
+        if (one != unaryMath.end()) {
+            if (args.empty() || args[0].kind != KIND_NUMBER) throw Unsupported();
+            dest = temp();
+            emit(one->second, dest, args[0].reg);
+            return {dest, KIND_NUMBER};
+        }
+        auto two = binaryMath.find(name);
+        if (two == binaryMath.end() || args.size() < 2 || args[0].kind != KIND_NUMBER ||
+            args[1].kind != KIND_NUMBER) {
+            throw Unsupported();
+        }
+        dest = temp();
+        emit(two->second, dest, args[0].reg, args[1].reg);
+        return {dest, KIND_NUMBER};
+    }
+};
+
+#ifdef CHOCO_HAS_JIT
+// Baseline x86-64 code for a kernel: each instruction becomes a fixed
+// template over the frame in memory (rbx), with rt in r12 and the return
+// slot in r13. Library math and kernel calls go through the C helpers.
+class KernelAssembler {
+public:
+    explicit KernelAssembler(const Kernel& k) : kernel(k) {}
+
+    // Leaves kernel.native unset if executable memory is unavailable.
+    void assemble(Kernel& target) {
+        bytes(0x53, 0x41, 0x54, 0x41, 0x55);  // push rbx; push r12; push r13
+        bytes(0x48, 0x89, 0xFB);              // mov rbx, rdi
+        bytes(0x49, 0x89, 0xF4);              // mov r12, rsi
+        bytes(0x49, 0x89, 0xD5);              // mov r13, rdx
+        for (const KernelInstr& in : kernel.code) {
+            offsets.push_back(code.size());
+            instruction(in);
+        }
+        size_t deopt = code.size();
+        bytes(0xB8);
+        imm32(1);  // mov eax, 1
+        epilogue();
+        for (const auto& fixup : jumps) {
+            size_t target = fixup.second < 0 ? deopt : offsets[fixup.second];
+            int32_t rel = static_cast<int32_t>(target - (fixup.first + 4));
+            memcpy(&code[fixup.first], &rel, 4);
+        }
+
+        size_t size = (code.size() + 4095) & ~static_cast<size_t>(4095);
+        void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) return;
+        memcpy(memory, code.data(), code.size());
+        if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+            munmap(memory, size);
+            return;
+        }
+        target.native = memory;
+        target.nativeSize = size;
+    }
+
+private:
+    const Kernel& kernel;
+    std::vector<uint8_t> code;
+    std::vector<size_t> offsets;
+    std::vector<std::pair<size_t, int>> jumps;  // rel32 position, instruction (-1: deopt)
+
+    template <typename... T>
+    void bytes(T... b) {
+        for (int value : {static_cast<int>(b)...}) code.push_back(static_cast<uint8_t>(value));
+    }
+
+    void imm32(int32_t value) {
+        uint8_t raw[4];
+        memcpy(raw, &value, 4);
+        code.insert(code.end(), raw, raw + 4);
+    }
+
+    void imm64(uint64_t value) {
+        uint8_t raw[8];
+        memcpy(raw, &value, 8);
+        code.insert(code.end(), raw, raw + 8);
+    }
+
+    void jumpTo(int instruction) {
+        jumps.push_back({code.size(), instruction});
+        imm32(0);
+    }
+
+    // Register operand: [rbx + 8 * reg] with a 32-bit displacement.
+    void slot(uint8_t modrm, int reg) {
+        code.push_back(modrm);
+        imm32(reg * 8);
+    }
+
+    void load(int xmm, int reg) { bytes(0xF2, 0x0F, 0x10); slot(0x83 | (xmm << 3), reg); }
+    void store(int reg) { bytes(0xF2, 0x0F, 0x11); slot(0x83, reg); }  // from xmm0
+    void loadPair(const KernelInstr& in) { load(0, in.b); load(1, in.c); }
+    void zeroXmm(int xmm) { bytes(0x66, 0x0F, 0x57, 0xC0 | (xmm << 3) | xmm); }
+
+    void callHelper(const void* fn) {
+        bytes(0x48, 0xB8);
+        imm64(reinterpret_cast<uint64_t>(fn));  // mov rax, fn
+        bytes(0xFF, 0xD0);                       // call rax
+    }
+
+    // al = flag, then xmm0 = al as 0.0 / 1.0, stored to a.
+    void storeFlag(int a) {
+        bytes(0x0F, 0xB6, 0xC0);        // movzx eax, al
+        bytes(0xF2, 0x0F, 0x2A, 0xC0);  // cvtsi2sd xmm0, eax
+        store(a);
+    }
+
+    // ucomisd sets ZF, PF and CF on NaN, so `==` also needs PF clear and
+    // `<` / `<=` are `>` / `>=` with the operands swapped.
+    void compare(KernelOpcode op, int a) {
+        switch (op) {
+            case K_EQ:
+                bytes(0x66, 0x0F, 0x2E, 0xC1, 0x0F, 0x94, 0xC0, 0x0F, 0x9B, 0xC1, 0x20, 0xC8);
+                break;
+            case K_NE:
+                bytes(0x66, 0x0F, 0x2E, 0xC1, 0x0F, 0x95, 0xC0, 0x0F, 0x9A, 0xC1, 0x08, 0xC8);
+                break;
+            case K_LT: bytes(0x66, 0x0F, 0x2E, 0xC8, 0x0F, 0x97, 0xC0); break;
+            case K_LE: bytes(0x66, 0x0F, 0x2E, 0xC8, 0x0F, 0x93, 0xC0); break;
+            case K_GT: bytes(0x66, 0x0F, 0x2E, 0xC1, 0x0F, 0x97, 0xC0); break;
+            default: bytes(0x66, 0x0F, 0x2E, 0xC1, 0x0F, 0x93, 0xC0); break;
+        }
+        storeFlag(a);
+    }
+
+    void constant(double k) {
+        uint64_t bits;
+        memcpy(&bits, &k, 8);
+        bytes(0x48, 0xB8);
+        imm64(bits);                          // mov rax, k
+        bytes(0x66, 0x48, 0x0F, 0x6E, 0xC8);  // movq xmm1, rax
+    }
+
+    // Jumps to instruction `target` unless `xmm0 op xmm1` holds; NaN
+    // operands make every comparison but != false.
+    void jumpUnless(KernelOpcode op, int target) {
+        switch (op) {
+            case K_EQ:
+                bytes(0x66, 0x0F, 0x2E, 0xC1, 0x0F, 0x8A);  // jp target
+                jumpTo(target);
+                bytes(0x0F, 0x85);                          // jne target
+                break;
+            case K_NE: bytes(0x66, 0x0F, 0x2E, 0xC1, 0x7A, 0x06, 0x0F, 0x84); break;  // jp +6; je
+            case K_LT: bytes(0x66, 0x0F, 0x2E, 0xC8, 0x0F, 0x86); break;              // jbe
+            case K_LE: bytes(0x66, 0x0F, 0x2E, 0xC8, 0x0F, 0x82); break;              // jb
+            case K_GT: bytes(0x66, 0x0F, 0x2E, 0xC1, 0x0F, 0x86); break;
+            default: bytes(0x66, 0x0F, 0x2E, 0xC1, 0x0F, 0x82); break;
+        }
+        jumpTo(target);
+    }
+
+    // Deopts when xmm1 is zero (a NaN divisor goes through).
+    void deoptOnZeroDivisor() {
+        zeroXmm(2);
+        bytes(0x66, 0x0F, 0x2E, 0xCA);  // ucomisd xmm1, xmm2
+        bytes(0x7A, 0x06, 0x0F, 0x84);  // jp +6; je deopt
+        jumpTo(-1);
+    }
+
+    // Deopts when |xmm0| >= 2^53 (NaN goes through), as the VM does.
+    void deoptPastExactIntegers() {
+        bytes(0x66, 0x0F, 0x28, 0xC8);  // movapd xmm1, xmm0
+        bytes(0x48, 0xB8);
+        imm64(0x7FFFFFFFFFFFFFFFull);
+        bytes(0x66, 0x48, 0x0F, 0x6E, 0xD0);  // movq xmm2, rax
+        bytes(0x66, 0x0F, 0x54, 0xCA);        // andpd xmm1, xmm2
+        double limit = EXACT_INTEGER_LIMIT;
+        uint64_t bits;
+        memcpy(&bits, &limit, 8);
+        bytes(0x48, 0xB8);
+        imm64(bits);
+        bytes(0x66, 0x48, 0x0F, 0x6E, 0xD0);  // movq xmm2, rax
+        bytes(0x66, 0x0F, 0x2E, 0xCA);        // ucomisd xmm1, xmm2
+        bytes(0x0F, 0x83);                    // jae deopt
+        jumpTo(-1);
+    }
+
+    void epilogue() { bytes(0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3); }
+
+    void instruction(const KernelInstr& in) {
+        switch (in.op) {
+            case K_LOADK: {
+                uint64_t bits;
+                memcpy(&bits, &in.k, 8);
+                bytes(0x48, 0xB8);
+                imm64(bits);
+                bytes(0x48, 0x89);
+                slot(0x83, in.a);
+                break;
+            }
+            case K_MOV:
+                bytes(0x48, 0x8B);
+                slot(0x83, in.b);
+                bytes(0x48, 0x89);
+                slot(0x83, in.a);
+                break;
+            case K_ADD: case K_SUB: case K_MUL: case K_AND: case K_DIV: {
+                loadPair(in);
+                if (in.op == K_DIV) deoptOnZeroDivisor();
+                uint8_t op = in.op == K_ADD ? 0x58 : in.op == K_SUB ? 0x5C : in.op == K_DIV ? 0x5E : 0x59;
+                bytes(0xF2, 0x0F, op, 0xC1);
+                if (in.op == K_ADD || in.op == K_SUB || in.op == K_MUL) deoptPastExactIntegers();
+                store(in.a);
+                break;
+            }
+            case K_OR:
+                loadPair(in);
+                bytes(0xF2, 0x0F, 0x5F, 0xC1);  // maxsd: both are 0 or 1
+                store(in.a);
+                break;
+            case K_MOD:
+                loadPair(in);
+                deoptOnZeroDivisor();
+                callHelper(reinterpret_cast<const void*>(&kernelFmod));
+                store(in.a);
+                break;
+            case K_NEG: case K_ABS:
+                load(0, in.b);
+                bytes(0x48, 0xB8);
+                imm64(in.op == K_NEG ? 0x8000000000000000ull : 0x7FFFFFFFFFFFFFFFull);
+                bytes(0x66, 0x48, 0x0F, 0x6E, 0xC8);                     // movq xmm1, rax
+                bytes(0x66, 0x0F, in.op == K_NEG ? 0x57 : 0x54, 0xC1);  // xorpd / andpd
+                store(in.a);
+                break;
+            case K_EQ: case K_NE: case K_LT: case K_LE: case K_GT: case K_GE:
+                loadPair(in);
+                compare(in.op, in.a);
+                break;
+            case K_NOT: case K_TRUTH:
+                load(0, in.b);
+                zeroXmm(1);
+                compare(in.op == K_NOT ? K_EQ : K_NE, in.a);
+                break;
+            case K_JMP:
+                bytes(0xE9);
+                jumpTo(in.a);
+                break;
+            case K_JMPF:
+                load(0, in.b);
+                zeroXmm(1);
+                bytes(0x66, 0x0F, 0x2E, 0xC1);  // ucomisd xmm0, xmm1
+                bytes(0x7A, 0x06, 0x0F, 0x84);  // jp +6; je target
+                jumpTo(in.a);
+                break;
+            case K_SQRT:
+                load(0, in.b);
+                zeroXmm(1);
+                bytes(0x66, 0x0F, 0x2E, 0xC1);  // ucomisd xmm0, xmm1
+                bytes(0x7A, 0x06, 0x0F, 0x82);  // jp +6; jb deopt
+                jumpTo(-1);
+                bytes(0xF2, 0x0F, 0x51, 0xC0);  // sqrtsd xmm0, xmm0
+                store(in.a);
+                break;
+            case K_FLOOR: case K_CEIL: case K_ROUND: {
+                load(0, in.b);
+                double (*fn)(double) = in.op == K_FLOOR ? kernelFloor : in.op == K_CEIL ? kernelCeil : kernelRound;
+                callHelper(reinterpret_cast<const void*>(fn));
+                store(in.a);
+                break;
+            }
+            case K_POW: case K_MIN: case K_MAX: {
+                loadPair(in);
+                double (*fn)(double, double) = in.op == K_POW ? kernelPow : in.op == K_MIN ? kernelMin : kernelMax;
+                callHelper(reinterpret_cast<const void*>(fn));
+                store(in.a);
+                break;
+            }
+            case K_CALL:
+                bytes(0x4C, 0x89, 0xE7);  // mov rdi, r12
+                bytes(0x48, 0xBE);
+                imm64(reinterpret_cast<uint64_t>(kernel.callees[in.c]));  // mov rsi, callee
+                bytes(0x48, 0x8D);
+                slot(0x93, in.b);  // lea rdx, args
+                bytes(0x48, 0x8D);
+                slot(0x8B, in.a);  // lea rcx, dest
+                callHelper(reinterpret_cast<const void*>(&kernelCall));
+                bytes(0x85, 0xC0, 0x0F, 0x85);  // test eax, eax; jne deopt
+                jumpTo(-1);
+                break;
+            case K_ADDK: case K_SUBK: case K_MULK: case K_DIVK: case K_MODK: {
+                load(0, in.b);
+                constant(in.k);
+                if (in.op == K_MODK) {
+                    callHelper(reinterpret_cast<const void*>(&kernelFmod));
+                } else {
+                    uint8_t op = in.op == K_ADDK ? 0x58 : in.op == K_SUBK ? 0x5C : in.op == K_MULK ? 0x59 : 0x5E;
+                    bytes(0xF2, 0x0F, op, 0xC1);
+                    if (in.op != K_DIVK) deoptPastExactIntegers();
+                }
+                store(in.a);
+                break;
+            }
+            case K_JNEQ: case K_JNNE: case K_JNLT: case K_JNLE: case K_JNGT: case K_JNGE:
+                loadPair(in);
+                jumpUnless(static_cast<KernelOpcode>(K_EQ + (in.op - K_JNEQ)), in.a);
+                break;
+            case K_JNEQK: case K_JNNEK: case K_JNLTK: case K_JNLEK: case K_JNGTK: case K_JNGEK:
+                load(0, in.b);
+                constant(in.k);
+                jumpUnless(static_cast<KernelOpcode>(K_EQ + (in.op - K_JNEQK)), in.a);
+                break;
+            case K_OPCODE_COUNT:
+                break;
+            case K_RET:
+                load(0, in.a);
+                bytes(0xF2, 0x41, 0x0F, 0x11, 0x45, 0x00);  // movsd [r13], xmm0
+                bytes(0x41, 0xC7, 0x45, 0x08);
+                imm32(in.b);                                  // mov dword [r13 + 8], kind
+                bytes(0x31, 0xC0);                            // xor eax, eax
+                epilogue();
+                break;
+        }
+    }
+};
+#endif
+
+// Host-provided builtin, registered per interpreter with registerBuiltin().
+typedef std::function<Value(Interpreter&, const std::vector<Value>&, int)> HostFunction;
+
+// All runtime state lives in the Interpreter (RNG, I/O streams, host
+// builtins), so independent instances can run on separate threads. The GUI
+// is the exception: GTK has a single main loop, so gui_* calls go through
+// the process-wide ChocoGUI singleton.
+class Interpreter {
+public:
+    std::unordered_map<std::string, Value> globalVars;
+    std::vector<std::unordered_map<std::string, Value>> scopes;
+    // Parallel to scopes: a lambda call's scope holds only its parameters
+    // and reads the closure's captures through this pointer, so calls do
+    // not copy the capture map. Null for every other scope.
+    std::vector<const std::unordered_map<std::string, Value>*> captureLayers;
+    // Popped scopes, cleared but keeping their bucket arrays for reuse.
+    std::vector<std::unordered_map<std::string, Value>> spareScopes;
+    static const size_t MAX_SPARE_SCOPES = 64;
+    static const size_t MAX_SPARE_BUCKETS = 64;
+    std::unordered_map<std::string, Function> functions;
+    std::unordered_map<std::string, StructDef> structDefs;
+    // Direct-mapped, allocated on first use. Bump callableEpoch whenever
+    // the set of function or host builtin names may change.
+    std::vector<SiteCache> siteCaches;
+    static const size_t SITE_CACHE_SIZE = 1024;
+    static const size_t SMALL_STRUCT_FIELDS = 8;
+    uint64_t callableEpoch = 1;
+    // Numeric kernels (see Kernel), compiled for functions after
+    // KERNEL_CALL_THRESHOLD calls and for while loops after
+    // KERNEL_LOOP_THRESHOLD iterations of one run, or at once when eager.
+    // A kernel that deopts KERNEL_MAX_DEOPTS times is given up on. All of
+    // it is dropped when callableEpoch moves.
+    struct KernelSlot {
+        uint32_t calls = 0;
+        uint32_t deopts = 0;
+        bool failed = false;
+        Kernel* kernel = nullptr;
+    };
+    static const uint32_t KERNEL_CALL_THRESHOLD = 8;
+    static const uint32_t KERNEL_LOOP_THRESHOLD = 32;
+    static const uint32_t KERNEL_MAX_DEOPTS = 8;
+    ExecutionTier tier = TIER_KERNELS;
+    bool eagerKernels = false;
+    std::unordered_map<const Function*, KernelSlot> functionKernels;
+    std::map<std::pair<uint64_t, size_t>, KernelSlot> loopKernels;  // (stream, condition)
+    std::map<std::pair<uint64_t, size_t>, KernelSlot> rangeKernels;  // (stream, body)
+    std::map<std::pair<uint64_t, size_t>, KernelSlot> lambdaKernels;  // (stream, body)
+    std::vector<std::unique_ptr<Kernel>> kernelStore;
+    uint64_t kernelEpoch = 0;
+    KernelRuntime kernelRuntime;
+    TokenStream tokens;
+    size_t current;
+    bool inFunction;
+    bool inLoop;
+    bool hasReturned;
+    Value returnValue;
+    bool shouldBreak;
+    bool shouldContinue;
+    bool inTryCatch;
+    std::string currentException;
+    std::unordered_map<std::string, HostFunction> hostFunctions;
+    std::ostream* out;
+    std::ostream* err;
+    std::istream* in;
+    std::mt19937_64 rng;
+#ifdef CHOCO_HAS_EVENT_LOOP
+    std::unique_ptr<AsyncRuntime> asyncRuntime;
+#endif
+
+    // Execution budget, charged one unit per loop iteration and per call.
+    // The clock is only read every DEADLINE_CHECK_INTERVAL units. Fuel sits
+    // in a tank shared with isolates and parallel workers; each draws it in
+    // batches of FUEL_BATCH units into `fuelLeft`.
+    static const uint64_t DEADLINE_CHECK_INTERVAL = 1024;
+    static const uint64_t FUEL_BATCH = 1024;
+    bool limited = false;
+    bool limitExceeded = false;
+    bool fuelLimited = false;
+    uint64_t fuelLeft = 0;
+    std::shared_ptr<std::atomic<uint64_t>> fuelTank;
+    bool hasDeadline = false;
+    std::chrono::steady_clock::time_point deadline;
+    uint64_t deadlineTicks = 0;
+
+    // Bytes allocated while this interpreter runs are charged here; isolates
+    // and parallel workers share their parent's account.
+    HeapAccountRef heap;
+    
+    static const std::unordered_map<std::string, bool> builtinFunctions;
+    static const size_t PARALLEL_MIN_ITEMS = 512;
+
+    Value callFunction(const std::string& name, const std::vector<Value>& args, int callLine) {
+        if (name == "map") {
+            if (args.size() < 2) {
+                throw RuntimeError("map() expects 2 arguments (array, lambda), got " + std::to_string(args.size()), callLine);
+            }
+            if (args[0].type == Value::ITERATOR && args[1].type == Value::LAMBDA) {
+                return chainIterator(IteratorState::MAP, args[0], args[1], 0);
+            }
+            if (args[0].type != Value::ARRAY && args[0].type != Value::FLOATS) {
+                throw RuntimeError("map() first argument must be an array, got " + args[0].getType(), callLine);
+            }
+            if (args[1].type != Value::LAMBDA) {
+                throw RuntimeError("map() second argument must be a lambda, got " + args[1].getType(), callLine);
+            }
+            // Arithmetic lambdas over numbers run as a kernel; floats map to floats.
+            std::vector<double> scratch, mapped;
+            const std::vector<double>* numbers = packedNumbers(args[0], scratch);
+            if (numbers && args[0].type == Value::ARRAY &&
+                std::any_of(args[0].array.begin(), args[0].array.end(), [](const Value& v) { return v.wide; })) {
+                numbers = nullptr;
+            }
+            if (numbers && mapKernel(args[1], *numbers, mapped)) {
+                if (args[0].type == Value::FLOATS) return floatsValue(std::move(mapped));
+                return Value(std::vector<Value>(mapped.begin(), mapped.end()));
+            }
+            // Floats stay packed while the lambda returns plain numbers;
+            // anything else turns the result into an array.
+            if (args[0].type == Value::FLOATS) {
+                std::vector<Value> lambdaArgs(1), boxed;
+                bool packed = true;
+                LambdaFrame frame(*this, args[1]);
+                for (double item : *args[0].floats) {
+                    lambdaArgs[0] = Value(item);
+                    Value result = frame.call(lambdaArgs);
+                    if (packed && result.type == Value::NUMBER && !result.wide) {
+                        mapped.push_back(result.num);
+                        continue;
+                    }
+                    if (packed) {
+                        packed = false;
+                        boxed.reserve(args[0].floats->size());
+                        boxed.assign(mapped.begin(), mapped.end());
+                    }
+                    boxed.push_back(std::move(result));
+                }
+                frame.close();
+                if (packed) return floatsValue(std::move(mapped));
+                return Value(boxed);
+            }
+            std::vector<Value> result;
+            result.reserve(args[0].array.size());
+            std::vector<Value> lambdaArgs(1);
+            LambdaFrame frame(*this, args[1]);
+            for (const auto& item : args[0].array) {
+                lambdaArgs[0] = item;
+                result.push_back(frame.call(lambdaArgs));
+            }
+            frame.close();
+            return Value(result);
+        }
+        
+        if (name == "filter") {
+            if (args.size() < 2) {
+                throw RuntimeError("filter() expects 2 arguments (array, lambda), got " + std::to_string(args.size()), callLine);
+            }
+            if (args[0].type == Value::ITERATOR && args[1].type == Value::LAMBDA) {
+                return chainIterator(IteratorState::FILTER, args[0], args[1], 0);
+            }
+            if (args[0].type != Value::ARRAY) {
+                throw RuntimeError("filter() first argument must be an array, got " + args[0].getType(), callLine);
+            }
+            if (args[1].type != Value::LAMBDA) {
+                throw RuntimeError("filter() second argument must be a lambda, got " + args[1].getType(), callLine);
+            }
+            std::vector<Value> result;
+            std::vector<Value> lambdaArgs(1);
+            LambdaFrame frame(*this, args[1]);
+            for (const auto& item : args[0].array) {
+                lambdaArgs[0] = item;
+                Value condition = frame.call(lambdaArgs);
+                if (condition.type == Value::BOOL && condition.boolean) {
+                    result.push_back(item);
+                }
+            }
+            frame.close();
+            return Value(result);
+        }
+        
+        if (name == "reduce") {
+            if (args.size() < 3) {
+                throw RuntimeError("reduce() expects 3 arguments (array, initial, lambda), got " + std::to_string(args.size()), callLine);
+            }
+            if (args[0].type != Value::ARRAY && args[0].type != Value::ITERATOR) {
+                throw RuntimeError("reduce() first argument must be an array or iterator, got " + args[0].getType(), callLine);
+            }
+            if (args[2].type != Value::LAMBDA) {
+                throw RuntimeError("reduce() third argument must be a lambda, got " + args[2].getType(), callLine);
+            }
+            Value accumulator = args[1];
+            if (args[0].type == Value::ITERATOR) {
+                std::vector<Value> lambdaArgs(2);
+                drainIterator(*args[0].iterator, [&](Value& item) {
+                    lambdaArgs[0] = std::move(accumulator);
+                    lambdaArgs[1] = std::move(item);
+                    accumulator = callLambda(args[2], lambdaArgs);
+                    return true;
+                });
+                return accumulator;
+            }
+            std::vector<Value> lambdaArgs(2);
+            LambdaFrame frame(*this, args[2]);
+            for (const auto& item : args[0].array) {
+                lambdaArgs[0] = std::move(accumulator);
+                lambdaArgs[1] = item;
+                accumulator = frame.call(lambdaArgs);
+            }
+            frame.close();
+            return accumulator;
+        }
+        
+        if (name == "pmap" || name == "pfilter" || name == "preduce") {
+            bool isReduce = name == "preduce";
+            size_t lambdaIndex = isReduce ? 2 : 1;
+            if (args.size() < lambdaIndex + 1) {
+                throw RuntimeError(name + "() expects " + std::to_string(lambdaIndex + 1) + " arguments, got " + std::to_string(args.size()), callLine);
+            }
+            if (args[0].type != Value::ARRAY) {
+                throw RuntimeError(name + "() first argument must be an array, got " + args[0].getType(), callLine);
+            }
+            if (args[lambdaIndex].type != Value::LAMBDA) {
+                throw RuntimeError(name + "() lambda argument must be a lambda, got " + args[lambdaIndex].getType(), callLine);
+            }
+            if (args[0].array.size() < PARALLEL_MIN_ITEMS) {
+                return callFunction(name.substr(1), args, callLine);
+            }
+            return parallelApply(name, args, callLine);
+        }
+        
+        if (name == "sleep" || name == "read_file_async" || name == "exec_async") {
+            return asyncBuiltin(name, args, callLine);
+        }
+
+        if (name == "spawn") {
+            if (args.size() == 0 || (args[0].type != Value::LAMBDA && args[0].type != Value::STRING)) {
+                throw RuntimeError("spawn() expects a lambda or function name, then its arguments", callLine);
+            }
+            if (args[0].type == Value::STRING && functions.find(args[0].str) == functions.end()) {
+                throw RuntimeError("spawn(): undefined function '" + args[0].str + "'", callLine);
+            }
+            return spawnIsolate(args[0], std::vector<Value>(args.begin() + 1, args.end()), callLine);
+        }
+
+        if (name == "snapshot") {
+            if (args.size() == 0 || args[0].type != Value::STRING) {
+                throw RuntimeError("snapshot() requires a file path", callLine);
+            }
+            writeSnapshot(args[0].str, callLine);
+            return Value();
+        }
+
+        if (name == "channel") {
+            size_t capacity = 64;
+            if (args.size() > 0) {
+                if (args[0].type != Value::NUMBER || !(args[0].num >= 1 && args[0].num <= Channel::MAX_CAPACITY)) {
+                    throw RuntimeError("channel() capacity must be between 1 and " + std::to_string(Channel::MAX_CAPACITY), callLine);
+                }
+                capacity = static_cast<size_t>(args[0].num);
+            }
+            Value result;
+            result.type = Value::CHANNEL;
+            result.channel = newHeapObject<Channel>(capacity);
+            return result;
+        }
+
+        if (name == "chan_send" || name == "chan_recv" || name == "chan_close") {
+            if (args.size() == 0 || args[0].type != Value::CHANNEL) {
+                throw RuntimeError(name + "() first argument must be a channel", callLine);
+            }
+            Channel& chan = *args[0].channel;
+            if (name == "chan_send") {
+                if (args.size() < 2) {
+                    throw RuntimeError("chan_send() expects 2 arguments (channel, value), got " + std::to_string(args.size()), callLine);
+                }
+                Value item = args[1];
+                detachBuilders(item);
+                if (!channelSend(chan, item, callLine)) {
+                    throw RuntimeError("chan_send() on a closed channel", callLine);
+                }
+                return Value();
+            }
+            if (name == "chan_recv") {
+                Value item;
+                channelRecv(chan, item, callLine);
+                return item;
+            }
+            chan.close();
+            return Value();
+        }
+
+        if (name == "gc") {
+            return Value(static_cast<double>(CycleCollector::instance().collect()));
+        }
+
+        if (name == "gc_stats") {
+            GcStats stats = CycleCollector::instance().snapshot();
+            Value result;
+            result.type = Value::STRUCT;
+            result.structType = "GcStats";
+            result.structFields["minor"] = Value(static_cast<double>(stats.minorCollections));
+            result.structFields["full"] = Value(static_cast<double>(stats.fullCollections));
+            result.structFields["freed"] = Value(static_cast<double>(stats.freed));
+            result.structFields["young"] = Value(static_cast<double>(stats.young));
+            result.structFields["old"] = Value(static_cast<double>(stats.old));
+            result.structFields["last_pause_ms"] = Value(stats.lastPauseMs);
+            result.structFields["max_pause_ms"] = Value(stats.maxPauseMs);
+            result.structFields["total_pause_ms"] = Value(stats.totalPauseMs);
+            return result;
+        }
+
+        if (name == "gc_tune") {
+            if (args.size() < 2 || args[0].type != Value::NUMBER || args[1].type != Value::NUMBER) {
+                throw RuntimeError("gc_tune() expects 2 numbers (young_threshold, growth_factor)", callLine);
+            }
+            if (args[0].num < 1 || args[1].num < 1) {
+                throw RuntimeError("gc_tune() threshold and growth factor must be at least 1", callLine);
+            }
+            CycleCollector::instance().tune(static_cast<size_t>(args[0].num), args[1].num);
+            return Value();
+        }
+        
+        if (name == "range") {
+            if (args.size() < 2) {
+                throw RuntimeError("range() expects 2 or 3 arguments (start, end, step), got " + std::to_string(args.size()), callLine);
+            }
+            if (args[0].type != Value::NUMBER || args[1].type != Value::NUMBER ||
+                (args.size() > 2 && args[2].type != Value::NUMBER)) {
+                throw RuntimeError("range() requires numbers", callLine);
+            }
+            auto state = newHeapObject<IteratorState>(IteratorState::RANGE);
+            state->rangeStart = args[0].num;
+            state->rangeEnd = args[1].num;
+            if (args.size() > 2) {
+                if (args[2].num == 0) {
+                    throw RuntimeError("range(): step cannot be zero", callLine);
+                }
+                state->rangeStep = args[2].num;
+            }
+            Value result;
+            result.type = Value::ITERATOR;
+            result.iterator = std::move(state);
+            return result;
+        }
+        
+        if (name == "iter") {
+            if (args.size() == 0) {
+                throw RuntimeError("iter() expects 1 argument, got 0", callLine);
+            }
+            if (args[0].type == Value::ITERATOR) {
+                return args[0];
+            }
+            if (args[0].type != Value::ARRAY && args[0].type != Value::STRING) {
+                throw RuntimeError("iter() requires an array or string, got " + args[0].getType(), callLine);
+            }
+            auto state = newHeapObject<IteratorState>(IteratorState::SOURCE);
+            state->source = args[0];
+            Value result;
+            result.type = Value::ITERATOR;
+            result.iterator = std::move(state);
+            return result;
+        }
+        
+        if (name == "take") {
+            if (args.size() < 2) {
+                throw RuntimeError("take() expects 2 arguments (iterator, count), got " + std::to_string(args.size()), callLine);
+            }
+            if (args[0].type != Value::ITERATOR) {
+                throw RuntimeError("take() first argument must be an iterator, got " + args[0].getType(), callLine);
+            }
+            if (args[1].type != Value::NUMBER || args[1].num < 0) {
+                throw RuntimeError("take() count must be a non-negative number", callLine);
+            }
+            return chainIterator(IteratorState::TAKE, args[0], Value(), static_cast<size_t>(args[1].num));
+        }
+        
+        if (name == "collect") {
+            if (args.size() == 0) {
+                throw RuntimeError("collect() expects 1 argument, got 0", callLine);
+            }
+            if (args[0].type == Value::ARRAY) {
+                return args[0];
+            }
+            if (args[0].type != Value::ITERATOR) {
+                throw RuntimeError("collect() requires an iterator, got " + args[0].getType(), callLine);
+            }
+            std::vector<Value> result;
+            drainIterator(*args[0].iterator, [&](Value& item) {
+                result.push_back(std::move(item));
+                return true;
+            });
+            return Value(result);
+        }
+        
+        if (name == "typeof") {
+            if (args.size() == 0) {
+                throw RuntimeError("typeof() expects 1 argument, got 0", callLine);
+            }
+            return Value(args[0].getType());
+        }
+        
         if (name == "len") {
             if (args.size() == 0) {
                 throw RuntimeError("len() expects 1 argument, got 0", callLine);
@@ -709,14 +4283,28 @@ public:
                 return Value(static_cast<double>(args[0].array.size()));
             } else if (args[0].type == Value::STRING) {
                 return Value(static_cast<double>(args[0].str.length()));
-            }
-            throw RuntimeError("len() requires array or string, got " + args[0].getType(), callLine);
+            } else if (args[0].type == Value::MAP) {
+                return Value(static_cast<double>(args[0].map->count));
+            } else if (args[0].type == Value::FLOATS) {
+                return Value(static_cast<double>(args[0].floats->size()));
+            } else if (args[0].type == Value::BUILDER) {
+                return Value(static_cast<double>(args[0].builder->length()));
+            }
+            throw RuntimeError("len() requires array, string or map, got " + args[0].getType(), callLine);
         }
         
         if (name == "push") {
             if (args.size() < 2) {
                 throw RuntimeError("push() expects 2 arguments (array, value), got " + std::to_string(args.size()), callLine);
             }
+            if (args[0].type == Value::FLOATS) {
+                if (args[1].type != Value::NUMBER) {
+                    throw RuntimeError("push() onto floats requires a number, got " + args[1].getType(), callLine);
+                }
+                Value arr = args[0];
+                ownFloats(arr).push_back(args[1].num);
+                return arr;
+            }
             if (args[0].type != Value::ARRAY) {
                 throw RuntimeError("push() first argument must be an array, got " + args[0].getType(), callLine);
             }
@@ -729,6 +4317,12 @@ public:
             if (args.size() == 0) {
                 throw RuntimeError("pop() expects 1 argument (array), got 0", callLine);
             }
+            if (args[0].type == Value::FLOATS) {
+                if (args[0].floats->empty()) {
+                    throw RuntimeError("Cannot pop from empty array", callLine);
+                }
+                return Value(args[0].floats->back());
+            }
             if (args[0].type != Value::ARRAY) {
                 throw RuntimeError("pop() requires an array, got " + args[0].getType(), callLine);
             }
@@ -740,6 +4334,41 @@ public:
             arr.array.pop_back();
             return last;
         }
+
+        if (name == "keys" || name == "values") {
+            if (args.size() == 0) {
+                throw RuntimeError(name + "() expects 1 argument (map), got 0", callLine);
+            }
+            if (args[0].type != Value::MAP) {
+                throw RuntimeError(name + "() requires a map, got " + args[0].getType(), callLine);
+            }
+            bool wantKeys = name == "keys";
+            std::vector<Value> result;
+            result.reserve(args[0].map->count);
+            for (const auto& entry : args[0].map->entries) {
+                if (!entry.live) continue;
+                result.push_back(wantKeys ? Value(entry.key) : entry.value);
+            }
+            return Value(result);
+        }
+
+        if (name == "has" || name == "remove") {
+            if (args.size() < 2) {
+                throw RuntimeError(name + "() expects 2 arguments (map, key), got " + std::to_string(args.size()), callLine);
+            }
+            if (args[0].type != Value::MAP) {
+                throw RuntimeError(name + "() first argument must be a map, got " + args[0].getType(), callLine);
+            }
+            if (args[1].type != Value::STRING) {
+                throw RuntimeError("Map key must be a string, got " + args[1].getType(), callLine);
+            }
+            if (name == "has") {
+                return Value(args[0].map->find(args[1].str) != nullptr);
+            }
+            Value result = args[0];
+            if (result.map->find(args[1].str)) ownMap(result).erase(args[1].str);
+            return result;
+        }
         
         if (name == "sqrt") {
             if (args.size() == 0) {
@@ -771,6 +4400,7 @@ public:
             if (args[0].type != Value::NUMBER) {
                 throw RuntimeError("abs() requires a number, got " + args[0].getType(), callLine);
             }
+            if (args[0].wide) return args[0].integer < 0 ? negateNumber(args[0]) : args[0];
             return Value(fabs(args[0].num));
         }
         
@@ -781,6 +4411,7 @@ public:
             if (args[0].type != Value::NUMBER) {
                 throw RuntimeError("floor() requires a number, got " + args[0].getType(), callLine);
             }
+            if (args[0].wide) return args[0];
             return Value(floor(args[0].num));
         }
         
@@ -791,6 +4422,7 @@ public:
             if (args[0].type != Value::NUMBER) {
                 throw RuntimeError("ceil() requires a number, got " + args[0].getType(), callLine);
             }
+            if (args[0].wide) return args[0];
             return Value(ceil(args[0].num));
         }
         
@@ -801,9 +4433,32 @@ public:
             if (args[0].type != Value::NUMBER) {
                 throw RuntimeError("round() requires a number, got " + args[0].getType(), callLine);
             }
+            if (args[0].wide) return args[0];
             return Value(round(args[0].num));
         }
         
+        if ((name == "min" || name == "max") && args.size() == 1) {
+            std::vector<double> scratch;
+            const std::vector<double>* xs = packedNumbers(args[0], scratch);
+            if (!xs) {
+                throw RuntimeError(name + "() of one argument requires an array of numbers, got " + args[0].getType(), callLine);
+            }
+            if (xs->empty()) {
+                throw RuntimeError(name + "() of an empty array", callLine);
+            }
+            if (args[0].type == Value::ARRAY &&
+                std::any_of(args[0].array.begin(), args[0].array.end(), [](const Value& v) { return v.wide; })) {
+                // Compared exactly, skipping NaNs as extremeFloats does.
+                const Value* best = nullptr;
+                for (const Value& item : args[0].array) {
+                    if (std::isnan(item.num)) continue;
+                    if (!best || orderNumbers(item, *best) == (name == "max" ? 1 : -1)) best = &item;
+                }
+                return *best;
+            }
+            return Value(extremeFloats(xs->data(), xs->size(), name == "max"));
+        }
+
         if (name == "min") {
             if (args.size() < 2) {
                 throw RuntimeError("min() expects 2 arguments, got " + std::to_string(args.size()), callLine);
@@ -811,6 +4466,7 @@ public:
             if (args[0].type != Value::NUMBER || args[1].type != Value::NUMBER) {
                 throw RuntimeError("min() requires two numbers", callLine);
             }
+            if (args[0].wide || args[1].wide) return orderNumbers(args[0], args[1]) == 1 ? args[1] : args[0];
             return Value(std::min(args[0].num, args[1].num));
         }
         
@@ -821,11 +4477,88 @@ public:
             if (args[0].type != Value::NUMBER || args[1].type != Value::NUMBER) {
                 throw RuntimeError("max() requires two numbers", callLine);
             }
+            if (args[0].wide || args[1].wide) return orderNumbers(args[0], args[1]) == -1 ? args[1] : args[0];
             return Value(std::max(args[0].num, args[1].num));
         }
         
+        if (name == "floats") {
+            if (args.size() == 0) {
+                throw RuntimeError("floats() expects 1 argument (length or array), got 0", callLine);
+            }
+            if (args[0].type == Value::NUMBER) {
+                if (!(args[0].num >= 0 && args[0].num < 4294967296.0)) {
+                    throw RuntimeError("floats() length must be between 0 and 2^32, got " + args[0].toString(), callLine);
+                }
+                return floatsValue(std::vector<double>(static_cast<size_t>(args[0].num), 0.0));
+            }
+            std::vector<double> scratch;
+            if (args[0].type == Value::ITERATOR) {
+                drainIterator(*args[0].iterator, [&](Value& item) {
+                    if (item.type != Value::NUMBER) {
+                        throw RuntimeError("floats() requires numbers, got " + item.getType(), callLine);
+                    }
+                    scratch.push_back(item.num);
+                    return true;
+                });
+                return floatsValue(std::move(scratch));
+            }
+            const std::vector<double>* xs = packedNumbers(args[0], scratch);
+            if (!xs) {
+                throw RuntimeError("floats() requires a length, an array or an iterator of numbers, got " + args[0].getType(), callLine);
+            }
+            return args[0].type == Value::FLOATS ? args[0] : floatsValue(std::move(scratch));
+        }
+
+        if (name == "vsum") {
+            if (args.size() == 0) {
+                throw RuntimeError("vsum() expects 1 argument (array), got 0", callLine);
+            }
+            std::vector<double> scratch;
+            const std::vector<double>* xs = packedNumbers(args[0], scratch);
+            if (!xs) {
+                throw RuntimeError("vsum() requires an array of numbers, got " + args[0].getType(), callLine);
+            }
+            return Value(sumFloats(xs->data(), xs->size()));
+        }
+
+        if (name == "vdot" || name == "vadd" || name == "vmul") {
+            if (args.size() < 2) {
+                throw RuntimeError(name + "() expects 2 arguments (array, array), got " + std::to_string(args.size()), callLine);
+            }
+            std::vector<double> leftScratch, rightScratch;
+            const std::vector<double>* xs = packedNumbers(args[0], leftScratch);
+            const std::vector<double>* ys = packedNumbers(args[1], rightScratch);
+            if (!xs || !ys) {
+                throw RuntimeError(name + "() requires two arrays of numbers, got " + args[0].getType() + " and " +
+                                   args[1].getType(), callLine);
+            }
+            if (xs->size() != ys->size()) {
+                throw RuntimeError(name + "() arrays differ in length (" + std::to_string(xs->size()) + " and " +
+                                   std::to_string(ys->size()) + ")", callLine);
+            }
+            if (name == "vdot") return Value(dotFloats(xs->data(), ys->data(), xs->size()));
+            std::vector<double> result(xs->size());
+            elementwiseFloats(name == "vadd" ? TOKEN_PLUS : TOKEN_STAR, xs->data(), ys->data(), 0, result.data(), result.size());
+            return floatsValue(std::move(result));
+        }
+
+        if (name == "vscale") {
+            if (args.size() < 2) {
+                throw RuntimeError("vscale() expects 2 arguments (array, factor), got " + std::to_string(args.size()), callLine);
+            }
+            std::vector<double> scratch;
+            const std::vector<double>* xs = packedNumbers(args[0], scratch);
+            if (!xs || args[1].type != Value::NUMBER) {
+                throw RuntimeError("vscale() requires an array of numbers and a number, got " + args[0].getType() + " and " +
+                                   args[1].getType(), callLine);
+            }
+            std::vector<double> result(xs->size());
+            elementwiseFloats(TOKEN_STAR, xs->data(), nullptr, args[1].num, result.data(), result.size());
+            return floatsValue(std::move(result));
+        }
+
         if (name == "random") {
-            return Value(static_cast<double>(rand()) / RAND_MAX);
+            return Value(std::uniform_real_distribution<double>(0.0, 1.0)(rng));
         }
         
         if (name == "random_int") {
@@ -835,12 +4568,12 @@ public:
             if (args[0].type != Value::NUMBER || args[1].type != Value::NUMBER) {
                 throw RuntimeError("random_int() requires two numbers", callLine);
             }
-            int min = static_cast<int>(args[0].num);
-            int max = static_cast<int>(args[1].num);
+            int64_t min = truncateInteger(args[0]);
+            int64_t max = truncateInteger(args[1]);
             if (min > max) {
                 throw RuntimeError("random_int(): min cannot be greater than max", callLine);
             }
-            return Value(static_cast<double>(min + rand() % (max - min + 1)));
+            return Value(std::uniform_int_distribution<int64_t>(min, max)(rng));
         }
         
         if (name == "str") {
@@ -855,10 +4588,10 @@ public:
                 throw RuntimeError("int() expects 1 argument, got 0", callLine);
             }
             if (args[0].type == Value::NUMBER) {
-                return Value(static_cast<double>(static_cast<int>(args[0].num)));
+                return Value(truncateInteger(args[0]));
             } else if (args[0].type == Value::STRING) {
                 try {
-                    return Value(static_cast<double>(std::stoi(args[0].str)));
+                    return Value(static_cast<int64_t>(std::stoll(args[0].str)));
                 } catch (...) {
                     throw RuntimeError("int(): cannot convert '" + args[0].str + "' to integer", callLine);
                 }
@@ -877,7 +4610,7 @@ public:
                     throw RuntimeError("float(): cannot convert '" + args[0].str + "' to float", callLine);
                 }
             } else if (args[0].type == Value::NUMBER) {
-                return args[0];
+                return Value(args[0].num);
             }
             throw RuntimeError("float() requires number or string, got " + args[0].getType(), callLine);
         }
@@ -963,7 +4696,37 @@ public:
                     result += args[1].str;
                 }
             }
-            return Value(result);
+            return Value(result);
+        }
+
+        // A builder is a growable string shared by reference: append()
+        // extends it in place, so accumulating text is linear.
+        if (name == "builder") {
+            Value result;
+            result.type = Value::BUILDER;
+            result.builder = std::make_shared<std::string>();
+            buildersCreated.store(true, std::memory_order_relaxed);
+            if (args.size() > 0) {
+                if (args[0].type != Value::NUMBER || !(args[0].num >= 0 && args[0].num < 4294967296.0)) {
+                    throw RuntimeError("builder() capacity must be between 0 and 2^32, got " + args[0].toString(), callLine);
+                }
+                result.builder->reserve(static_cast<size_t>(args[0].num));
+            }
+            return result;
+        }
+
+        if (name == "append" || name == "build") {
+            if (args.size() == 0 || args[0].type != Value::BUILDER) {
+                throw RuntimeError(name + "() first argument must be a builder, got " +
+                                   (args.empty() ? std::string("nothing") : args[0].getType()), callLine);
+            }
+            std::string& text = *args[0].builder;
+            if (name == "build") return Value(text);
+            for (size_t i = 1; i < args.size(); i++) {
+                if (args[i].type == Value::STRING) text += args[i].str;
+                else text += args[i].toString();
+            }
+            return args[0];
         }
         
         if (name == "read_file") {
@@ -1008,129 +4771,1226 @@ public:
             if (!file) {
                 throw RuntimeError("append_file(): cannot open file '" + args[0].str + "' for appending", callLine);
             }
-            file << args[1].str;
-            return Value(true);
+            file << args[1].str;
+            return Value(true);
+        }
+        
+        if (name == "file_exists") {
+            if (args.size() == 0) {
+                throw RuntimeError("file_exists() expects 1 argument (filename), got 0", callLine);
+            }
+            if (args[0].type != Value::STRING) {
+                throw RuntimeError("file_exists() requires a string filename, got " + args[0].getType(), callLine);
+            }
+            std::ifstream file(args[0].str);
+            return Value(file.good());
+        }
+        
+        if (name == "input") {
+            std::string prompt = "";
+            if (args.size() > 0) {
+                if (args[0].type != Value::STRING) {
+                    throw RuntimeError("input() prompt must be a string, got " + args[0].getType(), callLine);
+                }
+                prompt = args[0].str;
+            }
+            
+            if (!prompt.empty()) {
+                *out << prompt;
+                out->flush();
+            }
+            
+            std::string line;
+            if (std::getline(*in, line)) {
+                return Value(line);
+            } else {
+                return Value("");
+            }
+        }
+
+#ifndef CHOCO_NO_GUI
+        if (name.compare(0, 4, "gui_") == 0) {
+            ChocoGUI* gui = ChocoGUI::getInstance(0, nullptr);
+            gui->setInterpreter(this);
+
+            if (name == "gui_init") return gui->gui_init(args, callLine);
+            if (name == "gui_window") return gui->gui_window(args, callLine);
+            if (name == "gui_button") return gui->gui_button(args, callLine);
+            if (name == "gui_label") return gui->gui_label(args, callLine);
+            if (name == "gui_entry") return gui->gui_entry(args, callLine);
+            if (name == "gui_box") return gui->gui_box(args, callLine);
+            if (name == "gui_add") return gui->gui_add(args, callLine);
+            if (name == "gui_set_text") return gui->gui_set_text(args, callLine);
+            if (name == "gui_get_text") return gui->gui_get_text(args, callLine);
+            if (name == "gui_on") return gui->gui_on(args, callLine);
+            if (name == "gui_show") return gui->gui_show(args, callLine);
+            if (name == "gui_run") return gui->gui_run(args, callLine);
+            if (name == "gui_quit") return gui->gui_quit(args, callLine);
+            if (name == "gui_checkbox") return gui->gui_checkbox(args, callLine);
+            if (name == "gui_textview") return gui->gui_textview(args, callLine);
+            if (name == "gui_frame") return gui->gui_frame(args, callLine);
+            if (name == "gui_separator") return gui->gui_separator(args, callLine);
+            if (name == "gui_set_sensitive") return gui->gui_set_sensitive(args, callLine);
+            if (name == "gui_get_checked") return gui->gui_get_checked(args, callLine);
+            if (name == "gui_set_checked") return gui->gui_set_checked(args, callLine);
+        }
+#else
+        if (name.substr(0, 4) == "gui_") {
+            throw RuntimeError("GUI function '" + name + "' not available - compiled without GUI support", callLine);
+        }
+#endif
+        auto hostIt = hostFunctions.find(name);
+        if (hostIt != hostFunctions.end()) {
+            return hostIt->second(*this, args, callLine);
+        }
+
+        auto it = functions.find(name);
+        if (it == functions.end()) {
+            throw RuntimeError("Undefined function '" + name + "'", callLine);
+        }
+
+        Function& func = it->second;
+        
+        if (args.size() < func.params.size()) {
+            throw RuntimeError("Function '" + name + "' expects " + std::to_string(func.params.size()) + 
+                             " arguments, got " + std::to_string(args.size()), callLine);
+        }
+
+        if (func.isAsync) {
+            return startTask(func, args, callLine);
+        }
+        return invokeFunction(func, args);
+    }
+
+    // Call expressions own their argument vector; a plain user function
+    // call skips the builtin dispatch and takes the arguments by move.
+    Value callFunction(const std::string& name, std::vector<Value>&& args, int callLine) {
+        auto it = functions.find(name);
+        if (it != functions.end() && !it->second.isAsync && args.size() >= it->second.params.size() &&
+            !isBuiltinFunction(name) && hostFunctions.find(name) == hostFunctions.end()) {
+            return invokeFunction(it->second, std::move(args));
+        }
+        return callFunction(name, static_cast<const std::vector<Value>&>(args), callLine);
+    }
+
+    void pushScope(const std::unordered_map<std::string, Value>* captures = nullptr) {
+        if (spareScopes.empty()) {
+            scopes.emplace_back();
+        } else {
+            scopes.push_back(std::move(spareScopes.back()));
+            spareScopes.pop_back();
+        }
+        captureLayers.push_back(captures);
+    }
+
+    void popScope() {
+        captureLayers.pop_back();
+        std::unordered_map<std::string, Value> scope = std::move(scopes.back());
+        scopes.pop_back();
+        if (scope.bucket_count() <= MAX_SPARE_BUCKETS && spareScopes.size() < MAX_SPARE_SCOPES) {
+            scope.clear();
+            spareScopes.push_back(std::move(scope));
+        }
+    }
+
+    Value invokeFunction(const Function& func, const std::vector<Value>& args) {
+        charge(1);
+        Value result;
+        if (tier != TIER_INTERPRET && !limited && runFunctionKernel(func, args, result)) return result;
+        pushScope();
+        
+        for (size_t i = 0; i < func.params.size() && i < args.size(); i++) {
+            scopes.back()[func.params[i]] = args[i];
+        }
+        return runFunctionBody(func);
+    }
+
+    // Arguments evaluated at a call site are temporaries: bind them by move.
+    Value invokeFunction(const Function& func, std::vector<Value>&& args) {
+        charge(1);
+        Value result;
+        if (tier != TIER_INTERPRET && !limited && runFunctionKernel(func, args, result)) return result;
+        pushScope();
+
+        for (size_t i = 0; i < func.params.size() && i < args.size(); i++) {
+            scopes.back()[func.params[i]] = std::move(args[i]);
+        }
+        return runFunctionBody(func);
+    }
+
+    // Runs a function body in the scope its caller has just pushed, and
+    // pops that scope.
+    Value runFunctionBody(const Function& func) {
+        // Functions from an import or an earlier REPL line run on the
+        // tokens they were declared in.
+        bool foreignCode = func.code.data() != tokens.data();
+        TokenStream savedTokens;
+        if (foreignCode) {
+            savedTokens = tokens;
+            tokens = func.code;
+        }
+
+        size_t savedCurrent = current;
+        Value result = func.exprBody ? evalReturnExpression(func.bodyStart)
+                                     : runBody(func.bodyStart, func.bodyEnd);
+        popScope();
+        
+        current = savedCurrent;
+        if (foreignCode) tokens = savedTokens;
+        return result;
+    }
+
+    // Runs the statements of a function or lambda body and returns what it
+    // returned. Leaves `current` inside the body.
+    Value runBody(size_t bodyStart, size_t bodyEnd) {
+        current = bodyStart;
+        bool wasInFunction = inFunction;
+        inFunction = true;
+        hasReturned = false;
+        returnValue = Value();
+
+        while (current < bodyEnd && !isAtEnd() && !hasReturned) {
+            statement();
+        }
+
+        Value result = std::move(returnValue);
+        hasReturned = false;
+        inFunction = wasInFunction;
+        return result;
+    }
+
+    // A `return EXPR;` body: just the expression. Nothing in an expression
+    // can observe inFunction or the return flags.
+    Value evalReturnExpression(size_t bodyStart) {
+        current = bodyStart + 1;
+        Value result = expression();
+        expect(TOKEN_SEMICOLON, "Expected ';' after return statement");
+        return result;
+    }
+
+    // ---- numeric kernels --------------------------------------------------
+
+    void syncKernels() {
+        if (kernelEpoch == callableEpoch) return;
+        functionKernels.clear();
+        loopKernels.clear();
+        rangeKernels.clear();
+        lambdaKernels.clear();
+        kernelStore.clear();
+        kernelEpoch = callableEpoch;
+    }
+
+    KernelCompiler::Environment kernelEnvironment() {
+        KernelCompiler::Environment env;
+        env.isCallable = [this](const std::string& name) { return isCallableName(name); };
+        env.isBuiltin = [this](const std::string& name) { return isBuiltinFunction(name); };
+        env.isStruct = [this](const std::string& name) { return structDefs.count(name) > 0; };
+        env.callee = [this](const std::string& name, Kernel* caller) -> Kernel* {
+            auto it = functions.find(name);
+            if (it == functions.end() || it->second.isAsync || hostFunctions.count(name)) return nullptr;
+            Kernel* callee = functionKernel(it->second);
+            if (!callee || callee == caller) return callee;
+            // A callee's lets could land in its caller's variables.
+            return callee->compiling || !callee->locals.empty() ? nullptr : callee;
+        };
+        return env;
+    }
+
+    // Compiles on first use; null if the function cannot be a kernel.
+    Kernel* functionKernel(const Function& func) {
+        KernelSlot& slot = functionKernels[&func];
+        if (slot.kernel || slot.failed) return slot.kernel;
+        if (heap->stats().limitBytes) {
+            slot.failed = true;
+            return nullptr;
+        }
+        auto kernel = std::make_unique<Kernel>();
+        slot.kernel = kernel.get();
+        kernel->compiling = true;
+        KernelCompiler::Environment env = kernelEnvironment();
+        try {
+            KernelCompiler(func.code, env, *kernel).compileFunction(func.params, func.bodyStart, func.bodyEnd);
+        } catch (const KernelCompiler::Unsupported&) {
+            kernel.reset();
+        } catch (...) {
+            functionKernels[&func] = KernelSlot();
+            throw;
+        }
+        KernelSlot& done = functionKernels[&func];
+        // Recursion was compiled assuming a number comes back.
+        if (kernel && kernel->callsItself && (kernel->returnKinds != KIND_NUMBER || !kernel->locals.empty())) {
+            kernel.reset();
+        }
+        if (!kernel) {
+            done.kernel = nullptr;
+            done.failed = true;
+            return nullptr;
+        }
+        kernel->compiling = false;
+        finishKernel(*kernel);
+        kernelStore.push_back(std::move(kernel));
+        return done.kernel;
+    }
+
+    void finishKernel(Kernel& kernel) {
+        if (kernelRuntime.stack.empty()) kernelRuntime.stack.resize(KernelRuntime::STACK_SIZE);
+#ifdef CHOCO_HAS_JIT
+        if (tier == TIER_JIT) KernelAssembler(kernel).assemble(kernel);
+#endif
+    }
+
+    bool runFunctionKernel(const Function& func, const std::vector<Value>& args, Value& result) {
+        syncKernels();
+        KernelSlot* slot = &functionKernels[&func];
+        if (slot->failed || func.isAsync) return false;
+        if (!slot->kernel) {
+            if (++slot->calls < (eagerKernels ? 1 : KERNEL_CALL_THRESHOLD)) return false;
+            if (!functionKernel(func)) return false;
+            slot = &functionKernels[&func];
+        }
+        Kernel& kernel = *slot->kernel;
+        KernelRuntime& rt = kernelRuntime;
+        if (rt.top + kernel.registers > rt.stack.size()) return false;
+        for (size_t i = 0; i < kernel.params; i++) {
+            if (args[i].type != Value::NUMBER || args[i].wide) return false;
+        }
+        for (const auto& name : kernel.locals) {
+            if (findVariable(name)) return false;
+        }
+        double* frame = rt.stack.data() + rt.top;
+        for (size_t i = 0; i < kernel.params; i++) frame[i] = args[i].num;
+        rt.top += kernel.registers;
+        int status = enterKernel(kernel, frame, rt);
+        rt.top -= kernel.registers;
+        if (status != 0) {
+            if (++slot->deopts >= KERNEL_MAX_DEOPTS) slot->failed = true;
+            return false;
+        }
+        if (rt.ret.kind == KIND_NUMBER) result = Value(rt.ret.value);
+        else if (rt.ret.kind == KIND_BOOL) result = Value(rt.ret.value != 0);
+        else result = Value();
+        return true;
+    }
+
+    // Runs the rest of the while loop whose condition starts at
+    // conditionStart, just before the condition is next evaluated. False
+    // if the loop has to go on in the interpreter.
+    bool runLoopKernel(size_t conditionStart) {
+        syncKernels();
+        KernelSlot& slot = loopKernels[std::make_pair(tokens.id(), conditionStart)];
+        if (slot.failed) return false;
+        if (!slot.kernel) {
+            if (heap->stats().limitBytes) {
+                slot.failed = true;
+                return false;
+            }
+            auto kernel = std::make_unique<Kernel>();
+            KernelCompiler::Environment env = kernelEnvironment();
+            try {
+                KernelCompiler(tokens, env, *kernel).compileLoop(conditionStart, [this](const std::string& name) -> uint8_t {
+                    const Value* var = findVariable(name);
+                    if (!var || var->wide) return 0;
+                    return var->type == Value::NUMBER ? KIND_NUMBER : var->type == Value::BOOL ? KIND_BOOL : 0;
+                });
+            } catch (const KernelCompiler::Unsupported&) {
+                slot.failed = true;
+                return false;
+            }
+            finishKernel(*kernel);
+            slot.kernel = kernel.get();
+            kernelStore.push_back(std::move(kernel));
+        }
+        Kernel& kernel = *slot.kernel;
+        KernelRuntime& rt = kernelRuntime;
+        if (rt.top + kernel.registers > rt.stack.size()) return false;
+        double* frame = rt.stack.data() + rt.top;
+        for (size_t i = 0; i < kernel.names.size(); i++) {
+            const Value* var = findVariable(kernel.names[i]);
+            if (!var) return false;
+            if (kernel.kinds[i] == KIND_NUMBER && var->type == Value::NUMBER && !var->wide) frame[i] = var->num;
+            else if (kernel.kinds[i] == KIND_BOOL && var->type == Value::BOOL) frame[i] = var->boolean ? 1 : 0;
+            else return false;
+        }
+        rt.top += kernel.registers;
+        int status = enterKernel(kernel, frame, rt);
+        rt.top -= kernel.registers;
+        if (status != 0) {
+            if (++slot.deopts >= KERNEL_MAX_DEOPTS) slot.failed = true;
+            return false;
+        }
+        for (size_t i = 0; i < kernel.names.size(); i++) {
+            if (!kernel.written[i]) continue;
+            if (kernel.kinds[i] == KIND_NUMBER) setVariable(kernel.names[i], Value(frame[i]));
+            else setVariable(kernel.names[i], Value(frame[i] != 0));
+        }
+        return true;
+    }
+
+    // Runs iterations next..end-1 of the counted loop over `var` whose body
+    // is [bodyStart, bodyEnd). False if they have to run in the interpreter.
+    bool runRangeKernel(const std::string& var, int64_t next, int64_t end, size_t bodyStart, size_t bodyEnd) {
+        syncKernels();
+        KernelSlot& slot = rangeKernels[std::make_pair(tokens.id(), bodyStart)];
+        if (slot.failed) return false;
+        if (end > Value::WIDE_THRESHOLD || next < -Value::WIDE_THRESHOLD) return false;
+        if (!slot.kernel) {
+            if (heap->stats().limitBytes) {
+                slot.failed = true;
+                return false;
+            }
+            auto kernel = std::make_unique<Kernel>();
+            KernelCompiler::Environment env = kernelEnvironment();
+            try {
+                KernelCompiler(tokens, env, *kernel).compileRange(var, bodyStart, bodyEnd, [this](const std::string& name) -> uint8_t {
+                    const Value* v = findVariable(name);
+                    if (!v || v->wide) return 0;
+                    return v->type == Value::NUMBER ? KIND_NUMBER : v->type == Value::BOOL ? KIND_BOOL : 0;
+                });
+            } catch (const KernelCompiler::Unsupported&) {
+                slot.failed = true;
+                return false;
+            }
+            finishKernel(*kernel);
+            slot.kernel = kernel.get();
+            kernelStore.push_back(std::move(kernel));
+        }
+        Kernel& kernel = *slot.kernel;
+        KernelRuntime& rt = kernelRuntime;
+        if (rt.top + kernel.registers > rt.stack.size()) return false;
+        double* frame = rt.stack.data() + rt.top;
+        size_t count = kernel.names.size();
+        for (size_t i = 0; i < count; i++) {
+            const Value* v = findVariable(kernel.names[i]);
+            if (!v) return false;
+            if (kernel.kinds[i] == KIND_NUMBER && v->type == Value::NUMBER && !v->wide) frame[i] = v->num;
+            else if (kernel.kinds[i] == KIND_BOOL && v->type == Value::BOOL) frame[i] = v->boolean ? 1 : 0;
+            else return false;
+        }
+        frame[count] = static_cast<double>(next - 1);
+        frame[count + 1] = static_cast<double>(end);
+        rt.top += kernel.registers;
+        int status = enterKernel(kernel, frame, rt);
+        rt.top -= kernel.registers;
+        if (status != 0) {
+            if (++slot.deopts >= KERNEL_MAX_DEOPTS) slot.failed = true;
+            return false;
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (!kernel.written[i]) continue;
+            if (kernel.kinds[i] == KIND_NUMBER) setVariable(kernel.names[i], Value(frame[i]));
+            else setVariable(kernel.names[i], Value(frame[i] != 0));
+        }
+        return true;
+    }
+
+    // A one-parameter lambda as a kernel. Numbers it reads from its
+    // captures, but never assigns, become extra parameters.
+    Kernel* lambdaKernel(const Value& fn) {
+        KernelSlot& slot = lambdaKernels[std::make_pair(tokens.id(), fn.lambdaBodyStart)];
+        if (slot.kernel || slot.failed) return slot.kernel;
+        slot.failed = true;
+        if (heap->stats().limitBytes || fn.lambdaParams.size() != 1) return nullptr;
+        std::vector<std::string> params = fn.lambdaParams;
+        std::vector<std::string> captures;
+        for (size_t i = fn.lambdaBodyStart; i < fn.lambdaBodyEnd; i++) {
+            const Token& t = tokens[i];
+            if (t.type != TOKEN_IDENTIFIER || (i > 0 && tokens[i - 1].type == TOKEN_DOT)) continue;
+            auto captured = fn.closureCaptures.find(t.value);
+            if (captured == fn.closureCaptures.end() || captured->second.type != Value::NUMBER ||
+                isCallableName(t.value) || std::find(params.begin(), params.end(), t.value) != params.end()) {
+                continue;
+            }
+            bool assigned = false;
+            for (size_t j = fn.lambdaBodyStart; j < fn.lambdaBodyEnd && !assigned; j++) {
+                assigned = tokens[j].type == TOKEN_IDENTIFIER && tokens[j].value == t.value &&
+                           ((j + 1 < fn.lambdaBodyEnd && tokens[j + 1].type == TOKEN_EQUAL) ||
+                            (j > 0 && tokens[j - 1].type == TOKEN_LET));
+            }
+            if (assigned) return nullptr;
+            params.push_back(t.value);
+            captures.push_back(t.value);
+        }
+        auto kernel = std::make_unique<Kernel>();
+        KernelCompiler::Environment env = kernelEnvironment();
+        try {
+            KernelCompiler(tokens, env, *kernel).compileFunction(params, fn.lambdaBodyStart, fn.lambdaBodyEnd);
+        } catch (const KernelCompiler::Unsupported&) {
+            return nullptr;
+        }
+        if (kernel->returnKinds != KIND_NUMBER) return nullptr;
+        kernel->captures = std::move(captures);
+        finishKernel(*kernel);
+        KernelSlot& done = lambdaKernels[std::make_pair(tokens.id(), fn.lambdaBodyStart)];
+        done.failed = false;
+        done.kernel = kernel.get();
+        kernelStore.push_back(std::move(kernel));
+        return done.kernel;
+    }
+
+    // map() of `fn` over packed numbers through its kernel. False, with
+    // nothing observable done, if an element has to run interpreted.
+    bool mapKernel(const Value& fn, const std::vector<double>& items, std::vector<double>& out) {
+        if (tier == TIER_INTERPRET || limited || items.size() < (eagerKernels ? 1 : KERNEL_LOOP_THRESHOLD)) {
+            return false;
+        }
+        syncKernels();
+        Kernel* kernel = lambdaKernel(fn);
+        if (!kernel) return false;
+        KernelRuntime& rt = kernelRuntime;
+        if (rt.top + kernel->registers > rt.stack.size()) return false;
+        double* frame = rt.stack.data() + rt.top;
+        for (size_t i = 0; i < kernel->captures.size(); i++) {
+            auto captured = fn.closureCaptures.find(kernel->captures[i]);
+            if (captured == fn.closureCaptures.end() || captured->second.type != Value::NUMBER ||
+                captured->second.wide) {
+                return false;
+            }
+            frame[1 + i] = captured->second.num;
+        }
+        for (const auto& name : kernel->locals) {
+            if (fn.closureCaptures.count(name) || findVariable(name)) return false;
+        }
+        out.resize(items.size());
+        rt.top += kernel->registers;
+        for (size_t i = 0; i < items.size(); i++) {
+            frame[0] = items[i];
+            if (enterKernel(*kernel, frame, rt) != 0) {
+                rt.top -= kernel->registers;
+                out.clear();
+                KernelSlot& slot = lambdaKernels[std::make_pair(tokens.id(), fn.lambdaBodyStart)];
+                if (++slot.deopts >= KERNEL_MAX_DEOPTS) slot.failed = true;
+                return false;
+            }
+            out[i] = rt.ret.value;
+        }
+        rt.top -= kernel->registers;
+        return true;
+    }
+
+    // ---- async/await ------------------------------------------------------
+
+    void swapExecState(ExecState& other) {
+        std::swap(tokens, other.tokens);
+        std::swap(scopes, other.scopes);
+        std::swap(captureLayers, other.captureLayers);
+        std::swap(current, other.current);
+        std::swap(inFunction, other.inFunction);
+        std::swap(inLoop, other.inLoop);
+        std::swap(hasReturned, other.hasReturned);
+        std::swap(returnValue, other.returnValue);
+        std::swap(shouldBreak, other.shouldBreak);
+        std::swap(shouldContinue, other.shouldContinue);
+        std::swap(inTryCatch, other.inTryCatch);
+        std::swap(currentException, other.currentException);
+        // Globals are shared: the global scope always travels with whichever
+        // context is currently running.
+        std::swap(scopes[0], other.scopes[0]);
+    }
+
+    static Value taskValue(std::shared_ptr<TaskState> task) {
+        Value result;
+        result.type = Value::TASK;
+        result.task = std::move(task);
+        return result;
+    }
+
+    void completeTask(TaskState& task, Value result) {
+        task.done = true;
+        task.result = std::move(result);
+#ifdef CHOCO_HAS_EVENT_LOOP
+        for (Coroutine* waiter : task.waiters) {
+            asyncRuntime->ready.push_back(waiter);
+        }
+#endif
+        task.waiters.clear();
+    }
+
+    void failTask(TaskState& task, const std::string& message, int line) {
+        task.failed = true;
+        task.error = message;
+        task.errorLine = line;
+        completeTask(task, Value());
+    }
+
+    // Calling an async function creates a coroutine and returns its task
+    // right away; the body starts running the next time the loop turns.
+    Value startTask(const Function& func, const std::vector<Value>& args, int callLine) {
+        auto task = newHeapObject<TaskState>();
+#ifdef CHOCO_HAS_EVENT_LOOP
+        AsyncRuntime& rt = runtime();
+        auto co = std::make_unique<Coroutine>();
+        co->stackSize = AsyncRuntime::stackSize();
+        co->stack = mmap(nullptr, co->stackSize, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if (co->stack == MAP_FAILED) {
+            throw RuntimeError("Could not allocate a stack for async call", callLine);
+        }
+        mprotect(co->stack, 4096, PROT_NONE);
+        getcontext(&co->context);
+        co->context.uc_stack.ss_sp = co->stack;
+        co->context.uc_stack.ss_size = co->stackSize;
+        co->context.uc_link = nullptr;
+        uintptr_t self = reinterpret_cast<uintptr_t>(this);
+        makecontext(&co->context, reinterpret_cast<void (*)()>(&Interpreter::coroutineEntry), 2,
+                    static_cast<unsigned>(self & 0xffffffffu), static_cast<unsigned>(self >> 32));
+
+        co->state.tokens = tokens;
+        co->state.scopes.emplace_back();
+        co->state.captureLayers.push_back(nullptr);
+        co->func = func;
+        co->args = args;
+        co->task = task;
+        rt.unobserved.push_back(task);
+        rt.ready.push_back(co.get());
+        rt.coroutines.emplace(co.get(), std::move(co));
+#else
+        // Without an event loop async calls simply run to completion.
+        try {
+            completeTask(*task, invokeFunction(func, args));
+        } catch (const ThrownError& e) {
+            task->thrown = true;
+            failTask(*task, e.message, e.line);
+        } catch (const RuntimeError& e) {
+            failTask(*task, e.what(), e.line);
+        }
+#endif
+        return taskValue(task);
+    }
+
+    // Suspends until the task finishes and returns its result. Inside a
+    // coroutine this yields to the scheduler; in the main program it runs
+    // the event loop until the task is done. Non-task values pass through.
+    Value awaitValue(const Value& value, int line) {
+        if (value.type != Value::TASK) return value;
+        TaskState& task = *value.task;
+        task.observed = true;
+#ifdef CHOCO_HAS_EVENT_LOOP
+        if (!task.done) {
+            AsyncRuntime& rt = runtime();
+            if (rt.running) {
+                Coroutine* self = rt.running;
+                task.waiters.push_back(self);
+                swapcontext(&self->context, &rt.schedulerContext);
+            } else {
+                runEventLoop([&] { return task.done; }, line);
+            }
+        }
+#endif
+        if (task.failed && task.thrown) {
+            if (inTryCatch) {
+                currentException = task.error;
+                return Value();
+            }
+            throw ThrownError(task.error, task.errorLine);
+        }
+        if (task.failed && limitExceeded) {
+            throw ResourceLimitError(task.error, task.errorLine ? task.errorLine : line);
+        }
+        if (task.failed) {
+            throw RuntimeError(task.error, task.errorLine ? task.errorLine : line);
+        }
+        return task.result;
+    }
+
+#ifdef CHOCO_HAS_EVENT_LOOP
+    AsyncRuntime& runtime() {
+        if (!asyncRuntime) asyncRuntime = std::make_unique<AsyncRuntime>();
+        return *asyncRuntime;
+    }
+
+    static void coroutineEntry(unsigned lo, unsigned hi) {
+        Interpreter* self = reinterpret_cast<Interpreter*>(static_cast<uintptr_t>(lo) | (static_cast<uintptr_t>(hi) << 32));
+        AsyncRuntime& rt = *self->asyncRuntime;
+        Coroutine* co = rt.running;
+        try {
+            self->completeTask(*co->task, self->invokeFunction(co->func, co->args));
+        } catch (const ThrownError& e) {
+            co->task->thrown = true;
+            self->failTask(*co->task, e.message, e.line);
+        } catch (const RuntimeError& e) {
+            self->failTask(*co->task, e.what(), e.line);
+        } catch (const ParseError& e) {
+            self->failTask(*co->task, e.what(), e.line);
+        } catch (const std::exception& e) {
+            self->failTask(*co->task, e.what(), 0);
+        }
+        co->finished = true;
+        swapcontext(&co->context, &rt.schedulerContext);
+    }
+
+    void resumeCoroutine(Coroutine* co) {
+        AsyncRuntime& rt = *asyncRuntime;
+        rt.running = co;
+        swapExecState(co->state);
+        swapcontext(&rt.schedulerContext, &co->context);
+        swapExecState(co->state);
+        rt.running = nullptr;
+        if (co->finished) {
+            munmap(co->stack, co->stackSize);
+            rt.coroutines.erase(co);
+        }
+    }
+
+    // Turns the loop until `done` holds: resumes ready coroutines first and
+    // blocks in epoll only when nothing else can make progress.
+    void runEventLoop(const std::function<bool()>& done, int line) {
+        AsyncRuntime& rt = *asyncRuntime;
+        while (!done()) {
+            if (!rt.ready.empty()) {
+                Coroutine* co = rt.ready.front();
+                rt.ready.pop_front();
+                resumeCoroutine(co);
+                continue;
+            }
+            if (rt.pending.empty()) {
+                throw RuntimeError("await can never complete: every remaining task is waiting on another", line);
+            }
+            pollEvents();
+        }
+    }
+
+    void pollEvents() {
+        AsyncRuntime& rt = *asyncRuntime;
+        epoll_event events[64];
+        int n = epoll_wait(rt.epollFd, events, 64, -1);
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            auto it = rt.pending.find(fd);
+            if (it == rt.pending.end()) continue;
+            PendingIo& io = it->second;
+
+            if (io.kind == PendingIo::TIMER || io.kind == PendingIo::CHANNEL) {
+                uint64_t expirations;
+                ssize_t ignored = read(fd, &expirations, sizeof(expirations));
+                (void)ignored;
+                std::shared_ptr<TaskState> task = io.task;
+                rt.unwatch(fd);
+                completeTask(*task, Value());
+            } else if (io.kind == PendingIo::FILE_READ) {
+                io.reader.join();
+                std::shared_ptr<TaskState> task = io.task;
+                auto result = io.fileResult;
+                rt.unwatch(fd);
+                if (result->first) {
+                    completeTask(*task, Value(result->second));
+                } else {
+                    failTask(*task, "read_file_async(): cannot open file '" + result->second + "'", 0);
+                }
+            } else if (io.kind == PendingIo::ISOLATE) {
+                io.reader.join();
+                std::shared_ptr<TaskState> task = io.task;
+                std::shared_ptr<TaskState> result = io.isolateResult;
+                rt.unwatch(fd);
+                task->thrown = result->thrown;
+                if (result->failed) {
+                    failTask(*task, result->error, result->errorLine);
+                } else {
+                    completeTask(*task, std::move(result->result));
+                }
+            } else {
+                char buffer[4096];
+                ssize_t got;
+                while ((got = read(fd, buffer, sizeof(buffer))) > 0) {
+                    io.buffer.append(buffer, static_cast<size_t>(got));
+                }
+                if (got == 0 || (got < 0 && errno != EAGAIN)) {
+                    waitpid(io.pid, nullptr, 0);
+                    std::shared_ptr<TaskState> task = io.task;
+                    std::string output = std::move(io.buffer);
+                    rt.unwatch(fd);
+                    completeTask(*task, Value(output));
+                }
+            }
+        }
+    }
+
+    // True when blocking this thread could starve a task: inside an async
+    // function, or while the loop still has work queued.
+    bool eventLoopBusy() const {
+        if (!asyncRuntime) return false;
+        const AsyncRuntime& rt = *asyncRuntime;
+        return rt.running || !rt.ready.empty() || !rt.pending.empty();
+    }
+
+    // Retries `attempt` until it reports done, parking the caller on an
+    // eventfd the channel signals in between, so other tasks keep running
+    // while a channel is full or empty.
+    void waitOnChannel(Channel& chan, const std::function<bool()>& attempt, int line) {
+        while (!attempt()) {
+            int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (fd < 0) {
+                throw RuntimeError("could not create eventfd to wait on a channel", line);
+            }
+            chan.addWaiter(fd);
+            if (attempt()) {
+                chan.removeWaiter(fd);
+                close(fd);
+                return;
+            }
+            auto task = newHeapObject<TaskState>();
+            PendingIo io;
+            io.kind = PendingIo::CHANNEL;
+            io.task = task;
+            runtime().watch(fd, std::move(io));
+            awaitValue(taskValue(task), line);
+        }
+    }
+
+    // Lets every outstanding task finish before the program exits.
+    void drainEventLoop() {
+        if (!asyncRuntime) return;
+        AsyncRuntime& rt = *asyncRuntime;
+        runEventLoop([&] { return rt.ready.empty() && rt.pending.empty(); }, peek().line);
+        for (const auto& task : rt.unobserved) {
+            if (task->failed && !task->observed) {
+                *err << "\n[Runtime Error] Line " << task->errorLine << ": "
+                     << (task->thrown ? "Uncaught exception: " : "") << task->error
+                     << " (in async task that was never awaited)" << std::endl;
+            }
+        }
+        rt.unobserved.clear();
+    }
+#endif
+
+    // Blocks while the channel is full; returns false if it was closed.
+    bool channelSend(Channel& chan, Value& value, int line) {
+#ifdef CHOCO_HAS_EVENT_LOOP
+        if (eventLoopBusy()) {
+            bool sent = false;
+            waitOnChannel(chan, [&] { return chan.isClosed() || (sent = chan.trySend(value)); }, line);
+            return sent;
+        }
+#endif
+        return chan.send(value);
+    }
+
+    // Blocks while the channel is empty; returns false once it is closed
+    // and drained.
+    bool channelRecv(Channel& chan, Value& out, int line) {
+#ifdef CHOCO_HAS_EVENT_LOOP
+        if (eventLoopBusy()) {
+            bool got = false;
+            waitOnChannel(chan, [&] {
+                if ((got = chan.tryRecv(out))) return true;
+                if (!chan.isClosed()) return false;
+                got = chan.tryRecv(out);
+                return true;
+            }, line);
+            return got;
+        }
+#endif
+        return chan.recv(out);
+    }
+
+    Value asyncBuiltin(const std::string& name, const std::vector<Value>& args, int callLine) {
+        auto task = newHeapObject<TaskState>();
+        if (name == "sleep") {
+            if (args.size() == 0 || args[0].type != Value::NUMBER || args[0].num < 0) {
+                throw RuntimeError("sleep() expects a non-negative number of milliseconds", callLine);
+            }
+#ifdef CHOCO_HAS_EVENT_LOOP
+            int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+            if (fd < 0) {
+                throw RuntimeError("sleep(): could not create timer", callLine);
+            }
+            long long ns = std::max(1LL, static_cast<long long>(args[0].num * 1e6));
+            itimerspec spec{};
+            spec.it_value.tv_sec = ns / 1000000000LL;
+            spec.it_value.tv_nsec = ns % 1000000000LL;
+            timerfd_settime(fd, 0, &spec, nullptr);
+            PendingIo io;
+            io.kind = PendingIo::TIMER;
+            io.task = task;
+            runtime().watch(fd, std::move(io));
+#else
+            std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(args[0].num));
+            completeTask(*task, Value());
+#endif
+            return taskValue(task);
+        }
+
+        if (name == "read_file_async") {
+            if (args.size() == 0 || args[0].type != Value::STRING) {
+                throw RuntimeError("read_file_async() requires a string filename", callLine);
+            }
+#ifdef CHOCO_HAS_EVENT_LOOP
+            // Regular files can't be polled, so the read runs on a helper
+            // thread that signals an eventfd when it is done.
+            int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (fd < 0) {
+                throw RuntimeError("read_file_async(): could not create eventfd", callLine);
+            }
+            PendingIo io;
+            io.kind = PendingIo::FILE_READ;
+            io.task = task;
+            io.fileResult = std::make_shared<std::pair<bool, std::string>>(false, args[0].str);
+            auto result = io.fileResult;
+            std::string path = args[0].str;
+            io.reader = std::thread([fd, result, path] {
+                std::ifstream file(path);
+                if (file) {
+                    std::stringstream buffer;
+                    buffer << file.rdbuf();
+                    result->first = true;
+                    result->second = buffer.str();
+                }
+                uint64_t one = 1;
+                ssize_t ignored = write(fd, &one, sizeof(one));
+                (void)ignored;
+            });
+            runtime().watch(fd, std::move(io));
+#else
+            std::ifstream file(args[0].str);
+            if (!file) {
+                failTask(*task, "read_file_async(): cannot open file '" + args[0].str + "'", callLine);
+            } else {
+                std::stringstream buffer;
+                buffer << file.rdbuf();
+                completeTask(*task, Value(buffer.str()));
+            }
+#endif
+            return taskValue(task);
         }
-        
-        if (name == "file_exists") {
-            if (args.size() == 0) {
-                throw RuntimeError("file_exists() expects 1 argument (filename), got 0", callLine);
+
+        // exec_async: runs a shell command and resolves to its standard output.
+        if (args.size() == 0 || args[0].type != Value::STRING) {
+            throw RuntimeError("exec_async() requires a command string", callLine);
+        }
+#ifdef CHOCO_HAS_EVENT_LOOP
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) != 0) {
+            throw RuntimeError("exec_async(): could not create pipe", callLine);
+        }
+        pid_t pid = fork();
+        if (pid < 0) {
+            close(fds[0]);
+            close(fds[1]);
+            throw RuntimeError("exec_async(): could not start process", callLine);
+        }
+        if (pid == 0) {
+            dup2(fds[1], STDOUT_FILENO);
+            execl("/bin/sh", "sh", "-c", args[0].str.c_str(), static_cast<char*>(nullptr));
+            _exit(127);
+        }
+        close(fds[1]);
+        fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+        PendingIo io;
+        io.kind = PendingIo::PROCESS;
+        io.task = task;
+        io.pid = pid;
+        runtime().watch(fds[0], std::move(io));
+#else
+        std::string output;
+        FILE* pipe = popen(args[0].str.c_str(), "r");
+        if (!pipe) {
+            throw RuntimeError("exec_async(): could not start process", callLine);
+        }
+        char buffer[4096];
+        size_t got;
+        while ((got = fread(buffer, 1, sizeof(buffer), pipe)) > 0) {
+            output.append(buffer, got);
+        }
+        pclose(pipe);
+        completeTask(*task, Value(output));
+#endif
+        return taskValue(task);
+    }
+
+    Interpreter(const TokenStream& toks) : tokens(toks), current(0), 
+        inFunction(false), inLoop(false), hasReturned(false), shouldBreak(false), 
+        shouldContinue(false), inTryCatch(false), out(&std::cout), err(&std::cerr), in(&std::cin) {
+        scopes.push_back(std::unordered_map<std::string, Value>());
+        scopes.reserve(16);
+        captureLayers.push_back(nullptr);
+        captureLayers.reserve(16);
+        std::random_device device;
+        std::seed_seq seed{device(), device(), static_cast<unsigned>(time(nullptr)),
+                           static_cast<unsigned>(reinterpret_cast<uintptr_t>(this))};
+        rng.seed(seed);
+    }
+
+    void setOutput(std::ostream& stream) { out = &stream; }
+    void setErrorOutput(std::ostream& stream) { err = &stream; }
+    void setInput(std::istream& stream) { in = &stream; }
+    void seedRandom(uint64_t seed) { rng.seed(seed); }
+
+    void registerBuiltin(const std::string& name, HostFunction fn) {
+        hostFunctions[name] = std::move(fn);
+        callableEpoch++;
+    }
+
+    void setFuel(uint64_t units) {
+        fuelLimited = true;
+        fuelLeft = 0;
+        fuelTank = std::make_shared<std::atomic<uint64_t>>(units);
+        limitExceeded = false;
+        limited = true;
+    }
+
+    void setDeadline(std::chrono::steady_clock::duration budget) {
+        hasDeadline = true;
+        deadline = std::chrono::steady_clock::now() + budget;
+        deadlineTicks = 0;
+        limitExceeded = false;
+        limited = true;
+    }
+
+    void clearLimits() {
+        limited = limitExceeded = fuelLimited = hasDeadline = false;
+    }
+
+    uint64_t remainingFuel() const {
+        return fuelLimited ? fuelLeft + fuelTank->load(std::memory_order_relaxed) : fuelLeft;
+    }
+
+    void setHeapLimit(size_t bytes) { heap->setLimit(bytes); }
+    HeapStats heapStats() const { return heap->stats(); }
+
+    // Call while catching HeapLimitError: builds the RuntimeError (the
+    // tripped account lets its message be allocated), then re-arms the limit.
+    RuntimeError heapLimitError() {
+        RuntimeError error("Heap limit of " + std::to_string(heap->stats().limitBytes) + " bytes exceeded",
+                           current < tokens.size() ? tokens[current].line : 0);
+        heap->rearm();
+        return error;
+    }
+
+    inline void charge(uint64_t units) {
+        if (limited) chargeLimited(units);
+    }
+
+    // Draws what `units` needs beyond fuelLeft, plus a batch, from the tank.
+    bool refuel(uint64_t units) {
+        uint64_t want = units - fuelLeft + FUEL_BATCH;
+        uint64_t tank = fuelTank->load(std::memory_order_relaxed);
+        for (;;) {
+            if (tank < units - fuelLeft) return false;
+            uint64_t take = std::min(tank, want);
+            if (fuelTank->compare_exchange_weak(tank, tank - take, std::memory_order_relaxed)) {
+                fuelLeft += take;
+                return true;
             }
-            if (args[0].type != Value::STRING) {
-                throw RuntimeError("file_exists() requires a string filename, got " + args[0].getType(), callLine);
+        }
+    }
+
+    void chargeLimited(uint64_t units) {
+        int line = current < tokens.size() ? tokens[current].line : 0;
+        if (limitExceeded) {
+            throw ResourceLimitError("Execution limit exceeded", line);
+        }
+        if (fuelLimited) {
+            if (units > fuelLeft && !refuel(units)) {
+                fuelLeft = 0;
+                limitExceeded = true;
+                throw ResourceLimitError("Out of fuel", line);
             }
-            std::ifstream file(args[0].str);
-            return Value(file.good());
+            fuelLeft -= units;
         }
-        
-        if (name == "input") {
-            std::string prompt = "";
-            if (args.size() > 0) {
-                if (args[0].type != Value::STRING) {
-                    throw RuntimeError("input() prompt must be a string, got " + args[0].getType(), callLine);
+        if (hasDeadline) {
+            deadlineTicks += units;
+            if (deadlineTicks >= DEADLINE_CHECK_INTERVAL) {
+                deadlineTicks = 0;
+                if (std::chrono::steady_clock::now() >= deadline) {
+                    limitExceeded = true;
+                    throw ResourceLimitError("Deadline exceeded", line);
                 }
-                prompt = args[0].str;
-            }
-            
-            if (!prompt.empty()) {
-                std::cout << prompt;
-                std::cout.flush();
-            }
-            
-            std::string line;
-            if (std::getline(std::cin, line)) {
-                return Value(line);
-            } else {
-                return Value("");
             }
         }
+    }
 
-#ifndef CHOCO_NO_GUI
-        ChocoGUI* gui = ChocoGUI::getInstance(0, nullptr);
-        gui->setInterpreter(this);
-
-        if (name == "gui_init") return gui->gui_init(args, callLine);
-        if (name == "gui_window") return gui->gui_window(args, callLine);
-        if (name == "gui_button") return gui->gui_button(args, callLine);
-        if (name == "gui_label") return gui->gui_label(args, callLine);
-        if (name == "gui_entry") return gui->gui_entry(args, callLine);
-        if (name == "gui_box") return gui->gui_box(args, callLine);
-        if (name == "gui_add") return gui->gui_add(args, callLine);
-        if (name == "gui_set_text") return gui->gui_set_text(args, callLine);
-        if (name == "gui_get_text") return gui->gui_get_text(args, callLine);
-        if (name == "gui_on") return gui->gui_on(args, callLine);
-        if (name == "gui_show") return gui->gui_show(args, callLine);
-        if (name == "gui_run") return gui->gui_run(args, callLine);
-        if (name == "gui_quit") return gui->gui_quit(args, callLine);
-        if (name == "gui_checkbox") return gui->gui_checkbox(args, callLine);
-        if (name == "gui_textview") return gui->gui_textview(args, callLine);
-        if (name == "gui_frame") return gui->gui_frame(args, callLine);
-        if (name == "gui_separator") return gui->gui_separator(args, callLine);
-        if (name == "gui_set_sensitive") return gui->gui_set_sensitive(args, callLine);
-        if (name == "gui_get_checked") return gui->gui_get_checked(args, callLine);
-        if (name == "gui_set_checked") return gui->gui_set_checked(args, callLine);
-#else
-        if (name.substr(0, 4) == "gui_") {
-            throw RuntimeError("GUI function '" + name + "' not available - compiled without GUI support", callLine);
+    // Saves functions, structs, globals and every token stream they refer
+    // to, plus the position just after the current top-level statement.
+    void writeSnapshot(const std::string& path, int line) {
+        int depth = 0;
+        for (size_t i = 0; i < current; i++) {
+            if (tokens[i].type == TOKEN_LBRACE) depth++;
+            if (tokens[i].type == TOKEN_RBRACE) depth--;
         }
-#endif
-        auto it = functions.find(name);
-        if (it == functions.end()) {
-            throw RuntimeError("Undefined function '" + name + "'", callLine);
+        if (depth != 0 || scopes.size() != 1 || inFunction || current >= tokens.size() ||
+            tokens[current].type != TOKEN_SEMICOLON) {
+            throw RuntimeError("snapshot() must be called as a top-level statement", line);
         }
 
-        Function& func = it->second;
-        
-        if (args.size() < func.params.size()) {
-            throw RuntimeError("Function '" + name + "' expects " + std::to_string(func.params.size()) + 
-                             " arguments, got " + std::to_string(args.size()), callLine);
+        std::vector<TokenStream> streams = {tokens};
+        auto streamIndex = [&](const TokenStream& code) {
+            for (size_t i = 0; i < streams.size(); i++) {
+                if (streams[i].data() == code.data()) return static_cast<uint32_t>(i);
+            }
+            streams.push_back(code);
+            return static_cast<uint32_t>(streams.size() - 1);
+        };
+        for (const auto& func : functions) streamIndex(func.second.code);
+        for (const auto& def : structDefs) {
+            for (const auto& method : def.second.methods) streamIndex(method.second.code);
         }
-        
-        scopes.push_back(std::unordered_map<std::string, Value>());
-        
-        for (size_t i = 0; i < func.params.size() && i < args.size(); i++) {
-            scopes.back()[func.params[i]] = args[i];
+
+        SnapshotWriter w;
+        w.raw(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+        w.u32(SNAPSHOT_VERSION);
+        w.u32(static_cast<uint32_t>(streams.size()));
+        for (const auto& stream : streams) {
+            w.u32(static_cast<uint32_t>(stream.size()));
+            for (size_t i = 0; i < stream.size(); i++) {
+                w.u32(static_cast<uint32_t>(stream[i].type));
+                w.u32(static_cast<uint32_t>(stream[i].line));
+                w.str(stream[i].value);
+            }
         }
+        w.u64(current + 1);
 
-        size_t savedCurrent = current;
-        current = func.bodyStart;
-        bool wasInFunction = inFunction;
-        inFunction = true;
-        hasReturned = false;
-        returnValue = Value();
+        auto writeFunctions = [&](const std::unordered_map<std::string, Function>& table) {
+            w.u32(static_cast<uint32_t>(table.size()));
+            for (const auto& func : table) {
+                w.str(func.first);
+                w.u32(static_cast<uint32_t>(func.second.params.size()));
+                for (const auto& param : func.second.params) w.str(param);
+                w.u64(func.second.bodyStart);
+                w.u64(func.second.bodyEnd);
+                w.u8(func.second.isAsync);
+                w.u32(streamIndex(func.second.code));
+            }
+        };
 
-        while (current < func.bodyEnd && !isAtEnd() && !hasReturned) {
-            statement();
+        w.u32(static_cast<uint32_t>(structDefs.size()));
+        for (const auto& def : structDefs) {
+            w.str(def.first);
+            w.u32(static_cast<uint32_t>(def.second.fields.size()));
+            for (const auto& field : def.second.fields) w.str(field);
+            writeFunctions(def.second.methods);
         }
 
-        Value result = returnValue;
-        hasReturned = false;
-        inFunction = wasInFunction;
-        
-        scopes.pop_back();
-        
-        current = savedCurrent;
-        return result;
+        writeFunctions(functions);
+
+        w.u32(static_cast<uint32_t>(scopes[0].size()));
+        for (const auto& global : scopes[0]) {
+            w.str(global.first);
+            w.value(global.second, global.first, line);
+        }
+
+        if (!w.save(path)) {
+            throw RuntimeError("snapshot(): cannot write '" + path + "'", line);
+        }
     }
 
-    Interpreter(const std::vector<Token>& toks) : tokens(toks), current(0), 
-        inFunction(false), inLoop(false), hasReturned(false), shouldBreak(false), 
-        shouldContinue(false), inTryCatch(false) {
-        scopes.push_back(std::unordered_map<std::string, Value>());
-        scopes.reserve(16);
-        srand(time(nullptr));
+    // Replaces this interpreter's program and state with a snapshot. The
+    // file is mapped rather than read, and execution resumes right after
+    // the snapshot() call that produced it.
+    void restoreSnapshot(const std::string& path) {
+#ifdef CHOCO_HAS_MMAP
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) throw RuntimeError("Cannot open snapshot '" + path + "'", 0);
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0) {
+            close(fd);
+            throw RuntimeError("Cannot read snapshot '" + path + "'", 0);
+        }
+        size_t length = static_cast<size_t>(info.st_size);
+        void* mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) throw RuntimeError("Cannot map snapshot '" + path + "'", 0);
+        try {
+            loadSnapshot(SnapshotReader(static_cast<const char*>(mapped), length));
+        } catch (...) {
+            munmap(mapped, length);
+            throw;
+        }
+        munmap(mapped, length);
+#else
+        std::ifstream file(path, std::ios::binary);
+        if (!file) throw RuntimeError("Cannot open snapshot '" + path + "'", 0);
+        std::stringstream buffer;
+        buffer << file.rdbuf();
+        std::string bytes = buffer.str();
+        loadSnapshot(SnapshotReader(bytes.data(), bytes.size()));
+#endif
+    }
+
+    void loadSnapshot(SnapshotReader r) {
+        HeapAccountScope accountScope(heap.get());
+        char magic[sizeof(SNAPSHOT_MAGIC)];
+        r.raw(magic, sizeof(magic));
+        if (std::memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) != 0) {
+            throw RuntimeError("Not a Choco snapshot", 0);
+        }
+        if (r.u32() != SNAPSHOT_VERSION) {
+            throw RuntimeError("Snapshot was written by a different version of Choco", 0);
+        }
+
+        std::vector<TokenStream> streams(r.u32());
+        for (auto& stream : streams) {
+            std::vector<Token> toks(r.u32());
+            for (auto& tok : toks) {
+                tok.type = static_cast<TokenType>(r.u32());
+                tok.line = static_cast<int>(r.u32());
+                tok.value = r.str();
+            }
+            stream = TokenStream(std::move(toks));
+        }
+        if (streams.empty()) throw RuntimeError("Corrupt snapshot: no program", 0);
+        size_t resume = r.u64();
+
+        auto readFunctions = [&](std::unordered_map<std::string, Function>& table) {
+            for (uint32_t n = r.u32(); n > 0; n--) {
+                std::string name = r.str();
+                Function& func = table[name];
+                for (uint32_t p = r.u32(); p > 0; p--) func.params.push_back(r.str());
+                func.bodyStart = r.u64();
+                func.bodyEnd = r.u64();
+                func.isAsync = r.u8() != 0;
+                uint32_t stream = r.u32();
+                if (stream >= streams.size() || func.bodyEnd > streams[stream].size()) {
+                    throw RuntimeError("Corrupt snapshot: bad function '" + name + "'", 0);
+                }
+                func.code = streams[stream];
+                func.exprBody = returnsExpression(func.code, func.bodyStart, func.bodyEnd);
+            }
+        };
+
+        std::unordered_map<std::string, StructDef> defs;
+        for (uint32_t n = r.u32(); n > 0; n--) {
+            std::string name = r.str();
+            StructDef& def = defs[name];
+            for (uint32_t f = r.u32(); f > 0; f--) def.fields.push_back(r.str());
+            readFunctions(def.methods);
+        }
+
+        std::unordered_map<std::string, Function> funcs;
+        readFunctions(funcs);
+
+        std::unordered_map<std::string, Value> globals;
+        for (uint32_t n = r.u32(); n > 0; n--) {
+            std::string name = r.str();
+            globals[name] = r.value();
+        }
+
+        tokens = streams[0];
+        current = std::min(resume, tokens.size());
+        structDefs = std::move(defs);
+        functions = std::move(funcs);
+        callableEpoch++;
+        scopes.assign(1, std::move(globals));
+        captureLayers.assign(1, nullptr);
     }
 
     void execute() {
+        ScriptThreadScope scriptThread;
+        HeapAccountScope accountScope(heap.get());
         try {
-            while (!isAtEnd()) {
-                statement();
+            try {
+                while (!isAtEnd()) {
+                    statement();
+                }
+#ifdef CHOCO_HAS_EVENT_LOOP
+                drainEventLoop();
+#endif
+            } catch (const HeapLimitError&) {
+                throw heapLimitError();
             }
         } catch (const RuntimeError& e) {
-            std::cerr << "\n[Runtime Error] Line " << e.line << ": " << e.what() << std::endl;
+            *err << "\n[Runtime Error] Line " << e.line << ": " << e.what() << std::endl;
             throw;
         } catch (const ParseError& e) {
-            std::cerr << "\n[Parse Error] Line " << e.line << ": " << e.what() << std::endl;
+            *err << "\n[Parse Error] Line " << e.line << ": " << e.what() << std::endl;
             throw;
         }
     }
@@ -1171,23 +6031,52 @@ public:
         return builtinFunctions.find(name) != builtinFunctions.end();
     }
 
-    void setVariable(const std::string& name, const Value& val) {
+    // Resolves the storage slot for a variable, creating it in the innermost
+    // scope if it does not exist yet. Map nodes are stable across rehashing,
+    // so the pointer stays valid until the owning scope is popped.
+    // A captured variable is copied into its lambda's scope on first write,
+    // so the closure itself is never modified.
+    Value* variableSlot(const std::string& name) {
         for (int i = scopes.size() - 1; i >= 0; i--) {
-            if (scopes[i].find(name) != scopes[i].end()) {
-                scopes[i][name] = val;
-                return;
+            auto it = scopes[i].find(name);
+            if (it != scopes[i].end()) {
+                return &it->second;
+            }
+            if (const auto* captures = captureLayers[i]) {
+                auto captured = captures->find(name);
+                if (captured != captures->end()) {
+                    return &scopes[i].emplace(name, captured->second).first->second;
+                }
             }
         }
-        scopes.back()[name] = val;
+        return &scopes.back()[name];
     }
 
-    Value getVariable(const std::string& name) {
+    // The innermost visible binding of a local or captured variable, or null.
+    const Value* findVariable(const std::string& name) const {
         for (int i = scopes.size() - 1; i >= 0; i--) {
             auto it = scopes[i].find(name);
             if (it != scopes[i].end()) {
-                return it->second;
+                return &it->second;
+            }
+            if (const auto* captures = captureLayers[i]) {
+                auto captured = captures->find(name);
+                if (captured != captures->end()) {
+                    return &captured->second;
+                }
             }
         }
+        return nullptr;
+    }
+
+    void setVariable(const std::string& name, const Value& val) {
+        *variableSlot(name) = val;
+    }
+
+    Value getVariable(const std::string& name) {
+        if (const Value* local = findVariable(name)) {
+            return *local;
+        }
         auto it = globalVars.find(name);
         if (it != globalVars.end()) {
             return it->second;
@@ -1202,8 +6091,13 @@ public:
             letStatement();
         } else if (match(TOKEN_FN)) {
             functionDeclaration();
+        } else if (match(TOKEN_ASYNC)) {
+            expect(TOKEN_FN, "Expected 'fn' after 'async'");
+            functionDeclaration(true);
         } else if (match(TOKEN_STRUCT)) {
             structDeclaration();
+        } else if (match(TOKEN_IMPL)) {
+            implDeclaration();
         } else if (match(TOKEN_IMPORT)) {
             importStatement();
         } else if (match(TOKEN_TRY)) {
@@ -1240,15 +6134,153 @@ public:
         } else if (peek().type == TOKEN_IDENTIFIER && current + 1 < tokens.size() && tokens[current + 1].type == TOKEN_EQUAL) {
             Token name = advance();
             match(TOKEN_EQUAL);
-            Value val = expression();
-            setVariable(name.value, val);
-            expect(TOKEN_SEMICOLON, "Expected ';' after assignment");
+            if (!appendAssignment(name)) {
+                Value val = expression();
+                setVariable(name.value, val);
+                expect(TOKEN_SEMICOLON, "Expected ';' after assignment");
+            }
+        } else if (indexAssignmentAt(current)) {
+            indexAssignment();
         } else {
             expression();
             expect(TOKEN_SEMICOLON, "Expected ';' after expression");
         }
     }
 
+    // `name = name + a + b;` on a string variable extends it in place rather
+    // than copying it out, adding to the copy and storing that back, so a
+    // loop that accumulates text stays linear. Taken once the `+` has seen
+    // strings, and only when nothing on the right can run script code that
+    // might reassign the variable before it is extended.
+    bool appendAssignment(const Token& name) {
+        if (current + 1 >= tokens.size() || tokens[current].type != TOKEN_IDENTIFIER ||
+            tokens[current + 1].type != TOKEN_PLUS || tokens.feedback(current + 1) != OPERANDS_STRINGS ||
+            tokens[current].value != name.value || isCallableAt(current)) {
+            return false;
+        }
+        const Value* var = findVariable(name.value);
+        if (!var || var->type != Value::STRING || !runsNoScriptCode(current + 2)) return false;
+        current++;
+        std::string tail;
+        while (match(TOKEN_PLUS)) {
+            size_t site = current - 1;
+            Value piece = factor();
+            tokens.recordOperands(site, piece.type == Value::STRING ? OPERANDS_STRINGS : OPERANDS_MIXED);
+            if (piece.type != Value::STRING) {
+                throw RuntimeError("Cannot add string and " + piece.getType(), tokens[current - 1].line);
+            }
+            tail += piece.str;
+        }
+        expect(TOKEN_SEMICOLON, "Expected ';' after assignment");
+        variableSlot(name.value)->str += tail;
+        return true;
+    }
+
+    // Whether the operands from i to the end of the statement are joined by
+    // `+` alone and call nothing but builtins that never call back into the
+    // script.
+    bool runsNoScriptCode(size_t i) const {
+        static const std::unordered_set<std::string> pure = {
+            "str", "len", "int", "float", "round", "floor", "ceil", "abs",
+            "uppercase", "lowercase", "substr", "join", "typeof", "build"
+        };
+        int depth = 0;
+        for (; i < tokens.size(); i++) {
+            const Token& token = tokens[i];
+            switch (token.type) {
+                case TOKEN_SEMICOLON:
+                    return depth == 0;
+                case TOKEN_LPAREN:
+                    if (tokens[i - 1].type == TOKEN_IDENTIFIER) {
+                        if (tokens[i - 2].type == TOKEN_DOT || !pure.count(tokens[i - 1].value) ||
+                            functions.count(tokens[i - 1].value)) {
+                            return false;
+                        }
+                    } else if (tokens[i - 1].type == TOKEN_RPAREN || tokens[i - 1].type == TOKEN_RBRACKET) {
+                        return false;
+                    }
+                    depth++;
+                    break;
+                case TOKEN_LBRACKET:
+                    depth++;
+                    break;
+                case TOKEN_RPAREN: case TOKEN_RBRACKET:
+                    if (--depth < 0) return false;
+                    break;
+                case TOKEN_STRING: case TOKEN_NUMBER: case TOKEN_IDENTIFIER: case TOKEN_DOT:
+                case TOKEN_COMMA: case TOKEN_TRUE: case TOKEN_FALSE: case TOKEN_PLUS:
+                case TOKEN_STAR: case TOKEN_SLASH: case TOKEN_PERCENT:
+                    break;
+                default:
+                    if (depth == 0 || binaryPrecedence(token.type) == 0) return false;
+            }
+        }
+        return false;
+    }
+
+    // Whether `name[...] =` starts at i.
+    bool indexAssignmentAt(size_t i) const {
+        if (tokens[i].type != TOKEN_IDENTIFIER || i + 1 >= tokens.size() ||
+            tokens[i + 1].type != TOKEN_LBRACKET) {
+            return false;
+        }
+        int depth = 0;
+        for (i++; i < tokens.size(); i++) {
+            TokenType type = tokens[i].type;
+            if (type == TOKEN_LBRACKET) depth++;
+            else if (type == TOKEN_RBRACKET && --depth == 0) break;
+            else if (type == TOKEN_SEMICOLON) return false;
+        }
+        return i + 1 < tokens.size() && tokens[i + 1].type == TOKEN_EQUAL;
+    }
+
+    // `name[index] = value;` writes an array element or map entry in
+    // place; a map or floats shared with other values is copied first.
+    void indexAssignment() {
+        Token name = advance();
+        advance();
+        int bracketLine = name.line;
+        Value index = expression();
+        expect(TOKEN_RBRACKET, "Expected ']' after index");
+        expect(TOKEN_EQUAL, "Expected '=' after index");
+        Value val = expression();
+        expect(TOKEN_SEMICOLON, "Expected ';' after assignment");
+
+        if (!findVariable(name.value)) {
+            throw RuntimeError("Undefined variable '" + name.value + "'", bracketLine);
+        }
+        Value* target = variableSlot(name.value);
+        if (target->type == Value::MAP) {
+            if (index.type != Value::STRING) {
+                throw RuntimeError("Map key must be a string, got " + index.getType(), bracketLine);
+            }
+            ownMap(*target).insert(index.str) = std::move(val);
+        } else if (target->type == Value::ARRAY) {
+            if (index.type != Value::NUMBER) {
+                throw RuntimeError("Array index must be a number, got " + index.getType(), bracketLine);
+            }
+            int64_t idx = truncateInteger(index);
+            if (idx < 0 || idx >= static_cast<int64_t>(target->array.size())) {
+                throw RuntimeError("Array index " + std::to_string(idx) + " out of bounds (size: " + std::to_string(target->array.size()) + ")", bracketLine);
+            }
+            target->array[idx] = std::move(val);
+        } else if (target->type == Value::FLOATS) {
+            if (index.type != Value::NUMBER) {
+                throw RuntimeError("Array index must be a number, got " + index.getType(), bracketLine);
+            }
+            if (val.type != Value::NUMBER) {
+                throw RuntimeError("Cannot store " + val.getType() + " in floats", bracketLine);
+            }
+            int64_t idx = truncateInteger(index);
+            if (idx < 0 || idx >= static_cast<int64_t>(target->floats->size())) {
+                throw RuntimeError("Array index " + std::to_string(idx) + " out of bounds (size: " + std::to_string(target->floats->size()) + ")", bracketLine);
+            }
+            ownFloats(*target)[idx] = val.num;
+        } else {
+            throw RuntimeError("Cannot assign to an index of " + target->getType(), bracketLine);
+        }
+    }
+
     void letStatement() {
         if (peek().type != TOKEN_IDENTIFIER) {
             throw ParseError("Expected variable name after 'let'", peek().line);
@@ -1260,11 +6292,19 @@ public:
         expect(TOKEN_SEMICOLON, "Expected ';' after variable declaration");
     }
 
-    void functionDeclaration() {
+    void functionDeclaration(bool isAsync = false) {
         if (peek().type != TOKEN_IDENTIFIER) {
             throw ParseError("Expected function name after 'fn'", peek().line);
         }
         Token name = advance();
+        functions[name.value] = functionDefinition(name, isAsync);
+        callableEpoch++;
+        
+        setVariable(name.value, Value(name.value));
+    }
+
+    // Parses a parameter list and body, leaving current after the body.
+    Function functionDefinition(const Token& name, bool isAsync) {
         expect(TOKEN_LPAREN, "Expected '(' after function name");
         
         std::vector<std::string> params;
@@ -1295,9 +6335,9 @@ public:
         }
         
         size_t bodyEnd = current - 1;
-        functions[name.value] = {std::move(params), bodyStart, bodyEnd};
-        
-        setVariable(name.value, Value(name.value));
+        Function func = {std::move(params), bodyStart, bodyEnd, isAsync, tokens};
+        func.exprBody = returnsExpression(tokens, bodyStart, bodyEnd);
+        return func;
     }
 
     void structDeclaration() {
@@ -1320,7 +6360,31 @@ public:
             }
         }
         
-        structDefs[name.value] = {std::move(fields)};
+        structDefs[name.value].fields = std::move(fields);
+    }
+
+    // impl Name { fn method(self, ...) { ... } ... }: methods are called as
+    // value.method(...), with the struct value as the first argument.
+    void implDeclaration() {
+        if (peek().type != TOKEN_IDENTIFIER) {
+            throw ParseError("Expected struct name after 'impl'", peek().line);
+        }
+        Token name = advance();
+        auto def = structDefs.find(name.value);
+        if (def == structDefs.end()) {
+            throw RuntimeError("Cannot implement undefined struct '" + name.value + "'", name.line);
+        }
+        expect(TOKEN_LBRACE, "Expected '{' after struct name in impl");
+        while (!match(TOKEN_RBRACE)) {
+            bool isAsync = match(TOKEN_ASYNC);
+            expect(TOKEN_FN, "Expected method definition in impl block");
+            if (peek().type != TOKEN_IDENTIFIER) {
+                throw ParseError("Expected method name after 'fn'", peek().line);
+            }
+            Token method = advance();
+            def->second.methods[method.value] = functionDefinition(method, isAsync);
+        }
+        callableEpoch++;
     }
 
     void importStatement() {
@@ -1342,19 +6406,19 @@ public:
 
         try {
             Lexer lexer(source);
-            std::vector<Token> moduleTokens = lexer.tokenize();
+            std::vector<Token> moduleTokens = optimizeTokens(lexer.tokenize());
             
             size_t savedCurrent = current;
-            std::vector<Token> savedTokens = std::move(tokens);
+            TokenStream savedTokens = tokens;
             
-            tokens = std::move(moduleTokens);
+            tokens = TokenStream(std::move(moduleTokens));
             current = 0;
             
             while (!isAtEnd()) {
                 statement();
             }
             
-            tokens = std::move(savedTokens);
+            tokens = savedTokens;
             current = savedCurrent;
         } catch (...) {
             throw RuntimeError("Error while importing module '" + module.value + "'", module.line);
@@ -1402,7 +6466,7 @@ public:
         inTryCatch = false;
         
         if (!currentException.empty()) {
-            scopes.push_back(std::unordered_map<std::string, Value>());
+            pushScope();
             setVariable(errorVar.value, Value(currentException));
             current = catchStart;
             
@@ -1410,7 +6474,7 @@ public:
                 statement();
             }
             
-            scopes.pop_back();
+            popScope();
             currentException.clear();
         }
         
@@ -1424,7 +6488,7 @@ public:
         if (inTryCatch) {
             currentException = msg.toString();
         } else {
-            throw RuntimeError("Uncaught exception: " + msg.toString(), tokens[current - 2].line);
+            throw ThrownError(msg.toString(), tokens[current - 2].line);
         }
     }
 
@@ -1489,7 +6553,7 @@ public:
             
             bool isMatch = false;
             if (matchValue.type == caseValue.type) {
-                if (matchValue.type == Value::NUMBER) isMatch = matchValue.num == caseValue.num;
+                if (matchValue.type == Value::NUMBER) isMatch = orderNumbers(matchValue, caseValue) == 0;
                 else if (matchValue.type == Value::STRING) isMatch = matchValue.str == caseValue.str;
                 else if (matchValue.type == Value::BOOL) isMatch = matchValue.boolean == caseValue.boolean;
             }
@@ -1524,7 +6588,8 @@ public:
 
     void printStatement() {
         Value val = expression();
-        std::cout << val.toString() << std::endl;
+        // One write per line, so prints from interpreters sharing a stream don't interleave.
+        *out << (val.toString() + "\n") << std::flush;
         expect(TOKEN_SEMICOLON, "Expected ';' after print statement");
     }
 
@@ -1603,8 +6668,11 @@ public:
         
         bool wasInLoop = inLoop;
         inLoop = true;
+        uint32_t iterations = 0;
+        uint32_t kernelThreshold = eagerKernels ? 1 : KERNEL_LOOP_THRESHOLD;
         
         while (condition.type == Value::BOOL && condition.boolean && !hasReturned) {
+            charge(1);
             current = bodyStart;
             shouldBreak = false;
             shouldContinue = false;
@@ -1623,6 +6691,10 @@ public:
             }
             
             current = conditionStart;
+            if (++iterations == kernelThreshold && tier != TIER_INTERPRET && !limited &&
+                runLoopKernel(conditionStart)) {
+                break;
+            }
             condition = expression();
             expect(TOKEN_LBRACE, "Expected '{' after while condition");
         }
@@ -1639,14 +6711,19 @@ public:
         expect(TOKEN_IN, "Expected 'in' after iterator variable");
         
         Value start = expression();
-        expect(TOKEN_DOTDOT, "Expected '..' in for loop range");
-        Value end = expression();
-        
-        if (start.type != Value::NUMBER || end.type != Value::NUMBER) {
-            throw RuntimeError("For loop range must be numbers", iterVar.line);
+        bool isRange = match(TOKEN_DOTDOT);
+        Value end;
+        if (isRange) {
+            end = expression();
+            if (start.type != Value::NUMBER || end.type != Value::NUMBER) {
+                throw RuntimeError("For loop range must be numbers", iterVar.line);
+            }
+        } else if (start.type != Value::ARRAY && start.type != Value::STRING && start.type != Value::ITERATOR &&
+                   start.type != Value::CHANNEL && start.type != Value::MAP && start.type != Value::FLOATS) {
+            throw RuntimeError("For loop expects a range, array, string, map, iterator or channel, got " + start.getType(), iterVar.line);
         }
         
-        expect(TOKEN_LBRACE, "Expected '{' after for range");
+        expect(TOKEN_LBRACE, isRange ? "Expected '{' after for range" : "Expected '{' after for iterable");
         size_t loopBodyStart = current;
         
         int depth = 1;
@@ -1658,40 +6735,149 @@ public:
             if (depth > 0) loopBodyEnd++;
         }
         
-        int iStart = static_cast<int>(start.num);
-        int iEnd = static_cast<int>(end.num);
-        
         bool wasInLoop = inLoop;
         inLoop = true;
-        
-        for (int i = iStart; i < iEnd; i++) {
-            if (hasReturned || shouldBreak) break;
-            
-            setVariable(iterVar.value, Value(static_cast<double>(i)));
-            
-            size_t savedCurrent = current;
-            current = loopBodyStart;
-            shouldContinue = false;
-            
-            while (current < loopBodyEnd) {
-                if (hasReturned || isAtEnd() || shouldBreak) break;
-                statement();
-                if (shouldContinue) {
-                    shouldContinue = false;
-                    break;
+
+        if (isRange) {
+            forRange(iterVar.value, truncateInteger(start), truncateInteger(end), loopBodyStart, loopBodyEnd);
+        } else {
+            forEach(iterVar.value, start, loopBodyStart, loopBodyEnd);
+        }
+
+        inLoop = wasInLoop;
+        current = loopBodyEnd + 1;
+    }
+
+    // Counted loop: the induction variable is resolved to its slot once
+    // and updated in place instead of going through setVariable(). Once hot,
+    // a body that only touches numeric and bool variables runs the remaining
+    // iterations as a kernel, with every variable held in a register.
+    void forRange(const std::string& var, int64_t iStart, int64_t iEnd, size_t bodyStart, size_t bodyEnd) {
+        Value* slot = variableSlot(var);
+        const auto* scopesBase = scopes.data();
+        uint32_t iterations = 0;
+        uint32_t kernelThreshold = eagerKernels ? 1 : KERNEL_LOOP_THRESHOLD;
+
+        for (int64_t i = iStart; i < iEnd; i++) {
+            if (scopes.data() != scopesBase) {
+                slot = variableSlot(var);
+                scopesBase = scopes.data();
+            }
+            if (slot->type == Value::NUMBER && !slot->wide && i <= Value::WIDE_THRESHOLD && i >= -Value::WIDE_THRESHOLD) {
+                slot->num = static_cast<double>(i);
+            } else {
+                *slot = Value(i);
+            }
+
+            if (!runLoopBody(bodyStart, bodyEnd)) break;
+            if (++iterations == kernelThreshold && i + 1 < iEnd && tier != TIER_INTERPRET && !limited &&
+                runRangeKernel(var, i + 1, iEnd, bodyStart, bodyEnd)) {
+                break;
+            }
+        }
+    }
+
+    // The iterable is evaluated once; elements are moved out of that
+    // private copy into the loop variable, so no per-element copies are made.
+    void forEach(const std::string& var, Value& iterable, size_t bodyStart, size_t bodyEnd) {
+        Value* slot = variableSlot(var);
+        const auto* scopesBase = scopes.data();
+
+        if (iterable.type == Value::ITERATOR) {
+            drainIterator(*iterable.iterator, [&](Value& item) {
+                if (scopes.data() != scopesBase) {
+                    slot = variableSlot(var);
+                    scopesBase = scopes.data();
                 }
+                *slot = std::move(item);
+                return runLoopBody(bodyStart, bodyEnd);
+            });
+            return;
+        }
+
+        if (iterable.type == Value::CHANNEL) {
+            Value item;
+            while (channelRecv(*iterable.channel, item, peek().line)) {
+                if (scopes.data() != scopesBase) {
+                    slot = variableSlot(var);
+                    scopesBase = scopes.data();
+                }
+                *slot = std::move(item);
+                if (!runLoopBody(bodyStart, bodyEnd)) break;
             }
-            
-            if (shouldBreak) {
-                shouldBreak = false;
+            return;
+        }
+
+        // Keys in insertion order. The loop holds its own reference to the
+        // table, so writes to the map in the body go to a copy.
+        if (iterable.type == Value::MAP) {
+            for (const auto& entry : iterable.map->entries) {
+                if (!entry.live) continue;
+                if (scopes.data() != scopesBase) {
+                    slot = variableSlot(var);
+                    scopesBase = scopes.data();
+                }
+                *slot = Value(entry.key);
+                if (!runLoopBody(bodyStart, bodyEnd)) break;
+            }
+            return;
+        }
+
+        if (iterable.type == Value::FLOATS) {
+            const std::vector<double>& items = *iterable.floats;
+            for (double item : items) {
+                if (scopes.data() != scopesBase) {
+                    slot = variableSlot(var);
+                    scopesBase = scopes.data();
+                }
+                if (slot->type == Value::NUMBER && !slot->wide) slot->num = item;
+                else *slot = Value(item);
+                if (!runLoopBody(bodyStart, bodyEnd)) break;
+            }
+            return;
+        }
+
+        size_t count = iterable.type == Value::ARRAY ? iterable.array.size() : iterable.str.length();
+
+        for (size_t i = 0; i < count; i++) {
+            if (scopes.data() != scopesBase) {
+                slot = variableSlot(var);
+                scopesBase = scopes.data();
+            }
+            if (iterable.type == Value::ARRAY) {
+                *slot = std::move(iterable.array[i]);
+            } else if (slot->type == Value::STRING) {
+                slot->str.assign(1, iterable.str[i]);
+            } else {
+                *slot = Value(std::string(1, iterable.str[i]));
+            }
+
+            if (!runLoopBody(bodyStart, bodyEnd)) break;
+        }
+    }
+
+    // Runs one loop iteration; returns false when the loop should stop.
+    bool runLoopBody(size_t bodyStart, size_t bodyEnd) {
+        if (hasReturned) return false;
+        charge(1);
+
+        current = bodyStart;
+        shouldContinue = false;
+        
+        while (current < bodyEnd) {
+            if (hasReturned || isAtEnd() || shouldBreak) break;
+            statement();
+            if (shouldContinue) {
+                shouldContinue = false;
                 break;
             }
-            
-            current = savedCurrent;
         }
         
-        inLoop = wasInLoop;
-        current = loopBodyEnd + 1;
+        if (shouldBreak) {
+            shouldBreak = false;
+            return false;
+        }
+        return !hasReturned;
     }
 
     Value expression() {
@@ -1736,23 +6922,160 @@ public:
         return left;
     }
 
+    // Binary operators record the operand types they see (see
+    // OperandFeedback). At a site that has only seen numbers, an operand
+    // that is a number literal, variable or field/element path is read
+    // directly instead of descending through unary()/call()/primary(); any
+    // other operand, or a change of types, takes the generic path and marks
+    // the site mixed.
+
+    static OperandFeedback operandKinds(const Value& left, const Value& right) {
+        if (left.type != right.type) return OPERANDS_MIXED;
+        switch (left.type) {
+            case Value::NUMBER: return OPERANDS_NUMBERS;
+            case Value::STRING: return OPERANDS_STRINGS;
+            case Value::BOOL: return OPERANDS_BOOLS;
+            default: return OPERANDS_MIXED;
+        }
+    }
+
+    // 7 for * / %, 6 for + -, 5 for shifts, 4 for &, 3 for ^, 2 for |,
+    // 1 for comparisons, 0 for anything else.
+    static int binaryPrecedence(TokenType type) {
+        switch (type) {
+            case TOKEN_STAR: case TOKEN_SLASH: case TOKEN_PERCENT: return 7;
+            case TOKEN_PLUS: case TOKEN_MINUS: return 6;
+            case TOKEN_LESS_LESS: case TOKEN_GREATER_GREATER: return 5;
+            case TOKEN_AMPERSAND: return 4;
+            case TOKEN_CARET: return 3;
+            case TOKEN_PIPE: return 2;
+            case TOKEN_EQUAL_EQUAL: case TOKEN_BANG_EQUAL: case TOKEN_LESS:
+            case TOKEN_GREATER: case TOKEN_LESS_EQUAL: case TOKEN_GREATER_EQUAL: return 1;
+            default: return 0;
+        }
+    }
+
+    // Whether the token at i ends the operand of a `level` operator.
+    bool endsOperand(size_t i, int level) const {
+        if (i >= tokens.size()) return false;
+        TokenType next = tokens[i].type;
+        int precedence = binaryPrecedence(next);
+        if (precedence > 0) return precedence <= level;
+        return next == TOKEN_SEMICOLON || next == TOKEN_RPAREN || next == TOKEN_COMMA ||
+               next == TOKEN_RBRACKET || next == TOKEN_AND || next == TOKEN_OR;
+    }
+
+    // The token after a `name.field` / `name[i]` path starting at i, going
+    // by syntax alone (see borrowPath for which steps it can take).
+    size_t pathEnd(size_t i) const {
+        i++;
+        while (i + 2 < tokens.size()) {
+            if (tokens[i].type == TOKEN_DOT && tokens[i + 1].type == TOKEN_IDENTIFIER) {
+                i += 2;
+            } else if (tokens[i].type == TOKEN_LBRACKET && tokens[i + 2].type == TOKEN_RBRACKET &&
+                       (tokens[i + 1].type == TOKEN_NUMBER || tokens[i + 1].type == TOKEN_IDENTIFIER ||
+                        tokens[i + 1].type == TOKEN_STRING)) {
+                i += 3;
+            } else {
+                break;
+            }
+        }
+        return i;
+    }
+
+    // Reads a number literal, or a number held in a variable or at the end
+    // of a `name.field` / `name[i]` path, when what follows ends the operand
+    // of a `level` operator. Consumes nothing and returns false otherwise.
+    bool numericOperand(int level, double& out) {
+        const Token& operand = tokens[current];
+        if (operand.type == TOKEN_NUMBER) {
+            if (!endsOperand(current + 1, level) || !(std::fabs(tokens.number(current)) < EXACT_INTEGER_LIMIT)) {
+                return false;
+            }
+            out = tokens.number(current);
+            current++;
+            return true;
+        }
+        if (operand.type != TOKEN_IDENTIFIER || current + 1 >= tokens.size()) return false;
+        TokenType next = tokens[current + 1].type;
+        if (next == TOKEN_DOT || next == TOKEN_LBRACKET) {
+            size_t start = current;
+            const Value* node = borrowPath();
+            if (!node || node->type != Value::NUMBER || node->wide || !endsOperand(current, level)) {
+                current = start;
+                return false;
+            }
+            out = node->num;
+            return true;
+        }
+        if (!endsOperand(current + 1, level)) return false;
+        const Value* var = findVariable(operand.value);
+        if (!var) {
+            auto it = globalVars.find(operand.value);
+            if (it == globalVars.end()) return false;
+            var = &it->second;
+        }
+        if (var->type != Value::NUMBER || var->wide || isCallableAt(current)) return false;
+        out = var->num;
+        current++;
+        return true;
+    }
+
+    // The left operand of a `level` operator site that has only seen numbers.
+    bool numericLeadingOperand(int level, double& out) {
+        TokenType type = peek().type;
+        size_t end;
+        if (type == TOKEN_NUMBER) end = current + 1;
+        else if (type == TOKEN_IDENTIFIER) end = pathEnd(current);
+        else return false;
+        if (end >= tokens.size() || binaryPrecedence(tokens[end].type) != level) return false;
+        return tokens.feedback(end) == OPERANDS_NUMBERS && numericOperand(level, out);
+    }
+
+    static bool compareNumbers(TokenType op, double left, double right) {
+        switch (op) {
+            case TOKEN_EQUAL_EQUAL: return left == right;
+            case TOKEN_BANG_EQUAL: return left != right;
+            case TOKEN_LESS: return left < right;
+            case TOKEN_GREATER: return left > right;
+            case TOKEN_LESS_EQUAL: return left <= right;
+            case TOKEN_GREATER_EQUAL: return left >= right;
+            default: return false;
+        }
+    }
+
+    static double multiplyNumbers(TokenType op, double left, double right, int opLine) {
+        if (op == TOKEN_STAR) return left * right;
+        if (right == 0) {
+            throw RuntimeError(op == TOKEN_SLASH ? "Division by zero" : "Modulo by zero", opLine);
+        }
+        return op == TOKEN_SLASH ? left / right : fmod(left, right);
+    }
+
     Value comparison() {
-        Value left = term();
+        double leading;
+        Value left = numericLeadingOperand(1, leading) ? Value(leading) : bitOr();
         
-        while (peek().type == TOKEN_EQUAL_EQUAL || peek().type == TOKEN_BANG_EQUAL ||
-               peek().type == TOKEN_LESS || peek().type == TOKEN_GREATER ||
-               peek().type == TOKEN_LESS_EQUAL || peek().type == TOKEN_GREATER_EQUAL) {
-            TokenType op = advance().type;
-            Value right = term();
+        while (binaryPrecedence(peek().type) == 1) {
+            size_t site = current++;
+            TokenType op = tokens[site].type;
+            double rightNum;
+            if (left.type == Value::NUMBER && !left.wide && tokens.feedback(site) == OPERANDS_NUMBERS &&
+                numericOperand(1, rightNum)) {
+                left.boolean = compareNumbers(op, left.num, rightNum);
+                left.type = Value::BOOL;
+                left.num = 0;
+                continue;
+            }
+            Value right = bitOr();
+            tokens.recordOperands(site, operandKinds(left, right));
             
             bool result = false;
-            if (left.type == Value::NUMBER && right.type == Value::NUMBER) {
-                if (op == TOKEN_EQUAL_EQUAL) result = left.num == right.num;
-                else if (op == TOKEN_BANG_EQUAL) result = left.num != right.num;
-                else if (op == TOKEN_LESS) result = left.num < right.num;
-                else if (op == TOKEN_GREATER) result = left.num > right.num;
-                else if (op == TOKEN_LESS_EQUAL) result = left.num <= right.num;
-                else if (op == TOKEN_GREATER_EQUAL) result = left.num >= right.num;
+            if (left.type == Value::NUMBER && right.type == Value::NUMBER && (left.wide || right.wide)) {
+                int order = orderNumbers(left, right);
+                result = order != 2 && compareNumbers(op, order, 0);
+            } else if (left.type == Value::NUMBER && right.type == Value::NUMBER) {
+                result = compareNumbers(op, left.num, right.num);
             } else if (left.type == Value::BOOL && right.type == Value::BOOL) {
                 if (op == TOKEN_EQUAL_EQUAL) result = left.boolean == right.boolean;
                 else if (op == TOKEN_BANG_EQUAL) result = left.boolean != right.boolean;
@@ -1765,16 +7088,60 @@ public:
         return left;
     }
 
+    // | ^ & << >> work on integers as 64-bit two's complement. From loosest
+    // to tightest: comparisons, |, ^, &, << >>, then + -. Unlike C they bind
+    // tighter than comparisons, so `a & 1 == 1` is `(a & 1) == 1`. One
+    // precedence-climbing loop serves all four levels, so an expression
+    // without them costs a single peek here.
+    Value bitOr() { return bitwiseOperators(term(), 2); }
+
+    Value bitwiseOperators(Value left, int minLevel) {
+        for (;;) {
+            int level = binaryPrecedence(peek().type);
+            if (level < minLevel || level > 5) return left;
+            const Token& opToken = tokens[current++];
+            Value right = term();
+            int next = binaryPrecedence(peek().type);
+            if (next > level && next <= 5) right = bitwiseOperators(std::move(right), level + 1);
+            int64_t a, b, result;
+            if (left.type != Value::NUMBER || right.type != Value::NUMBER) {
+                throw RuntimeError("Bitwise '" + opToken.value + "' needs numbers, got " + left.getType() +
+                                   " and " + right.getType(), opToken.line);
+            }
+            if (!exactInteger(left, a) || !exactInteger(right, b)) {
+                throw RuntimeError("Bitwise '" + opToken.value + "' needs integers, got " + left.toString() +
+                                   " and " + right.toString(), opToken.line);
+            }
+            if (!bitwise(opToken.type, a, b, result)) {
+                throw RuntimeError("Shift count must be between 0 and 63, got " + right.toString(), opToken.line);
+            }
+            left = Value(result);
+        }
+    }
+
     Value term() {
-        Value left = factor();
+        double leading;
+        Value left = numericLeadingOperand(6, leading) ? Value(leading) : factor();
         
         while (match(TOKEN_PLUS) || match(TOKEN_MINUS)) {
-            TokenType op = tokens[current - 1].type;
+            size_t site = current - 1;
+            TokenType op = tokens[site].type;
+            double rightNum;
+            if (left.type == Value::NUMBER && !left.wide && tokens.feedback(site) == OPERANDS_NUMBERS &&
+                numericOperand(6, rightNum)) {
+                double sum = op == TOKEN_PLUS ? left.num + rightNum : left.num - rightNum;
+                if (std::fabs(sum) < EXACT_INTEGER_LIMIT) {
+                    left.num = sum;
+                } else {
+                    left = addOrMultiply(op, left, Value(rightNum), tokens[site].line);
+                }
+                continue;
+            }
             Value right = factor();
+            tokens.recordOperands(site, operandKinds(left, right));
             
             if (left.type == Value::NUMBER && right.type == Value::NUMBER) {
-                if (op == TOKEN_PLUS) left.num += right.num;
-                else left.num -= right.num;
+                left = addOrMultiply(op, left, right, tokens[site].line);
             } else if (left.type == Value::STRING && right.type == Value::STRING && op == TOKEN_PLUS) {
                 left.str += right.str;
             } else if (op == TOKEN_PLUS) {
@@ -1787,26 +7154,36 @@ public:
     }
 
     Value factor() {
-        Value left = unary();
+        double leading;
+        Value left = numericLeadingOperand(7, leading) ? Value(leading) : unary();
         
         while (match(TOKEN_STAR) || match(TOKEN_SLASH) || match(TOKEN_PERCENT)) {
-            TokenType op = tokens[current - 1].type;
-            int opLine = tokens[current - 1].line;
+            size_t site = current - 1;
+            TokenType op = tokens[site].type;
+            int opLine = tokens[site].line;
+            double rightNum;
+            if (left.type == Value::NUMBER && !left.wide && tokens.feedback(site) == OPERANDS_NUMBERS &&
+                numericOperand(7, rightNum)) {
+                double product = multiplyNumbers(op, left.num, rightNum, opLine);
+                if (op != TOKEN_STAR || std::fabs(product) < EXACT_INTEGER_LIMIT) {
+                    left.num = product;
+                } else {
+                    left = addOrMultiply(op, left, Value(rightNum), opLine);
+                }
+                continue;
+            }
             Value right = unary();
+            tokens.recordOperands(site, operandKinds(left, right));
             
             if (left.type == Value::NUMBER && right.type == Value::NUMBER) {
                 if (op == TOKEN_STAR) {
-                    left.num *= right.num;
-                } else if (op == TOKEN_SLASH) {
-                    if (right.num == 0) {
-                        throw RuntimeError("Division by zero", opLine);
-                    }
-                    left.num /= right.num;
-                } else if (op == TOKEN_PERCENT) {
-                    if (right.num == 0) {
-                        throw RuntimeError("Modulo by zero", opLine);
-                    }
-                    left.num = fmod(left.num, right.num);
+                    left = addOrMultiply(op, left, right, opLine);
+                } else if (op == TOKEN_PERCENT && (left.wide || right.wide) && right.num != 0) {
+                    left = moduloNumbers(left, right);
+                } else if (op == TOKEN_SLASH && (left.wide || right.wide) && right.num != 0) {
+                    left = divideNumbers(left, right);
+                } else {
+                    left = Value(multiplyNumbers(op, left.num, right.num, opLine));
                 }
             } else {
                 std::string opStr = (op == TOKEN_STAR) ? "multiply" : (op == TOKEN_SLASH) ? "divide" : "modulo";
@@ -1817,6 +7194,11 @@ public:
     }
 
     Value unary() {
+        if (match(TOKEN_AWAIT)) {
+            int awaitLine = tokens[current - 1].line;
+            Value awaited = unary();
+            return awaitValue(awaited, awaitLine);
+        }
         if (match(TOKEN_BANG)) {
             Value val = unary();
             if (val.type == Value::BOOL) {
@@ -1828,31 +7210,241 @@ public:
             int opLine = tokens[current - 1].line;
             Value val = unary();
             if (val.type == Value::NUMBER) {
-                val.num = -val.num;
-                return val;
+                return negateNumber(val);
             }
             throw RuntimeError("Cannot negate " + val.getType(), opLine);
         }
+        if (match(TOKEN_TILDE)) {
+            int opLine = tokens[current - 1].line;
+            Value val = unary();
+            int64_t bits;
+            if (val.type != Value::NUMBER || !exactInteger(val, bits)) {
+                throw RuntimeError("Bitwise '~' needs an integer, got " + val.toString(), opLine);
+            }
+            return Value(~bits);
+        }
         return call();
     }
 
+    // Lexed code runs through TokenOptimizer first. Constant propagation
+    // is off where globals can change behind the program's back (the REPL,
+    // embedding hosts).
+    static std::vector<Token> optimizeTokens(std::vector<Token> toks, bool propagateLets = true) {
+        return TokenOptimizer(std::move(toks), propagateLets, [](const std::string& name) {
+            return builtinFunctions.find(name) != builtinFunctions.end();
+        }).run();
+    }
+
+    // A name that evaluates to itself (as a function reference) rather
+    // than to a variable.
+    bool isCallableName(const std::string& name) const {
+        return functions.find(name) != functions.end() || isBuiltinFunction(name) ||
+               hostFunctions.find(name) != hostFunctions.end();
+    }
+
+    SiteCache& siteCache(size_t index) {
+        if (siteCaches.empty()) siteCaches.resize(SITE_CACHE_SIZE);
+        uint64_t stream = tokens.id();
+        SiteCache& entry = siteCaches[(index + stream * 0x9E3779B1u) & (SITE_CACHE_SIZE - 1)];
+        if (entry.stream != stream || entry.index != index) {
+            entry = SiteCache();
+            entry.stream = stream;
+            entry.index = index;
+        }
+        return entry;
+    }
+
+    // The identifier token at `index`, resolved through its site cache.
+    const SiteCache& nameSite(size_t index) {
+        SiteCache& entry = siteCache(index);
+        if (entry.epoch != callableEpoch) {
+            const std::string& name = tokens[index].value;
+            entry.epoch = callableEpoch;
+            entry.callable = isCallableName(name);
+            entry.function = nullptr;
+            if (entry.callable && !isBuiltinFunction(name) && hostFunctions.find(name) == hostFunctions.end()) {
+                entry.function = &functions.find(name)->second;
+            }
+        }
+        return entry;
+    }
+
+    bool isCallableAt(size_t index) { return nameSite(index).callable; }
+
+    // Finds the field named by the token at `index` in a struct value.
+    // Small structs are scanned directly, which beats hashing the name.
+    const Value* structField(const Value& value, size_t index) {
+        const auto& fields = value.structFields;
+        const std::string& name = tokens[index].value;
+        if (fields.size() <= SMALL_STRUCT_FIELDS) {
+            for (const auto& field : fields) {
+                if (field.first == name) return &field.second;
+            }
+            return nullptr;
+        }
+        SiteCache& entry = siteCache(index);
+        size_t count = fields.bucket_count();
+        size_t bucket;
+        if (entry.bucketCounts[0] == count) {
+            bucket = entry.buckets[0];
+        } else if (entry.bucketCounts[1] == count) {
+            bucket = entry.buckets[1];
+        } else {
+            bucket = fields.bucket(name);
+            entry.bucketCounts[1] = entry.bucketCounts[0];
+            entry.buckets[1] = entry.buckets[0];
+            entry.bucketCounts[0] = count;
+            entry.buckets[0] = bucket;
+        }
+        for (auto it = fields.begin(bucket); it != fields.end(bucket); ++it) {
+            if (it->first == name) return &it->second;
+        }
+        return nullptr;
+    }
+
+    // The method named by the token at `index` for a struct value, or null.
+    // Each call site remembers the struct type it last dispatched on.
+    const Function* structMethod(const Value& value, size_t index) {
+        SiteCache& entry = siteCache(index);
+        if (entry.epoch == callableEpoch && entry.methodType && *entry.methodType == value.structType) {
+            return entry.function;
+        }
+        auto def = structDefs.find(value.structType);
+        if (def == structDefs.end()) return nullptr;
+        auto method = def->second.methods.find(tokens[index].value);
+        if (method == def->second.methods.end()) return nullptr;
+        entry.epoch = callableEpoch;
+        entry.methodType = &def->first;
+        entry.function = &method->second;
+        return entry.function;
+    }
+
+    // Reads `name.field` and `name[i]` chains on a plain variable through
+    // its storage, so only the value at the end of the path is copied, not
+    // the aggregate holding it. Stops at the first step it cannot take
+    // without running code (any index other than a literal or a variable)
+    // or that would fail; the caller evaluates the rest as usual. Returns
+    // null, consuming nothing, when the path does not start at a variable.
+    const Value* borrowPath() {
+        if (current + 1 >= tokens.size()) return nullptr;
+        TokenType next = tokens[current + 1].type;
+        if (next != TOKEN_DOT && next != TOKEN_LBRACKET) return nullptr;
+        const std::string& name = tokens[current].value;
+        if (isCallableAt(current)) return nullptr;
+        const Value* node = findVariable(name);
+        if (!node) {
+            auto it = globalVars.find(name);
+            if (it == globalVars.end()) return nullptr;
+            node = &it->second;
+        }
+        current++;
+
+        while (current + 2 < tokens.size()) {
+            const Token& op = tokens[current];
+            if (op.type == TOKEN_DOT && node->type == Value::STRUCT &&
+                tokens[current + 1].type == TOKEN_IDENTIFIER) {
+                const Value* field = structField(*node, current + 1);
+                if (!field) break;
+                node = field;
+                current += 2;
+            } else if (op.type == TOKEN_LBRACKET && node->type == Value::ARRAY &&
+                       current + 3 < tokens.size() && tokens[current + 2].type == TOKEN_RBRACKET) {
+                const Token& indexToken = tokens[current + 1];
+                double index;
+                if (indexToken.type == TOKEN_NUMBER) {
+                    index = tokens.number(current + 1);
+                } else if (indexToken.type == TOKEN_IDENTIFIER && !isCallableAt(current + 1)) {
+                    const Value* indexValue = findVariable(indexToken.value);
+                    if (!indexValue || indexValue->type != Value::NUMBER) break;
+                    index = indexValue->num;
+                } else {
+                    break;
+                }
+                if (!(index >= 0 && index < static_cast<double>(node->array.size()))) break;
+                node = &node->array[static_cast<size_t>(index)];
+                current += 3;
+            } else if (op.type == TOKEN_LBRACKET && node->type == Value::MAP &&
+                       current + 3 < tokens.size() && tokens[current + 2].type == TOKEN_RBRACKET) {
+                const Token& keyToken = tokens[current + 1];
+                const std::string* key;
+                if (keyToken.type == TOKEN_STRING && keyToken.value.find("#{") == std::string::npos) {
+                    key = &keyToken.value;
+                } else if (keyToken.type == TOKEN_IDENTIFIER && !isCallableAt(current + 1)) {
+                    const Value* keyValue = findVariable(keyToken.value);
+                    if (!keyValue || keyValue->type != Value::STRING) break;
+                    key = &keyValue->str;
+                } else {
+                    break;
+                }
+                const Value* found = node->map->find(*key);
+                if (!found) break;
+                node = found;
+                current += 3;
+            } else {
+                break;
+            }
+        }
+        return node;
+    }
+
+    // Evaluates call arguments up to and including the closing ')'.
+    // The arguments after a call's '(', preceded by the receiver of a
+    // method call if there is one.
+    std::vector<Value> callArguments(Value* receiver = nullptr) {
+        std::vector<Value> args;
+        if (peek().type != TOKEN_RPAREN || receiver) args.reserve(4);
+        if (receiver) args.push_back(std::move(*receiver));
+        while (!match(TOKEN_RPAREN)) {
+            args.push_back(expression());
+            if (!match(TOKEN_COMMA)) {
+                expect(TOKEN_RPAREN, "Expected ')' or ',' in function call");
+                break;
+            }
+        }
+        return args;
+    }
+
     Value call() {
-        Value val = primary();
-        
+        Value val;
+        const Value* borrowed = nullptr;
+        if (peek().type == TOKEN_IDENTIFIER) {
+            // `name(...)` naming a user function calls it straight from
+            // the site cache, skipping the builtin and host lookups.
+            if (current + 1 < tokens.size() && tokens[current + 1].type == TOKEN_LPAREN) {
+                if (Function* target = nameSite(current).function) {
+                    size_t site = current;
+                    current += 2;
+                    int callLine = tokens[current - 1].line;
+                    std::vector<Value> args = callArguments();
+                    if (!target->isAsync && args.size() >= target->params.size()) {
+                        val = invokeFunction(*target, std::move(args));
+                    } else {
+                        val = callFunction(tokens[site].value, args, callLine);
+                    }
+                    callSuffix(val);
+                    return val;
+                }
+            }
+            borrowed = borrowPath();
+        }
+        if (borrowed) {
+            val = *borrowed;
+        } else {
+            val = primary();
+        }
+        callSuffix(val);
+        return val;
+    }
+
+    // Applies the calls, indexing and field accesses following a primary.
+    void callSuffix(Value& val) {
         while (true) {
             if (match(TOKEN_LPAREN)) {
                 int callLine = tokens[current - 1].line;
-                std::vector<Value> args;
-                while (!match(TOKEN_RPAREN)) {
-                    args.push_back(expression());
-                    if (!match(TOKEN_COMMA)) {
-                        expect(TOKEN_RPAREN, "Expected ')' or ',' in function call");
-                        break;
-                    }
-                }
+                std::vector<Value> args = callArguments();
                 
                 if (val.type == Value::STRING) {
-                    val = callFunction(val.str, args, callLine);
+                    val = callFunction(val.str, std::move(args), callLine);
                 } else if (val.type == Value::LAMBDA) {
                     val = callLambda(val, args);
                 } else {
@@ -1867,20 +7459,40 @@ public:
                     if (index.type != Value::NUMBER) {
                         throw RuntimeError("Array index must be a number, got " + index.getType(), bracketLine);
                     }
-                    int idx = static_cast<int>(index.num);
-                    if (idx < 0 || idx >= static_cast<int>(val.array.size())) {
+                    int64_t idx = truncateInteger(index);
+                    if (idx < 0 || idx >= static_cast<int64_t>(val.array.size())) {
                         throw RuntimeError("Array index " + std::to_string(idx) + " out of bounds (size: " + std::to_string(val.array.size()) + ")", bracketLine);
                     }
-                    val = val.array[idx];
+                    Value element = std::move(val.array[idx]);
+                    val = std::move(element);
+                } else if (val.type == Value::FLOATS) {
+                    if (index.type != Value::NUMBER) {
+                        throw RuntimeError("Array index must be a number, got " + index.getType(), bracketLine);
+                    }
+                    int64_t idx = truncateInteger(index);
+                    if (idx < 0 || idx >= static_cast<int64_t>(val.floats->size())) {
+                        throw RuntimeError("Array index " + std::to_string(idx) + " out of bounds (size: " + std::to_string(val.floats->size()) + ")", bracketLine);
+                    }
+                    val = Value((*val.floats)[idx]);
                 } else if (val.type == Value::STRING) {
                     if (index.type != Value::NUMBER) {
                         throw RuntimeError("String index must be a number, got " + index.getType(), bracketLine);
                     }
-                    int idx = static_cast<int>(index.num);
-                    if (idx < 0 || idx >= static_cast<int>(val.str.length())) {
+                    int64_t idx = truncateInteger(index);
+                    if (idx < 0 || idx >= static_cast<int64_t>(val.str.length())) {
                         throw RuntimeError("String index " + std::to_string(idx) + " out of bounds (length: " + std::to_string(val.str.length()) + ")", bracketLine);
                     }
                     val = Value(std::string(1, val.str[idx]));
+                } else if (val.type == Value::MAP) {
+                    if (index.type != Value::STRING) {
+                        throw RuntimeError("Map key must be a string, got " + index.getType(), bracketLine);
+                    }
+                    const Value* found = val.map->find(index.str);
+                    if (!found) {
+                        throw RuntimeError("Map has no key '" + index.str + "'", bracketLine);
+                    }
+                    Value element = *found;
+                    val = std::move(element);
                 } else {
                     throw RuntimeError("Cannot index " + val.getType(), bracketLine);
                 }
@@ -1890,10 +7502,41 @@ public:
                     throw ParseError("Expected field name after '.'", dotLine);
                 }
                 Token field = advance();
-                if (val.type == Value::STRUCT) {
-                    auto it = val.structFields.find(field.value);
-                    if (it != val.structFields.end()) {
-                        val = it->second;
+                if (val.type == Value::ITERATOR && peek().type == TOKEN_LPAREN) {
+                    static const char* const iteratorMethods[] = {"map", "filter", "take", "collect", "reduce"};
+                    if (std::find_if(std::begin(iteratorMethods), std::end(iteratorMethods),
+                                     [&](const char* m) { return field.value == m; }) == std::end(iteratorMethods)) {
+                        throw RuntimeError("Iterator has no method '" + field.value + "'", dotLine);
+                    }
+                    advance();
+                    std::vector<Value> args = {val};
+                    while (!match(TOKEN_RPAREN)) {
+                        args.push_back(expression());
+                        if (!match(TOKEN_COMMA)) {
+                            expect(TOKEN_RPAREN, "Expected ')' or ',' in method call");
+                            break;
+                        }
+                    }
+                    val = callFunction(field.value, args, dotLine);
+                } else if (val.type == Value::STRUCT) {
+                    if (Value* found = const_cast<Value*>(structField(val, current - 1))) {
+                        // Move out first: assigning a sub-object of val to val would free it mid-copy.
+                        Value fieldValue = std::move(*found);
+                        val = std::move(fieldValue);
+                    } else if (peek().type == TOKEN_LPAREN) {
+                        const Function* method = structMethod(val, current - 1);
+                        if (!method) {
+                            throw RuntimeError("Struct '" + val.structType + "' has no field or method '" + field.value + "'", dotLine);
+                        }
+                        advance();
+                        std::vector<Value> args = callArguments(&val);
+                        if (args.size() < method->params.size()) {
+                            throw RuntimeError("Method '" + field.value + "' expects " +
+                                               std::to_string(method->params.size() - 1) + " arguments, got " +
+                                               std::to_string(args.size() - 1), dotLine);
+                        }
+                        val = method->isAsync ? startTask(*method, args, dotLine)
+                                              : invokeFunction(*method, std::move(args));
                     } else {
                         throw RuntimeError("Struct '" + val.structType + "' has no field '" + field.value + "'", dotLine);
                     }
@@ -1904,8 +7547,6 @@ public:
                 break;
             }
         }
-        
-        return val;
     }
 
     Value callLambda(const Value& lambda, const std::vector<Value>& args) {
@@ -1914,36 +7555,338 @@ public:
                              " arguments, got " + std::to_string(args.size()), peek().line);
         }
         
-        scopes.push_back(lambda.closureCaptures);
+        charge(1);
+        pushScope(&lambda.closureCaptures);
         
         for (size_t i = 0; i < lambda.lambdaParams.size() && i < args.size(); i++) {
             scopes.back()[lambda.lambdaParams[i]] = args[i];
         }
 
         size_t savedCurrent = current;
-        current = lambda.lambdaBodyStart;
-        bool wasInFunction = inFunction;
-        inFunction = true;
-        hasReturned = false;
-        returnValue = Value();
+        Value result = returnsExpression(tokens, lambda.lambdaBodyStart, lambda.lambdaBodyEnd)
+                           ? evalReturnExpression(lambda.lambdaBodyStart)
+                           : runBody(lambda.lambdaBodyStart, lambda.lambdaBodyEnd);
+        popScope();
+        
+        current = savedCurrent;
+        return result;
+    }
 
-        while (current < lambda.lambdaBodyEnd && !isAtEnd() && !hasReturned) {
-            statement();
+    // map/filter/reduce call one lambda per element. Its frame is pushed
+    // once and rebound for each call; anything a call left behind besides
+    // the parameters is cleared so every call starts from the captures.
+    class LambdaFrame {
+        Interpreter& interp;
+        const Value& lambda;
+        bool exprBody;
+
+    public:
+        LambdaFrame(Interpreter& owner, const Value& fn)
+            : interp(owner), lambda(fn),
+              exprBody(returnsExpression(owner.tokens, fn.lambdaBodyStart, fn.lambdaBodyEnd)) {
+            interp.pushScope(&lambda.closureCaptures);
         }
 
-        Value result = returnValue;
-        hasReturned = false;
-        inFunction = wasInFunction;
-        
-        scopes.pop_back();
-        
-        current = savedCurrent;
+        void close() { interp.popScope(); }
+
+        Value call(std::vector<Value>& args) {
+            if (args.size() < lambda.lambdaParams.size()) {
+                throw RuntimeError("Lambda expects " + std::to_string(lambda.lambdaParams.size()) +
+                                   " arguments, got " + std::to_string(args.size()), interp.peek().line);
+            }
+            interp.charge(1);
+            auto& frame = interp.scopes.back();
+            if (frame.size() > lambda.lambdaParams.size()) frame.clear();
+            for (size_t i = 0; i < lambda.lambdaParams.size(); i++) {
+                frame[lambda.lambdaParams[i]] = std::move(args[i]);
+            }
+            size_t savedCurrent = interp.current;
+            Value result = exprBody ? interp.evalReturnExpression(lambda.lambdaBodyStart)
+                                    : interp.runBody(lambda.lambdaBodyStart, lambda.lambdaBodyEnd);
+            interp.current = savedCurrent;
+            return result;
+        }
+    };
+
+    // A fresh interpreter over the same program. Functions, structs and host
+    // builtins are copied but globals are not, so the two share no script
+    // state and can run on different threads. The deadline, fuel tank and
+    // heap account carry over, so limits hold across spawn and pmap.
+    std::unique_ptr<Interpreter> makeIsolate() const {
+        auto isolate = std::make_unique<Interpreter>(tokens);
+        isolate->functions = functions;
+        isolate->structDefs = structDefs;
+        isolate->hostFunctions = hostFunctions;
+        isolate->callableEpoch++;
+        isolate->tier = tier;
+        isolate->eagerKernels = eagerKernels;
+        isolate->out = out;
+        isolate->err = err;
+        isolate->in = in;
+        if (hasDeadline) {
+            isolate->hasDeadline = isolate->limited = true;
+            isolate->deadline = deadline;
+        }
+        if (fuelLimited) {
+            isolate->fuelLimited = isolate->limited = true;
+            isolate->fuelTank = fuelTank;
+        }
+        isolate->heap = heap;
+        return isolate;
+    }
+
+    // Runs `fn` in its own isolate on a new thread. The returned task
+    // completes, through the event loop, when the thread finishes; values
+    // reach the isolate only as copies (arguments, lambda captures) or
+    // through channels, with builders copied too.
+    Value spawnIsolate(Value fn, std::vector<Value> args, int callLine) {
+        detachBuilders(fn);
+        for (Value& arg : args) detachBuilders(arg);
+        auto task = newHeapObject<TaskState>();
+        auto result = newHeapObject<TaskState>();
+        std::shared_ptr<Interpreter> isolate = makeIsolate();
+        auto body = [isolate, result, fn, args, callLine] {
+            HeapAccountScope accountScope(isolate->heap.get());
+            try {
+                Value value = fn.type == Value::LAMBDA ? isolate->callLambda(fn, args)
+                                                       : isolate->callFunction(fn.str, args, callLine);
+                result->result = isolate->awaitValue(value, callLine);
+#ifdef CHOCO_HAS_EVENT_LOOP
+                isolate->drainEventLoop();
+#endif
+            } catch (const ThrownError& e) {
+                result->failed = result->thrown = true;
+                result->error = e.message;
+                result->errorLine = e.line;
+            } catch (const RuntimeError& e) {
+                result->failed = true;
+                result->error = e.what();
+                result->errorLine = e.line;
+            } catch (const ParseError& e) {
+                result->failed = true;
+                result->error = e.what();
+                result->errorLine = e.line;
+            } catch (const HeapLimitError&) {
+                RuntimeError e = isolate->heapLimitError();
+                result->failed = true;
+                result->error = e.what();
+                result->errorLine = e.line;
+            } catch (const std::exception& e) {
+                result->failed = true;
+                result->error = e.what();
+            }
+        };
+
+#ifdef CHOCO_HAS_EVENT_LOOP
+        int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd < 0) {
+            throw RuntimeError("spawn(): could not create eventfd", callLine);
+        }
+        PendingIo io;
+        io.kind = PendingIo::ISOLATE;
+        io.task = task;
+        io.isolateResult = result;
+        io.reader = std::thread([body, fd]() mutable {
+            {
+                // The isolate and its values must be released while this
+                // thread still counts as running script code.
+                ScriptThreadScope scriptThread;
+                auto run = std::move(body);
+                run();
+            }
+            uint64_t one = 1;
+            ssize_t ignored = write(fd, &one, sizeof(one));
+            (void)ignored;
+        });
+        runtime().unobserved.push_back(task);
+        runtime().watch(fd, std::move(io));
+#else
+        // Without an event loop there is nothing to wake the awaiting side,
+        // so the isolate runs to completion before spawn() returns.
+        std::thread([&body] {
+            ScriptThreadScope scriptThread;
+            body();
+        }).join();
+        *task = *result;
+        task->done = true;
+#endif
+        return taskValue(task);
+    }
+
+    // pmap/pfilter/preduce: the array is split into chunks that run on the
+    // shared pool. Each worker slot gets its own Interpreter context sharing
+    // this program's tokens and declarations; lambdas are expected to be
+    // pure, since every call only sees its own copy of the captures.
+    Value parallelApply(const std::string& name, const std::vector<Value>& args, int callLine) {
+        const std::vector<Value>& items = args[0].array;
+        WorkStealingPool& pool = WorkStealingPool::shared();
+        size_t grain = std::max<size_t>(64, items.size() / (pool.slots() * 8));
+        // Every slot gets lambdas and items with builders of its own.
+        std::vector<Value> lambdas(pool.slots(), name == "preduce" ? args[2] : args[1]);
+        for (Value& copy : lambdas) detachBuilders(copy);
+        const Value& lambda = lambdas.back();
+
+        std::vector<std::unique_ptr<Interpreter>> contexts(pool.slots());
+        auto contextFor = [&](size_t slot) -> Interpreter& {
+            if (slot + 1 == contexts.size()) return *this;
+            if (!contexts[slot]) {
+                contexts[slot] = makeIsolate();
+                contexts[slot]->inTryCatch = inTryCatch;
+            }
+            return *contexts[slot];
+        };
+        // A 'throw' inside a worker's lambda is handed back to this context.
+        auto forwardException = [&] {
+            for (const auto& ctx : contexts) {
+                if (ctx && !ctx->currentException.empty() && currentException.empty()) {
+                    currentException = ctx->currentException;
+                }
+            }
+        };
+
+        try {
+            if (name == "pmap") {
+                std::vector<Value> result(items.size());
+                pool.parallelFor(items.size(), grain, [&](size_t slot, size_t begin, size_t end) {
+                    ScriptThreadScope scriptThread;
+                    HeapAccountScope accountScope(heap.get());
+                    Interpreter& ctx = contextFor(slot);
+                    std::vector<Value> lambdaArgs(1);
+                    for (size_t i = begin; i < end; i++) {
+                        lambdaArgs[0] = items[i];
+                        detachBuilders(lambdaArgs[0]);
+                        result[i] = ctx.callLambda(lambdas[slot], lambdaArgs);
+                    }
+                });
+                forwardException();
+                return Value(result);
+            }
+
+            if (name == "pfilter") {
+                std::vector<char> keep(items.size(), 0);
+                pool.parallelFor(items.size(), grain, [&](size_t slot, size_t begin, size_t end) {
+                    ScriptThreadScope scriptThread;
+                    HeapAccountScope accountScope(heap.get());
+                    Interpreter& ctx = contextFor(slot);
+                    std::vector<Value> lambdaArgs(1);
+                    for (size_t i = begin; i < end; i++) {
+                        lambdaArgs[0] = items[i];
+                        detachBuilders(lambdaArgs[0]);
+                        Value condition = ctx.callLambda(lambdas[slot], lambdaArgs);
+                        keep[i] = condition.type == Value::BOOL && condition.boolean;
+                    }
+                });
+                forwardException();
+                std::vector<Value> result;
+                for (size_t i = 0; i < items.size(); i++) {
+                    if (keep[i]) result.push_back(items[i]);
+                }
+                return Value(result);
+            }
+
+            // preduce: each chunk folds its own range, then the partial
+            // results are combined in order, so the combiner must be associative.
+            size_t chunkCount = (items.size() + grain - 1) / grain;
+            std::vector<Value> partials(chunkCount);
+            pool.parallelFor(items.size(), grain, [&](size_t slot, size_t begin, size_t end) {
+                ScriptThreadScope scriptThread;
+                HeapAccountScope accountScope(heap.get());
+                Interpreter& ctx = contextFor(slot);
+                std::vector<Value> lambdaArgs(2);
+                Value acc = items[begin];
+                detachBuilders(acc);
+                for (size_t i = begin + 1; i < end; i++) {
+                    lambdaArgs[0] = std::move(acc);
+                    lambdaArgs[1] = items[i];
+                    detachBuilders(lambdaArgs[1]);
+                    acc = ctx.callLambda(lambdas[slot], lambdaArgs);
+                }
+                partials[begin / grain] = std::move(acc);
+            });
+            forwardException();
+            Value accumulator = args[1];
+            std::vector<Value> lambdaArgs(2);
+            for (auto& partial : partials) {
+                lambdaArgs[0] = std::move(accumulator);
+                lambdaArgs[1] = std::move(partial);
+                accumulator = callLambda(lambda, lambdaArgs);
+            }
+            return accumulator;
+        } catch (const RuntimeError&) {
+            throw;
+        } catch (const std::exception& e) {
+            throw RuntimeError(name + "(): " + e.what(), callLine);
+        }
+    }
+
+    Value chainIterator(IteratorState::Kind kind, const Value& upstream, const Value& fn, size_t limit) {
+        auto state = newHeapObject<IteratorState>(kind);
+        state->parent = upstream.iterator;
+        state->fn = fn;
+        state->limit = limit;
+        Value result;
+        result.type = Value::ITERATOR;
+        result.iterator = std::move(state);
         return result;
     }
 
+    // Runs the whole stage chain as one fused loop: each source element is
+    // pushed through every map/filter/take stage before the next is read,
+    // so no intermediate arrays are built. sink returns false to stop early.
+    void drainIterator(const IteratorState& it, const std::function<bool(Value&)>& sink) {
+        std::vector<const IteratorState*> stages;
+        const IteratorState* root = &it;
+        while (root->parent) {
+            stages.push_back(root);
+            root = root->parent.get();
+        }
+        std::reverse(stages.begin(), stages.end());
+
+        std::vector<size_t> taken(stages.size(), 0);
+        for (const IteratorState* stage : stages) {
+            if (stage->kind == IteratorState::TAKE && stage->limit == 0) return;
+        }
+
+        std::vector<Value> lambdaArgs(1);
+        bool exhausted = false;
+        auto feed = [&](Value item) {
+            for (size_t k = 0; k < stages.size(); k++) {
+                const IteratorState* stage = stages[k];
+                if (stage->kind == IteratorState::MAP) {
+                    lambdaArgs[0] = std::move(item);
+                    item = callLambda(stage->fn, lambdaArgs);
+                } else if (stage->kind == IteratorState::FILTER) {
+                    lambdaArgs[0] = item;
+                    Value condition = callLambda(stage->fn, lambdaArgs);
+                    if (condition.type != Value::BOOL || !condition.boolean) return !exhausted;
+                } else if (stage->kind == IteratorState::TAKE) {
+                    if (++taken[k] >= stage->limit) exhausted = true;
+                }
+            }
+            return sink(item) && !exhausted;
+        };
+
+        if (root->kind == IteratorState::RANGE) {
+            double step = root->rangeStep;
+            for (double x = root->rangeStart; step > 0 ? x < root->rangeEnd : x > root->rangeEnd; x += step) {
+                if (!feed(Value(x))) return;
+            }
+        } else if (root->source.type == Value::ARRAY) {
+            for (const auto& item : root->source.array) {
+                if (!feed(item)) return;
+            }
+        } else {
+            for (char c : root->source.str) {
+                if (!feed(Value(std::string(1, c)))) return;
+            }
+        }
+    }
+
     Value primary() {
         if (match(TOKEN_NUMBER)) {
-            return Value(std::stod(tokens[current - 1].value));
+            double parsed = tokens.number(current - 1);
+            if (std::fabs(parsed) < EXACT_INTEGER_LIMIT) return Value(parsed);
+            return numberLiteral(tokens[current - 1].value, parsed);
         }
         if (match(TOKEN_STRING)) {
             std::string str = tokens[current - 1].value;
@@ -2001,8 +7944,11 @@ public:
             
             for (int i = scopes.size() - 1; i >= 0; i--) {
                 for (const auto& var : scopes[i]) {
-                    if (lambda.closureCaptures.find(var.first) == lambda.closureCaptures.end()) {
-                        lambda.closureCaptures[var.first] = var.second;
+                    lambda.closureCaptures.emplace(var.first, var.second);
+                }
+                if (const auto* captures = captureLayers[i]) {
+                    for (const auto& var : *captures) {
+                        lambda.closureCaptures.emplace(var.first, var.second);
                     }
                 }
             }
@@ -2011,6 +7957,33 @@ public:
             return lambda;
         }
         
+        // `{key: value, ...}`; a bare identifier key is its own name.
+        if (match(TOKEN_LBRACE)) {
+            Value map = mapValue(newHeapObject<MapTable>());
+            while (!match(TOKEN_RBRACE)) {
+                std::string key;
+                if (peek().type == TOKEN_IDENTIFIER && current + 1 < tokens.size() &&
+                    tokens[current + 1].type == TOKEN_COLON) {
+                    key = advance().value;
+                } else {
+                    int keyLine = peek().line;
+                    Value keyValue = expression();
+                    if (keyValue.type != Value::STRING) {
+                        throw RuntimeError("Map key must be a string, got " + keyValue.getType(), keyLine);
+                    }
+                    key = std::move(keyValue.str);
+                }
+                expect(TOKEN_COLON, "Expected ':' after map key");
+                Value entry = expression();
+                map.map->insert(key) = std::move(entry);
+                if (!match(TOKEN_COMMA)) {
+                    expect(TOKEN_RBRACE, "Expected '}' or ',' in map literal");
+                    break;
+                }
+            }
+            return map;
+        }
+
         if (match(TOKEN_LBRACKET)) {
             std::vector<Value> arr;
             while (!match(TOKEN_RBRACKET)) {
@@ -2051,7 +8024,7 @@ public:
                 return structVal;
             }
             
-            if (functions.find(name) != functions.end() || isBuiltinFunction(name)) {
+            if (isCallableAt(current - 1)) {
                 return Value(name);
             }
             
@@ -2070,14 +8043,21 @@ public:
 
 const std::unordered_map<std::string, bool> Interpreter::builtinFunctions = {
     {"len", true}, {"push", true}, {"pop", true},
+    {"keys", true}, {"values", true}, {"has", true}, {"remove", true},
     {"sqrt", true}, {"pow", true}, {"abs", true},
     {"floor", true}, {"ceil", true}, {"round", true},
     {"min", true}, {"max", true}, {"random", true}, {"random_int", true},
+    {"floats", true}, {"vsum", true}, {"vdot", true}, {"vscale", true}, {"vadd", true}, {"vmul", true},
     {"str", true}, {"int", true}, {"float", true},
     {"uppercase", true}, {"lowercase", true}, {"substr", true},
-    {"split", true}, {"join", true},
+    {"split", true}, {"join", true}, {"builder", true}, {"append", true}, {"build", true},
     {"read_file", true}, {"write_file", true}, {"append_file", true}, {"file_exists", true},
     {"map", true}, {"filter", true}, {"reduce", true}, {"typeof", true},
+    {"range", true}, {"iter", true}, {"take", true}, {"collect", true},
+    {"pmap", true}, {"pfilter", true}, {"preduce", true},
+    {"sleep", true}, {"read_file_async", true}, {"exec_async", true},
+    {"snapshot", true}, {"spawn", true}, {"channel", true}, {"chan_send", true}, {"chan_recv", true}, {"chan_close", true},
+    {"gc", true}, {"gc_stats", true}, {"gc_tune", true},
     {"input", true}, {"gui_init", true}, {"gui_window", true}, {"gui_button", true},
     {"gui_label", true}, {"gui_entry", true}, {"gui_box", true},
     {"gui_add", true}, {"gui_set_text", true}, {"gui_get_text", true},
@@ -2094,6 +8074,57 @@ static Value interpreterCallbackWrapper(Interpreter* interp, const std::string&
 }
 #endif
 
+#if defined(CHOCO_HAS_JIT) && !defined(CHOCO_EMBEDDED_MODE)
+// Output and errors of running `path` on `tier` (compiling everything at
+// first use), with no input and a fixed seed. Each run gets a process of
+// its own, since the cycle collector's counters are process-wide.
+static std::string verifyOutput(const char* path, ExecutionTier tier) {
+    int fds[2];
+    if (pipe(fds) != 0) return "[pipe failed]";
+    std::cout.flush();
+    pid_t child = fork();
+    if (child == 0) {
+        close(fds[0]);
+        std::ostringstream output;
+        std::istringstream input;
+        std::ifstream script(path);
+        std::stringstream source;
+        source << script.rdbuf();
+        try {
+            if (!script) throw std::runtime_error(std::string("Could not open file '") + path + "'");
+            Lexer lexer(source.str());
+            Interpreter interpreter(Interpreter::optimizeTokens(lexer.tokenize()));
+            interpreter.tier = tier;
+            interpreter.eagerKernels = tier != TIER_INTERPRET;
+            interpreter.setOutput(output);
+            interpreter.setErrorOutput(output);
+            interpreter.setInput(input);
+            interpreter.seedRandom(0);
+            interpreter.execute();
+        } catch (const std::exception& e) {
+            output << "\n[" << e.what() << "]";
+        }
+        std::string text = output.str();
+        for (size_t sent = 0; sent < text.size();) {
+            ssize_t n = write(fds[1], text.data() + sent, text.size() - sent);
+            if (n <= 0) break;
+            sent += n;
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+    std::string text;
+    char buffer[4096];
+    ssize_t got;
+    while ((got = read(fds[0], buffer, sizeof(buffer))) > 0) text.append(buffer, got);
+    close(fds[0]);
+    int status = 0;
+    if (child > 0) waitpid(child, &status, 0);
+    if (child < 0 || !WIFEXITED(status)) text += "\n[crashed]";
+    return text;
+}
+#endif
+
 #ifndef CHOCO_EMBEDDED_MODE
 int main(int argc, char* argv[]) {
     // Check for compile command
@@ -2135,6 +8166,7 @@ int main(int argc, char* argv[]) {
         std::cout << std::endl;
         
         std::vector<Token> emptyTokens;
+        ScriptThreadScope scriptThread;
         Interpreter repl(emptyTokens);
         std::string line;
         int lineNumber = 1;
@@ -2221,19 +8253,19 @@ int main(int argc, char* argv[]) {
             
             try {
                 Lexer lexer(line);
-                std::vector<Token> tokens = lexer.tokenize();
+                std::vector<Token> tokens = Interpreter::optimizeTokens(lexer.tokenize(), false);
                 
                 size_t savedCurrent = repl.current;
-                std::vector<Token> savedTokens = std::move(repl.tokens);
+                TokenStream savedTokens = repl.tokens;
                 
-                repl.tokens = std::move(tokens);
+                repl.tokens = TokenStream(std::move(tokens));
                 repl.current = 0;
                 
                 while (!repl.isAtEnd()) {
                     repl.statement();
                 }
                 
-                repl.tokens = std::move(savedTokens);
+                repl.tokens = savedTokens;
                 repl.current = savedCurrent;
                 
             } catch (const LexerError& e) {
@@ -2254,15 +8286,95 @@ int main(int argc, char* argv[]) {
         return 0;
     }
     
-    if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " [file.choco]" << std::endl;
+    // Execution limits: --fuel <units> caps loop iterations plus calls,
+    // --timeout <ms> caps wall-clock time, --max-heap <bytes> caps memory.
+    // --jit compiles numeric kernels on to machine code.
+    int argi = 1;
+    long long fuelLimit = -1;
+    long long timeoutMs = -1;
+    long long heapLimit = -1;
+    ExecutionTier tier = TIER_KERNELS;
+    while (argi < argc) {
+        std::string option = argv[argi];
+        if (option == "--jit") {
+            tier = TIER_JIT;
+            argi++;
+            continue;
+        }
+        if (argi + 1 >= argc || (option != "--fuel" && option != "--timeout" && option != "--max-heap")) break;
+        long long amount = std::atoll(argv[argi + 1]);
+        if (option == "--fuel") {
+            fuelLimit = amount;
+        } else if (option == "--timeout") {
+            timeoutMs = amount;
+        } else {
+            heapLimit = amount;
+        }
+        argi += 2;
+    }
+    auto applyLimits = [&](Interpreter& interpreter) {
+        interpreter.tier = tier;
+        if (fuelLimit >= 0) interpreter.setFuel(static_cast<uint64_t>(fuelLimit));
+        if (timeoutMs >= 0) interpreter.setDeadline(std::chrono::milliseconds(timeoutMs));
+        if (heapLimit > 0) interpreter.setHeapLimit(static_cast<size_t>(heapLimit));
+    };
+
+    if (argi >= argc) {
+        std::cerr << "Usage: " << argv[0] << " [--fuel N] [--timeout MS] [--max-heap BYTES] [--jit] [file.choco]" << std::endl;
+        std::cerr << "       " << argv[0] << " [limits] --restore <file.snap>" << std::endl;
+#ifdef CHOCO_HAS_JIT
+        std::cerr << "       " << argv[0] << " --jit-verify <file.choco>..." << std::endl;
+#endif
         std::cerr << "       " << argv[0] << "              (for REPL mode)" << std::endl;
         return 1;
     }
 
-    std::ifstream file(argv[1]);
+#ifdef CHOCO_HAS_JIT
+    // Differential check of the compiled tiers: each script runs once
+    // interpreted and once with every function and loop compiled to native
+    // code at first use, and the two outputs must match.
+    if (std::string(argv[argi]) == "--jit-verify") {
+        bool allSame = true;
+        for (int i = argi + 1; i < argc; i++) {
+            bool same = verifyOutput(argv[i], TIER_INTERPRET) == verifyOutput(argv[i], TIER_JIT);
+            std::cout << (same ? "ok       " : "MISMATCH ") << argv[i] << std::endl;
+            allSame = allSame && same;
+        }
+        return allSame ? 0 : 1;
+    }
+#endif
+
+    // Resume a program from a file written by snapshot(), skipping
+    // everything that ran before it.
+    if (std::string(argv[argi]) == "--restore") {
+        if (argi + 1 >= argc) {
+            std::cerr << "Usage: " << argv[0] << " --restore <file.snap>" << std::endl;
+            return 1;
+        }
+        try {
+            Interpreter interpreter(std::vector<Token>{});
+            try {
+                interpreter.restoreSnapshot(argv[argi + 1]);
+            } catch (const RuntimeError& e) {
+                std::cerr << "Error: " << e.what() << std::endl;
+                return 1;
+            }
+            applyLimits(interpreter);
+
+            ChocoGUI* gui = ChocoGUI::getInstance(argc, argv);
+            gui->setCallbackFunction(interpreterCallbackWrapper);
+            gui->setInterpreter(&interpreter);
+
+            interpreter.execute();
+            return 0;
+        } catch (...) {
+            return 1;
+        }
+    }
+
+    std::ifstream file(argv[argi]);
     if (!file) {
-        std::cerr << "Error: Could not open file '" << argv[1] << "'" << std::endl;
+        std::cerr << "Error: Could not open file '" << argv[argi] << "'" << std::endl;
         return 1;
     }
 
@@ -2272,9 +8384,10 @@ int main(int argc, char* argv[]) {
 
     try {
         Lexer lexer(source);
-        std::vector<Token> tokens = lexer.tokenize();
+        std::vector<Token> tokens = Interpreter::optimizeTokens(lexer.tokenize());
 
         Interpreter interpreter(tokens);
+        applyLimits(interpreter);
 
         ChocoGUI* gui = ChocoGUI::getInstance(argc, argv);
         gui->setCallbackFunction(interpreterCallbackWrapper);
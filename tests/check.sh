@@ -0,0 +1,174 @@
+#!/bin/sh
+# Checks that test.choco can't make on its own: scripts that must stop
+# with an error, and the embedding API host.
+# Usage, from anywhere: tests/check.sh
+# Set COCOA to the interpreter built from this tree (default ./cocoa,
+# relative to the repository root) and CXX to pick the compiler.
+
+cd "$(dirname "$0")/.." || exit 1
+COCOA=$(cd "$(dirname "${COCOA:-./cocoa}")" && pwd)/$(basename "${COCOA:-./cocoa}")
+CXX=${CXX:-g++}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+failures=0
+
+fail() {
+    echo "FAIL: $1"
+    failures=$((failures + 1))
+}
+
+# expect_failure NAME TEXT COMMAND...
+# Runs the command in the scratch directory; it must fail, in time, with
+# TEXT in its output.
+expect_failure() {
+    name=$1
+    expected=$2
+    shift 2
+    output=$(cd "$WORK" && timeout 30 "$@" 2>&1 < /dev/null)
+    status=$?
+    if [ "$status" -eq 0 ] || [ "$status" -eq 124 ]; then
+        fail "$name: exited with $status"
+    fi
+    case "$output" in
+        *"$expected"*) ;;
+        *) fail "$name: expected '$expected', got: $output" ;;
+    esac
+}
+
+# expect_error NAME TEXT [OPTION...] < script
+# Runs the script with the options; it must fail with TEXT in its output.
+expect_error() {
+    label=$1
+    text=$2
+    shift 2
+    cat > "$WORK/$label.choco"
+    expect_failure "$label" "$text" "$COCOA" "$@" "$label.choco"
+}
+
+# Integers
+expect_error int-add-overflow "Integer overflow" <<'EOF'
+let top = 9223372036854775807;
+print top + 1;
+EOF
+expect_error int-sub-overflow "Integer overflow" <<'EOF'
+let bottom = -9223372036854775807 - 1;
+print bottom - 1;
+EOF
+expect_error int-mul-overflow "Integer overflow" <<'EOF'
+print 3037000500 * 3037000500;
+EOF
+
+# Kernels that meet an error hand back to the interpreter, which raises it.
+for tier in "" --jit; do
+    expect_error "kernel-divide$tier" "Division by zero" $tier <<'EOF'
+fn share(total, cups) { return total / cups; }
+let poured = 0;
+for cup in 1..20 { poured = poured + share(100, cup); }
+print share(100, 0);
+EOF
+    expect_error "kernel-overflow$tier" "Integer overflow" $tier <<'EOF'
+let grains = 1;
+let doublings = 0;
+while (doublings < 64) {
+    grains = grains * 2;
+    doublings = doublings + 1;
+}
+EOF
+done
+
+# Limits. Isolates and parallel workers draw on the caller's fuel: each
+# of these fits the budget alone, but not all together.
+expect_error fuel-loop "Out of fuel" --fuel 10000 <<'EOF'
+while (true) {}
+EOF
+expect_error fuel-isolates "Out of fuel" --fuel 100000 <<'EOF'
+fn spin(n) { let i = 0; while (i < n) { i = i + 1; } return i; }
+let a = spawn("spin", 40000);
+let b = spawn("spin", 40000);
+let c = spawn("spin", 40000);
+print await a + await b + await c;
+EOF
+expect_error fuel-pmap "Out of fuel" --fuel 50000 <<'EOF'
+let cups = range(0, 2000).collect();
+print len(pmap(cups, |x| => { let i = 0; while (i < 40) { i = i + 1; } return i; }));
+EOF
+expect_error timeout-loop "Deadline exceeded" --timeout 100 <<'EOF'
+fn spin() { while (true) {} }
+spin();
+EOF
+expect_error timeout-isolate "Deadline exceeded" --timeout 100 <<'EOF'
+fn spin() { while (true) {} }
+print await spawn("spin");
+EOF
+expect_error heap-loop "Heap limit of 1000000 bytes exceeded" --max-heap 1000000 <<'EOF'
+let pile = [];
+while (true) { pile = push(pile, "beans in the hopper"); }
+EOF
+expect_error heap-isolate "Heap limit of 2000000 bytes exceeded" --max-heap 2000000 <<'EOF'
+fn hoard(n) { let pile = []; for i in 0..n { pile = push(pile, "#{i} beans"); } return len(pile); }
+print await spawn("hoard", 1000000);
+EOF
+
+# Snapshots: a restored run prints what the rest of the original did.
+cat > "$WORK/snapshot.choco" <<'EOF'
+struct Order { drink, shots }
+impl Order {
+    fn strength(self) { return self.shots * 10; }
+}
+fn total(orders) { return reduce(orders, 0, |acc, o| => { return acc + o.strength(); }); }
+let menu = {espresso: 2, "flat white": 4};
+let orders = [Order { drink: "espresso", shots: 2 }, Order { drink: "mocha", shots: 1 }];
+let bump = 3;
+let extra = |x| => { return x + bump; };
+let prices = floats([1.5, 2.25]);
+let big = 9007199254740993;
+print "before";
+snapshot("snapshot.snap");
+menu["mocha"] = 5;
+print menu;
+print total(orders);
+print extra(4);
+print vsum(prices);
+print big + 2;
+print orders[1].drink;
+EOF
+if (cd "$WORK" && "$COCOA" snapshot.choco > full.txt 2>&1 &&
+        "$COCOA" --restore snapshot.snap > restored.txt 2>&1); then
+    if [ ! -s "$WORK/restored.txt" ] || ! tail -n +2 "$WORK/full.txt" | cmp -s - "$WORK/restored.txt"; then
+        fail "snapshot: restored run printed something else"
+    fi
+else
+    fail "snapshot: round trip exited with an error"
+fi
+
+expect_error snapshot-iterator "cannot save a iterator" <<'EOF'
+let beans = iter([1, 2]);
+snapshot("iterator.snap");
+EOF
+expect_error snapshot-task "cannot save a task" <<'EOF'
+async fn brew() { return 1; }
+let cup = brew();
+snapshot("task.snap");
+EOF
+expect_error snapshot-channel "cannot save a channel" <<'EOF'
+let pipe = channel(2);
+snapshot("channel.snap");
+EOF
+
+# The version is the u32 after the 8-byte magic.
+printf '\377' | dd of="$WORK/snapshot.snap" bs=1 seek=8 conv=notrunc 2> /dev/null
+expect_failure snapshot-version "written by a different version" "$COCOA" --restore snapshot.snap
+
+# Embedding API
+if $CXX -std=c++17 -O1 -pthread -DCHOCO_HEAP_ACCOUNTING -o "$WORK/embed_test" \
+        tests/embed_test.cpp choco_embed.cpp; then
+    (cd "$WORK" && ./embed_test) || fail "embed_test"
+else
+    fail "embed_test did not build"
+fi
+
+if [ "$failures" -ne 0 ]; then
+    echo "$failures check(s) failed"
+    exit 1
+fi
+echo "all checks passed"
@@ -0,0 +1,141 @@
+//////////////////////////////////////
+// CacaoLang Embedding API checks
+// Built and run by tests/check.sh:
+//   g++ -std=c++17 -pthread -DCHOCO_HEAP_ACCOUNTING -o embed_test
+//       tests/embed_test.cpp choco_embed.cpp
+// Prints each failed check and exits nonzero if any failed.
+//////////////////////////////////////
+
+#include "../choco_embed.h"
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const std::string& what) {
+    if (!ok) {
+        std::cerr << "FAIL: " << what << std::endl;
+        failures++;
+    }
+}
+
+void checkEqual(const Value& actual, const std::string& expected, const std::string& what) {
+    check(actual.toString() == expected, what + ": expected " + expected + ", got " + actual.toString());
+}
+
+const char* SCRIPT = R"(
+let threshold = 10;
+let hits = 0;
+let log = builder();
+
+fn check(x) {
+    hits = hits + 1;
+    return x * factor() > threshold;
+}
+fn count() { return hits; }
+fn note(s) { append(log, s, ";"); return build(log); }
+fn greet(name) { print "hello #{name}"; }
+fn fail(x) { return missing(x); }
+fn hoard(n) {
+    let pile = [];
+    for i in 0..n { pile = push(pile, "#{i} beans in the hopper"); }
+    return len(pile);
+}
+fn spin() { while (true) {} }
+async fn later(x) { await sleep(1); return x * 2; }
+)";
+
+Value factor(const std::vector<Value>&) { return Value(2.0); }
+
+}
+
+int main() {
+    auto program = choco::Program::compile(SCRIPT, {{"factor", factor}});
+    check(program->hasFunction("check"), "hasFunction finds a script function");
+    check(!program->hasFunction("nope"), "hasFunction rejects unknown names");
+
+    // call, global and setGlobal
+    choco::Context ctx(program);
+    checkEqual(ctx.call("check", {Value(3.0)}), "false", "call with a host builtin");
+    checkEqual(ctx.call("check", {Value(6.0)}), "true", "second call");
+    checkEqual(ctx.global("hits"), "2", "global sees script writes");
+    ctx.setGlobal("threshold", Value(100.0));
+    checkEqual(ctx.call("check", {Value(6.0)}), "false", "setGlobal is seen by the script");
+    checkEqual(ctx.call("later", {Value(21.0)}), "42", "async functions are awaited");
+
+    // Errors leave the context usable.
+    try {
+        ctx.call("fail", {Value(1.0)});
+        check(false, "calling an undefined function throws");
+    } catch (const choco::ScriptError& e) {
+        check(e.line > 0, "ScriptError carries a line");
+    }
+    checkEqual(ctx.call("count"), "3", "context usable after an error");
+
+    // reset restores the Program's globals.
+    ctx.reset();
+    checkEqual(ctx.global("hits"), "0", "reset restores globals");
+    checkEqual(ctx.global("threshold"), "10", "reset undoes setGlobal");
+
+    // Output goes to the stream the host chose.
+    std::ostringstream captured;
+    ctx.setOutput(captured);
+    ctx.call("greet", {Value(std::string("host"))});
+    check(captured.str() == "hello host\n", "setOutput captures print");
+
+    // Contexts of one Program do not share builders.
+    choco::Context a(program), b(program);
+    a.call("note", {Value(std::string("from-a"))});
+    checkEqual(b.call("note", {Value(std::string("from-b"))}), "from-b;", "builders are per context");
+    b.reset();
+    checkEqual(b.call("note", {Value(std::string("again"))}), "again;", "reset restores builders");
+    checkEqual(a.call("note", {Value(std::string("a2"))}), "from-a;a2;", "other context keeps its builder");
+
+    // Limits
+    choco::Context limited(program);
+    limited.setFuel(1000);
+    try {
+        limited.call("spin");
+        check(false, "fuel stops a runaway loop");
+    } catch (const choco::LimitExceeded&) {
+    }
+    limited.clearLimits();
+    limited.setTimeout(std::chrono::milliseconds(20));
+    try {
+        limited.call("spin");
+        check(false, "timeout stops a runaway loop");
+    } catch (const choco::LimitExceeded&) {
+    }
+    limited.clearLimits();
+
+    limited.setHeapLimit(64 * 1024);
+    try {
+        limited.call("hoard", {Value(100000.0)});
+        check(false, "heap limit stops a growing array");
+    } catch (const choco::LimitExceeded&) {
+        check(false, "heap limit raises ScriptError, not LimitExceeded");
+    } catch (const choco::ScriptError& e) {
+        check(std::string(e.what()).find("Heap limit") != std::string::npos, "heap limit error names the limit");
+    }
+    check(limited.heapPeakBytes() > 0, "heap counters are kept");
+    limited.setHeapLimit(0);
+    checkEqual(limited.call("hoard", {Value(10.0)}), "10", "context usable after the heap limit");
+
+    // load reads a script from disk.
+    const char* path = "embed_test_script.choco";
+    {
+        std::ofstream file(path);
+        file << "fn twice(x) { return x * 2; }\n";
+    }
+    auto loaded = choco::Program::load(path);
+    std::remove(path);
+    choco::Context fromFile(loaded);
+    checkEqual(fromFile.call("twice", {Value(8.0)}), "16", "Program::load");
+
+    if (failures == 0) std::cout << "embed_test: ok" << std::endl;
+    return failures == 0 ? 0 : 1;
+}